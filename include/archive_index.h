@@ -0,0 +1,24 @@
+#ifndef ARCHIVE_INDEX_H
+#define ARCHIVE_INDEX_H 1
+
+/*
+ * The pages we have archived, by their path relative
+ * to the archive directory, so that checking whether
+ * we already have a page doesn't need a syscall.
+ * Loaded by walking the archive directory at startup
+ * and kept up to date as pages are archived.
+ */
+int archive_index_load(const char *) __nonnull((1)) __wur;
+void archive_index_add(const char *) __nonnull((1));
+int archive_index_has(const char *) __nonnull((1)) __wur;
+void archive_index_destroy(void);
+
+/*
+ * Bodies we only have the start of are kept beside
+ * where they will go, with these suffixes, until the
+ * rest has been fetched.
+ */
+#define PARTIAL_SUFFIX ".part"
+#define PARTIAL_INFO_SUFFIX ".part-info"
+
+#endif /* !defined ARCHIVE_INDEX_H */
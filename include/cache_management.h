@@ -13,7 +13,7 @@ void Redirected_URL_cache_dtor(void *);
 int URL_cache_ctor(void *);
 void URL_cache_dtor(void *);
 
-Dead_URL_t *search_dead_URL(cache_t *, const char *);
-void cache_dead_URL(cache_t *, const char *, int);
+Dead_URL_t *search_dead_URL(cache_t *, url_id_t);
+void cache_dead_URL(cache_t *, url_id_t, int);
 
 #endif /* !defined __CACHE_MANAGEMENT_H__ */
@@ -0,0 +1,27 @@
+#ifndef CONTENT_STORE_H
+#define CONTENT_STORE_H 1
+
+#include <stddef.h>
+#include "http.h"
+
+/*
+ * Archived files by the SHA-256 of their contents. Each
+ * distinct body is linked in once, as
+ * <archive>/.objects/<first 2 hex digits>/<the other 62>,
+ * and any other page with the same body is made a hard
+ * link to it (or a reflink, if it has too many links)
+ * rather than another copy.
+ */
+#define CONTENT_STORE_DIR ".objects"
+#define CONTENT_DIGEST_LEN HTTP_DIGEST_LEN
+
+int content_store_load(const char *) __nonnull((1)) __wur;
+int content_store_link(const unsigned char *, const char *, size_t) __nonnull((1,2)) __wur;
+int content_store_adopt(const unsigned char *, const char *) __nonnull((1,2)) __wur;
+size_t content_store_bytes_saved(void);
+void content_store_destroy(void);
+
+int content_digest(const void *, size_t, unsigned char *) __nonnull((1,3)) __wur;
+int content_digest_file(const char *, unsigned char *) __nonnull((1,2)) __wur;
+
+#endif /* !defined CONTENT_STORE_H */
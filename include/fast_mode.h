@@ -6,6 +6,15 @@
 
 #define FAST_MODE_NR_WORKERS 8
 
+/*
+ * No more than this many workers fetch assets at once;
+ * the rest are left for pages. The first this many
+ * workers take assets first, the others only when
+ * asset_due() says so.
+ */
+#define FAST_MODE_NR_ASSET_WORKERS 2
+#define FAST_MODE_ASSET_WAIT_USEC 50000 /* when only assets are queued and they're all taken */
+
 int do_fast_mode(char *) __nonnull((1)) __wur;
 
 #endif /* !defined FAST_MODE_H */
@@ -10,6 +10,7 @@
 
 #define HTTP_SWITCHING_PROTOCOLS 101u // for successful upgrade to HTTP 2.0
 #define HTTP_OK 200u
+#define HTTP_PARTIAL_CONTENT 206u // the range we asked for
 #define HTTP_MOVED_PERMANENTLY 301u
 #define HTTP_FOUND 302u // the URI is being temporarily redirected
 #define HTTP_SEE_OTHER 303u
@@ -34,7 +35,9 @@
 #define HTTP_COOKIE_MAX 2048 /* Surely this is more than enough */
 #define HTTP_HNAME_MAX 64 /* Header name */
 #define HTTP_HOST_MAX 256
+#define HTTP_DIGEST_LEN 32 /* SHA-256 */
 #define HTTP_HEADER_FIELD_MAX_LENGTH 2048
+#define HTTP_VALIDATOR_MAX 256 /* ETag or Last-Modified value we'll keep for If-Range */
 
 #define HTTP_VERSION		"1.1"
 #define HTTP_USER_AGENT		"Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:75.0) Gecko/20100101 Firefox/75.0"
@@ -45,6 +48,20 @@
 #define HTTP_DEFAULT_READ_BUF_SIZE	32768
 #define HTTP_DEFAULT_WRITE_BUF_SIZE	4096
 
+/*
+ * Values SINK_OPEN can return instead of a file descriptor.
+ * The body is either kept in the read buffer as usual, or
+ * read from the socket and thrown away.
+ */
+#define HTTP_SINK_MEMORY	-1
+#define HTTP_SINK_DISCARD	-2
+
+/*
+ * Most body data we hold in the read buffer before
+ * writing it out to the sink.
+ */
+#define HTTP_SINK_BLOCK		65536
+
 #define HTTP_PORT	80
 #define HTTPS_PORT	443
 
@@ -90,6 +107,8 @@ struct conn
 	int ssl_nonblocking;
 	char *host_ipv4;
 	SSL_CTX *ssl_ctx;
+	int ktls_send; /* kernel is doing the TLS record encryption */
+	int ktls_recv; /* ...and decryption, so plaintext can be spliced from the socket */
 };
 
 enum request
@@ -116,6 +135,65 @@ struct http_t
 
 	size_t URL_len;
 
+/*
+ * IDs the crawler gave URL and HOST in its URL arena,
+ * or 0 if not known. Cleared whenever we change URL
+ * ourselves (e.g. to follow a redirect).
+ */
+	uint32_t URL_id;
+	uint32_t host_id;
+
+/*
+ * Links the crawler followed from its first page
+ * to get to URL; kept across redirects.
+ */
+	uint16_t depth;
+
+/*
+ * If set, called once the header of a 200 response
+ * to a GET has been received. It returns a file
+ * descriptor that the body is written to as it
+ * arrives, or one of the HTTP_SINK_* values.
+ * SINK_CLOSE is then called with the descriptor
+ * and whether the transfer failed.
+ */
+	int (*sink_open)(struct http_t *);
+	void (*sink_close)(struct http_t *, int, int);
+	int sink_fd;
+	int body_sunk; /* body of the last response went to the sink, not the read buffer */
+
+/*
+ * If DIGEST_SINK is set, the body of a 200 response
+ * is hashed with SHA-256 on its way to a sink file.
+ * When SINK_CLOSE is called, BODY_DIGEST holds the
+ * hash if BODY_DIGEST_VALID; it isn't if the body
+ * went straight from the socket to the file with
+ * splice(), since we never saw it.
+ */
+	int digest_sink;
+	unsigned char body_digest[HTTP_DIGEST_LEN];
+	int body_digest_valid;
+
+/*
+ * If set, called with each block of the body of a 200
+ * response as it is received into the read buffer (so
+ * not for bodies that went to the sink). Chunked bodies
+ * are passed on already decoded.
+ */
+	void (*recv_block)(struct http_t *, char *, size_t);
+	void *hook_data; /* for the caller's hooks */
+
+/*
+ * Set before sending a GET to ask for the body from
+ * byte RESUME_FROM onwards if it is still the version
+ * that RESUME_VALIDATOR (an ETag or Last-Modified date)
+ * identifies. Cleared once the response is received.
+ * The server replies 206 if it honoured the range, or
+ * 200 with the whole body if not.
+ */
+	off_t resume_from;
+	char resume_validator[HTTP_VALIDATOR_MAX];
+
 	struct HTTP_methods *ops;
 };
 
@@ -137,7 +215,21 @@ size_t httpslen;
 struct http_t *HTTP_new(uint32_t) __wur;
 void HTTP_delete(struct http_t *) __nonnull((1));
 
-void http_check_host(struct http_t *) __nonnull((1));
+int http_check_host(struct http_t *) __nonnull((1)) __wur;
+
+/*
+ * The redirects map is shared by all HTTP objects.
+ * These save/restore it between sessions.
+ */
+int HTTP_redirects_save(const char *) __nonnull((1));
+int HTTP_redirects_load(const char *) __nonnull((1));
+
+/*
+ * Limit the rate (bytes per second) at which response
+ * data is taken off the wire, across all HTTP objects
+ * and for each remote host. 0 means no limit.
+ */
+void HTTP_set_rate_limits(size_t, size_t);
 
 /*
  * Connection-related functions
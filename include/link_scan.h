@@ -0,0 +1,127 @@
+#ifndef LINK_SCAN_H
+#define LINK_SCAN_H 1
+
+#include <pthread.h>
+#include "buffer.h"
+#include "http.h"
+#include "netwasabi.h"
+#include "queue.h"
+
+/*
+ * Finds the URLs in a document that arrives in pieces.
+ * Each block is scanned once; a partially matched
+ * href="... (or a URL that runs over the end of the
+ * block) carries over to the next one.
+ */
+struct link_scanner
+{
+	size_t matched[NR_URL_TYPES]; /* bytes of url_types[i].string matched so far */
+	int in_url; /* index into url_types of the URL being collected, -1 if none */
+	int too_long; /* URL being collected has gone over HTTP_URL_MAX */
+	size_t off; /* offset in the document of the next block */
+	size_t url_off; /* offset in the document of the URL being collected */
+	buf_t url;
+	void (*found)(struct link_scanner *, buf_t *);
+	void *arg;
+};
+
+int link_scanner_init(struct link_scanner *, void (*)(struct link_scanner *, buf_t *), void *) __nonnull((1,2)) __wur;
+void link_scanner_reset(struct link_scanner *) __nonnull((1));
+void link_scanner_feed(struct link_scanner *, char *, size_t) __nonnull((1,2));
+void link_scanner_destroy(struct link_scanner *) __nonnull((1));
+
+/*
+ * A link found in a document that is already all in
+ * memory: the URL is LEN bytes at offset OFF, and is
+ * closed by DELIM.
+ */
+struct link_span
+{
+	size_t off;
+	size_t len;
+	char delim;
+};
+
+int link_span_next(const char *, size_t, size_t *, struct link_span *) __nonnull((1,3,4)) __wur;
+
+/*
+ * The links in a document, found and resolved once so
+ * that queuing them and rewriting them to point at the
+ * archive don't each have to do it again.
+ *
+ * The full URL and local path of each link are kept,
+ * null terminated, in STRINGS; use link_full_url()
+ * and link_local_path() to get at them.
+ *
+ * The table is filled in either by link_table_build()
+ * once the document is all in memory, or one link at a
+ * time by a link stream as the document arrives.
+ */
+struct link
+{
+	size_t off; /* where the URL is in the document */
+	size_t len;
+	size_t full_off; /* offset in STRINGS of the full URL */
+	size_t full_len; /* 0 if we won't follow the link */
+	url_id_t id; /* of the full URL in the URL arena */
+	size_t local_off;
+	size_t local_len; /* 0 if we won't rewrite the link */
+};
+
+struct link_table
+{
+	struct link *links;
+	int nr_links;
+	int nr_allocated;
+	buf_t strings;
+	buf_t doc; /* the document's own name in the archive */
+	buf_t full; /* for working out each link */
+	buf_t name;
+	buf_t path;
+};
+
+#define link_full_url(t, l) ((t)->strings.buf_head + (l)->full_off)
+#define link_local_path(t, l) ((t)->strings.buf_head + (l)->local_off)
+
+int link_table_init(struct link_table *) __nonnull((1)) __wur;
+int link_table_start(struct link_table *, struct http_t *) __nonnull((1,2)) __wur;
+struct link *link_table_add(struct link_table *, struct http_t *, buf_t *, size_t) __nonnull((1,2,3)) __wur;
+int link_table_build(struct link_table *, struct http_t *) __nonnull((1,2)) __wur;
+void link_table_destroy(struct link_table *) __nonnull((1));
+
+/*
+ * Hooks a scanner up to an HTTP object so that the URLs
+ * in a page go into the queue while the rest of the page
+ * is still being received. Each link is resolved and put
+ * in TABLE as it is found, so the page's links can be
+ * rewritten afterwards without looking for them again.
+ */
+struct link_stream
+{
+	struct link_scanner scanner;
+	struct link_table *table;
+	struct http_t *http;
+	queue_obj_t *queue;
+	url_set_t *archived;
+	pthread_mutex_t *queue_mutex; /* NULL if no other thread uses the queue */
+	pthread_mutex_t *archived_mutex;
+	int active; /* the page being received is being scanned */
+	int fed; /* and some of it has been */
+	int failed; /* TABLE is missing links */
+	int nr_found;
+
+/*
+ * When near duplicates are being looked for, the links
+ * found are only put in TABLE until the page is all in
+ * and we know whether to follow them.
+ */
+	int defer;
+};
+
+int link_stream_init(struct link_stream *, struct link_table *, struct http_t *, queue_obj_t *, url_set_t *, pthread_mutex_t *, pthread_mutex_t *) __nonnull((1,2,3,4,5)) __wur;
+void link_stream_start(struct link_stream *) __nonnull((1));
+int link_stream_finish(struct link_stream *) __nonnull((1)) __wur;
+void link_stream_release(struct link_stream *, int) __nonnull((1));
+void link_stream_destroy(struct link_stream *) __nonnull((1));
+
+#endif /* !defined LINK_SCAN_H */
@@ -5,12 +5,13 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include "btree.h"
 #include "buffer.h"
 #include "cache.h"
 #include "graph.h"
 #include "http.h"
 #include "queue.h"
+#include "url_arena.h"
+#include "url_filter.h"
 
 #define NETWASABI_BUILD		"0.0.3"
 #define NETWASABI_DIR		"NetWasabi_Crawled"
@@ -156,6 +157,22 @@ do {\
 struct netwasabi_ctx nwctx;
 uint32_t runtime_options;
 
+/*
+ * What to do with a page whose text is much the same
+ * as that of one we've already crawled.
+ */
+#define NEAR_DUPS_FOLLOW 0 /* nothing; don't look for them */
+#define NEAR_DUPS_NOFOLLOW 1 /* archive it, but don't follow its links */
+#define NEAR_DUPS_SKIP 2 /* neither archive it nor follow its links */
+
+/*
+ * Pages we parse for links are queued ahead of assets
+ * (images, stylesheets, scripts), which have a lane of
+ * their own. Crawling over one connection, we take an
+ * asset after every ASSET_LANE_INTERVAL pages.
+ */
+#define ASSET_LANE_INTERVAL 4
+
 #define DEFAULT_CRAWL_DELAY 3
 #define DEFAULT_CRAWL_DEPTH 10
 #define DEFAULT_MAX_QUEUE 100
@@ -175,6 +192,16 @@ struct url_types
 #define MAX_QUEUE_OPTION_NAME "queueMax"
 #define FAST_MODE_OPTION_NAME "fastMode"
 #define XDOMAIN_OPTION_NAME "xdomain"
+#define MAX_RATE_OPTION_NAME "maxRate"
+#define HOST_RATE_OPTION_NAME "hostRate"
+#define DROP_TRACKING_OPTION_NAME "dropTrackingParams"
+#define SORT_QUERY_OPTION_NAME "sortQuery"
+#define STRIP_SESSION_OPTION_NAME "stripSessionIds"
+#define EXCLUDE_OPTION_NAME "exclude"
+#define INCLUDE_OPTION_NAME "include"
+#define SITEMAPS_OPTION_NAME "sitemaps"
+#define NEAR_DUPS_OPTION_NAME "nearDuplicates"
+#define DEDUP_CONTENT_OPTION_NAME "dedupContent"
 
 #define stats_nr_bytes(n) ((n)->stats.nr_bytes)
 #define stats_nr_requests(n) ((n)->stats.nr_requests)
@@ -185,6 +212,12 @@ struct url_types
 #define CONFIG_CRAWL_DEPTH(n, v) ((n)->config.crawl_depth = (v))
 #define CONFIG_MAX_QUEUE(n, v) ((n)->config.max_queue = (v))
 #define CONFIG_CROSS_DOMAIN(n, v) ((n)->config.allow_xdomain = (v))
+#define CONFIG_MAX_RATE(n, v) ((n)->config.max_rate = (v))
+#define CONFIG_HOST_RATE(n, v) ((n)->config.host_rate = (v))
+#define CONFIG_USE_SITEMAPS(n, v) ((n)->config.use_sitemaps = (v))
+#define CONFIG_NEAR_DUPS(n, v) ((n)->config.near_dups = (v))
+#define CONFIG_DEDUP_CONTENT(n, v) ((n)->config.dedup_content = (v))
+#define CONFIG_CANON_FLAG(n, f, v) ((v) ? ((n)->config.canon_flags |= (f)) : ((n)->config.canon_flags &= ~(f)))
 
 #define STATS_ADD_BYTES(n, b) ((n)->stats.nr_bytes += (b))
 #define STATS_INC_REQS(n) ++((n)->stats.nr_requests)
@@ -206,7 +239,7 @@ typedef struct URL_t
 
 typedef struct Dead_URL
 {
-	char *URL;
+	url_id_t URL_id;
 	int code;
 	time_t timestamp;
 	int times_seen;
@@ -242,6 +275,12 @@ struct netwasabi_ctx
 		unsigned int max_queue; // maximum number of URLs allowed in the queue
 		unsigned int allow_xdomain; // can we follow URLs that are on another remote server?
 		unsigned int tslash;
+		size_t max_rate; // bytes per second we may receive in total (0 == no limit)
+		size_t host_rate; // bytes per second we may receive from any one host
+		unsigned int canon_flags; // URL_CANON_* rules for canonicalize_url()
+		unsigned int use_sitemaps; // seed the queue from the site's sitemaps before crawling
+		unsigned int near_dups; // NEAR_DUPS_* - what to do with pages much like one already seen
+		unsigned int dedup_content; // store identical bodies once and hard link to them
 	} config;
 
 	struct
@@ -265,10 +304,10 @@ int url_cnt;
 /* Defined in main */
 struct url_types url_types[NR_URL_TYPES];
 int path_max;
+url_arena_t *URL_arena; /* every URL we know of; the queue and trees hold IDs into it */
+url_filter_t *URL_filter; /* built-in and user include/exclude rules */
 
 struct winsize winsize;
-struct graph_ctx *allowed;
-struct graph_ctx *forbidden;
 
 size_t httplen;
 size_t httpslen;
@@ -297,9 +336,34 @@ void put_error_msg(const char *, ...) __nonnull ((1));
 int check_local_dirs(struct http_t *, buf_t *) __nonnull((1,2)) __wur;
 void replace_with_local_urls(struct http_t *, buf_t *) __nonnull((1,2));
 int archive_page(struct http_t *) __nonnull((1)) __wur;
-int parse_URLs(struct http_t *, queue_obj_t *, btree_obj_t *) __nonnull((1,2,3)) __wur;
-
-int Crawl_WebSite(struct http_t *, queue_obj_t *, btree_obj_t *) __nonnull((1,2,3)) __wur;
+int archive_open_sink(struct http_t *) __nonnull((1)) __wur;
+void archive_close_sink(struct http_t *, int, int) __nonnull((1));
+int archive_prepare_resume(struct http_t *) __nonnull((1));
+int archive_retry_partial(struct http_t *) __nonnull((1)) __wur;
+int enqueue_full_URL(struct http_t *, queue_obj_t *, url_set_t *, buf_t *) __nonnull((1,2,3,4)) __wur;
+int enqueue_URL_id_if_acceptable(struct http_t *, queue_obj_t *, url_set_t *, url_id_t) __nonnull((1,2,3)) __wur;
+int enqueue_URL_id(queue_obj_t *, url_id_t) __nonnull((1));
+url_id_t dequeue_URL_id(queue_obj_t *) __nonnull((1)) __wur;
+url_id_t dequeue_page_id(queue_obj_t *) __nonnull((1)) __wur;
+url_id_t dequeue_asset_id(void) __wur;
+int URLs_queued(queue_obj_t *) __nonnull((1)) __wur;
+int assets_queued(void) __wur;
+int asset_due(queue_obj_t *) __nonnull((1)) __wur;
+unsigned int next_page_depth(queue_obj_t *) __nonnull((1)) __wur;
+unsigned int URL_depth(url_id_t) __wur;
+int load_URL(struct http_t *, url_id_t) __nonnull((1)) __wur;
+url_id_t http_URL_id(struct http_t *) __nonnull((1));
+int add_default_URL_rules(url_filter_t *) __nonnull((1)) __wur;
+host_id_t http_host_id(struct http_t *) __nonnull((1));
+int page_is_near_duplicate(struct http_t *) __nonnull((1)) __wur;
+
+typedef int (*fetch_aside_cb_t)(struct http_t *, const char *, size_t, void *);
+int fetch_aside(struct http_t *, const char *, fetch_aside_cb_t, void *) __nonnull((1,2,3));
+
+struct link_table;
+int parse_URLs(struct http_t *, struct link_table *, queue_obj_t *, url_set_t *) __nonnull((1,2,3,4)) __wur;
+
+int Crawl_WebSite(struct http_t *, queue_obj_t *, url_set_t *) __nonnull((1,2,3)) __wur;
 
 #define TOKEN_MAX 64
 
@@ -310,10 +374,4 @@ pthread_mutex_t screen_mutex;
 #define ACTION_ING_STR ">>> "
 #define ACTION_DONE_STR "@@@ "
 
-/*
- * For paths that are forbidden as
- * layed out in the robots.txt file.
- */
-extern char **forbidden_tokens;
-
 #endif /* !defined NETWASABI_H */
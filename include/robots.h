@@ -0,0 +1,62 @@
+#ifndef ROBOTS_H
+#define ROBOTS_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "http.h"
+#include "url_arena.h"
+
+#define ROBOTS_AGENT "netwasabi" /* the product token we look for in User-agent lines */
+#define ROBOTS_MAX_SIZE (512 * 1024) /* what we read of a robots.txt, as Google does */
+#define ROBOTS_MAX_SITEMAPS 64 /* Sitemap lines we keep */
+
+/*
+ * The Allow and Disallow rules that apply to us in a
+ * host's robots.txt, in a trie keyed on the path. A
+ * node where a rule ends holds whether it allows or
+ * disallows and how long it is, so that the longest
+ * rule matching a path decides (Allow wins a tie).
+ * '*' in a rule is a child of its own that matches
+ * any run of characters; a trailing '$' anchors the
+ * rule to the end of the path.
+ */
+#define ROBOTS_RULE_NONE 0
+#define ROBOTS_RULE_ALLOW 1
+#define ROBOTS_RULE_DISALLOW 2
+
+struct robots_node
+{
+	uint32_t child; /* first child, 0 if none */
+	uint32_t sibling; /* next child of our parent */
+	unsigned char c;
+	uint8_t rule; /* ROBOTS_RULE_* for a rule ending here without '$' */
+	uint8_t anchored_rule; /* ...and for one ending here with '$' */
+	uint16_t len;
+	uint16_t anchored_len;
+};
+
+typedef struct Robots_Rules
+{
+	struct robots_node *nodes; /* nodes[0] is the root */
+	uint32_t nr_nodes;
+	uint32_t nr_allocated;
+	unsigned int crawl_delay; /* seconds, 0 if none given */
+	char **sitemaps; /* URLs of the Sitemap lines */
+	int nr_sitemaps;
+} robots_rules_t;
+
+int robots_rules_init(robots_rules_t *) __nonnull((1)) __wur;
+void robots_rules_destroy(robots_rules_t *) __nonnull((1));
+int robots_parse(robots_rules_t *, const char *, size_t) __nonnull((1,2)) __wur;
+int robots_rules_allow(robots_rules_t *, const char *, size_t) __nonnull((1,2)) __wur;
+
+/*
+ * The rules of each host we've crawled, by host ID.
+ */
+int robots_load(struct http_t *) __nonnull((1)) __wur;
+int robots_allow(host_id_t, const char *, size_t) __nonnull((2)) __wur;
+int robots_for_each_sitemap(host_id_t, void (*)(const char *, void *), void *) __nonnull((2));
+void robots_pace(host_id_t, unsigned int);
+void robots_free_hosts(void);
+
+#endif /* !defined ROBOTS_H */
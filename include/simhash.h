@@ -0,0 +1,55 @@
+#ifndef SIMHASH_H
+#define SIMHASH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SimHash of the text of an HTML page: each run of
+ * SIMHASH_SHINGLE words is hashed, and bit i of the
+ * fingerprint is set if more shingle hashes have bit i
+ * set than not. Pages that say nearly the same thing
+ * have fingerprints only a few bits apart.
+ *
+ * The text is what's left with tags, scripts and styles
+ * taken out, split into words on anything that isn't
+ * alphanumeric; it can be fed in as many pieces as it
+ * arrives in.
+ */
+#define SIMHASH_SHINGLE 4
+#define SIMHASH_MIN_SHINGLES 16 /* fewer and we don't judge the page */
+#define SIMHASH_MAX_DISTANCE 3 /* bits apart to count as a near duplicate */
+
+/*
+ * The fingerprints we've seen are indexed by each of
+ * SIMHASH_BANDS 16-bit bands. Two fingerprints no more
+ * than SIMHASH_BANDS - 1 bits apart agree on at least
+ * one band, so only pages sharing a band are compared.
+ */
+#define SIMHASH_BANDS 4
+
+#define SIMHASH_TAG_MAX 8
+
+struct simhash
+{
+	int32_t votes[64];
+	uint64_t window[SIMHASH_SHINGLE]; /* hashes of the last words */
+	uint64_t word; /* hash of the word so far */
+	size_t word_len;
+	unsigned int nr_words;
+	unsigned int nr_shingles;
+	int in_tag;
+	int in_raw; /* in a <script> or <style>, whose text isn't text */
+	int closing; /* the tag we're in is a closing one */
+	char tag[SIMHASH_TAG_MAX];
+	int tag_len; /* -1 once we're past the tag name */
+};
+
+void simhash_init(struct simhash *) __nonnull((1));
+void simhash_feed(struct simhash *, const char *, size_t) __nonnull((1,2));
+int simhash_final(struct simhash *, uint64_t *) __nonnull((1,2)) __wur;
+
+int simhash_seen(uint64_t) __wur;
+void simhash_index_destroy(void);
+
+#endif /* !defined SIMHASH_H */
@@ -0,0 +1,21 @@
+#ifndef SITEMAP_H
+#define SITEMAP_H 1
+
+#include "http.h"
+#include "queue.h"
+#include "url_arena.h"
+
+#define SITEMAP_MAX_FILES 64 /* sitemaps we fetch, counting those in sitemap indexes */
+#define SITEMAP_MAX_URLS 50000 /* URLs we take from one sitemap, as the protocol allows */
+#define SITEMAP_MAX_SIZE (50 * 1024 * 1024) /* bytes of one sitemap, once gunzip'd */
+
+/*
+ * Seed the queue with the URLs in the sitemaps of the
+ * host HTTP is connected to: those named in its
+ * robots.txt or, if none, /sitemap.xml. Sitemap indexes
+ * are followed and gzip'd sitemaps inflated. URLs are
+ * queued most recently modified first.
+ */
+int sitemap_seed(struct http_t *, queue_obj_t *, url_set_t *) __nonnull((1,2,3));
+
+#endif /* !defined SITEMAP_H */
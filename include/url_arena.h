@@ -0,0 +1,120 @@
+#ifndef __URL_ARENA_H__
+#define __URL_ARENA_H__ 1
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Every URL we come across is stored once, here, and
+ * referred to everywhere else by its ID. The strings
+ * are never moved or freed until the arena is destroyed,
+ * so pointers returned by URL_ARENA_string() stay valid.
+ *
+ * Each URL is parsed once, when it is interned, and its
+ * host is interned too, so that two URLs are on the same
+ * host if their records have the same HOST_ID.
+ */
+typedef uint32_t url_id_t;
+typedef uint32_t host_id_t;
+
+#define URL_ID_NONE ((url_id_t)0)
+#define HOST_ID_NONE ((host_id_t)0)
+
+/*
+ * Where the parts of a URL are, as offsets into it.
+ * Parts that aren't there have a length of 0.
+ */
+typedef struct URL_Parts
+{
+	uint16_t scheme_len;
+	uint16_t host_off;
+	uint16_t host_len;
+	uint16_t port; /* 0 if not given */
+	uint16_t path_off; /* also where host[:port] ends */
+	uint16_t path_len;
+	uint16_t query_off; /* just after the '?' */
+	uint16_t query_len;
+} url_parts_t;
+
+#define URL_PARTS_MAX 65535 /* longest URL the offsets can describe */
+
+typedef struct URL_Record
+{
+	uint64_t fingerprint;
+	char *URL; /* null terminated, in one of the arena's blocks */
+	uint32_t URL_len;
+	url_parts_t parts;
+	host_id_t host_id;
+} url_record_t;
+
+typedef struct URL_Arena_Block
+{
+	struct URL_Arena_Block *next;
+	size_t used;
+	size_t size;
+	char data[];
+} url_arena_block_t;
+
+/*
+ * Open-addressed fingerprint => ID index over an array
+ * of records. The arena has one for URLs and one for
+ * hosts (whose records only use FINGERPRINT, URL and
+ * URL_LEN).
+ */
+typedef struct URL_Index
+{
+	url_record_t *records; /* indexed by ID; records[0] is unused */
+	uint32_t nr_records;
+	uint32_t nr_allocated;
+	uint32_t *table;
+	uint32_t table_size; /* always a power of 2 */
+} url_index_t;
+
+typedef struct URL_Arena
+{
+	url_arena_block_t *blocks; /* the one being filled is first */
+	url_index_t URLs;
+	url_index_t hosts;
+	pthread_mutex_t lock;
+} url_arena_t;
+
+/*
+ * A set of URL IDs, one bit for each. IDs are handed out
+ * in order from 1, so the bits are dense and a lookup is
+ * a shift and a mask however many URLs are in the set.
+ * Guarded by whoever uses it.
+ */
+typedef struct URL_Set
+{
+	uint8_t *bits;
+	size_t size; /* in bytes */
+	uint32_t nr_ids;
+} url_set_t;
+
+url_arena_t *URL_ARENA_object_new(void);
+void URL_ARENA_object_destroy(url_arena_t *);
+url_id_t URL_ARENA_intern(url_arena_t *, const char *, size_t);
+url_id_t URL_ARENA_lookup(url_arena_t *, const char *, size_t);
+const char *URL_ARENA_string(url_arena_t *, url_id_t);
+size_t URL_ARENA_length(url_arena_t *, url_id_t);
+uint64_t URL_ARENA_fingerprint(url_arena_t *, url_id_t);
+int URL_ARENA_record(url_arena_t *, url_id_t, url_record_t *);
+host_id_t URL_ARENA_host_id(url_arena_t *, url_id_t);
+host_id_t URL_ARENA_intern_host(url_arena_t *, const char *, size_t);
+url_set_t *URL_SET_object_new(void);
+void URL_SET_object_destroy(url_set_t *);
+int URL_SET_add(url_set_t *, url_id_t);
+int URL_SET_has(url_set_t *, url_id_t);
+uint64_t URL_fingerprint(const char *, size_t);
+int URL_parts_parse(const char *, size_t, url_parts_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined __URL_ARENA_H__ */
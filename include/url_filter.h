@@ -0,0 +1,71 @@
+#ifndef URL_FILTER_H
+#define URL_FILTER_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Include and exclude rules for URLs, compiled into one
+ * Aho-Corasick automaton so that a URL is checked
+ * against all of them in a single pass.
+ *
+ * A rule is one of
+ *
+ *	prefix:<string>	URL starts with <string>
+ *	suffix:<string>	URL ends with <string>
+ *	glob:<pattern>	URL matches <pattern>, in which '*'
+ *			matches any run of characters
+ *	<string>	URL contains <string>
+ *
+ * A URL is allowed if it matches no exclude rule and,
+ * when there are include rules, at least one of them.
+ */
+#define URL_FILTER_EXCLUDE 0
+#define URL_FILTER_INCLUDE 1
+
+struct url_filter_rule
+{
+	int action;
+	int anchor_start; /* first segment must start the URL */
+	int anchor_end; /* last segment must end it */
+	uint16_t nr_segments;
+};
+
+struct url_filter_output
+{
+	uint16_t rule;
+	uint16_t segment;
+	uint16_t len;
+};
+
+typedef struct URL_Filter
+{
+	struct url_filter_rule *rules;
+	int nr_rules;
+	int nr_includes;
+	int exclude_all; /* there is an exclude rule of "glob:*" */
+	int include_all; /* ...or an include rule */
+
+/*
+ * The automaton: DELTA[state * 256 + byte] is the next
+ * state; the segments that end in STATE are at
+ * OUTPUTS[OUT_START[STATE]] to OUTPUTS[OUT_START[STATE+1]].
+ */
+	uint32_t *delta;
+	uint32_t *out_start;
+	struct url_filter_output *outputs;
+	uint32_t nr_states;
+
+	char **patterns; /* as added, until compiled */
+	int nr_allocated;
+	int compiled;
+} url_filter_t;
+
+url_filter_t *URL_FILTER_object_new(void) __wur;
+void URL_FILTER_object_destroy(url_filter_t *) __nonnull((1));
+int URL_FILTER_add_rule(url_filter_t *, const char *, int) __nonnull((1,2)) __wur;
+int URL_FILTER_add_rules(url_filter_t *, const char *, int) __nonnull((1,2)) __wur;
+int URL_FILTER_compile(url_filter_t *) __nonnull((1)) __wur;
+int URL_FILTER_allows(url_filter_t *, const char *, size_t) __nonnull((1,2)) __wur;
+
+#endif /* !defined URL_FILTER_H */
@@ -0,0 +1,47 @@
+#ifndef URL_TRAPS_H
+#define URL_TRAPS_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include "url_arena.h"
+
+/*
+ * Crawler traps are parts of a site that make up a new
+ * URL for every page: relative links that pile up path
+ * segments, ?page=N counting up forever, calendars that
+ * link to the next month, and chains of ever deeper
+ * directories each holding one or two links.
+ *
+ * Each URL that looks like one of these is reduced to a
+ * template (the numbers or dates taken out), and each
+ * template may have a budget of URLs before we stop
+ * following the ones that fit it.
+ */
+#define URL_TRAP_NONE 0
+#define URL_TRAP_REPEAT 1 /* a segment or run of segments repeated */
+#define URL_TRAP_NUMERIC 2 /* page numbers and offsets in the query */
+#define URL_TRAP_CALENDAR 3 /* dates in the path or query */
+#define URL_TRAP_DEEP 4 /* deep paths with few links at each level */
+#define URL_TRAP_KINDS 5
+
+#define URL_TRAP_REPEAT_BUDGET 0
+#define URL_TRAP_NUMERIC_BUDGET 200
+#define URL_TRAP_CALENDAR_BUDGET 60 /* five years of months */
+#define URL_TRAP_DEEP_BUDGET 32
+
+#define URL_TRAP_REPEAT_MAX 3 /* times one segment may appear in a path */
+#define URL_TRAP_DEEP_SEGMENTS 8 /* segments in a path to count as deep */
+#define URL_TRAP_DEEP_CHAIN 4 /* levels above its directory that must have... */
+#define URL_TRAP_TINY_FANOUT 2 /* ...no more than this many URLs in each */
+
+#define URL_TRAP_TEMPLATE_MAX 512
+
+typedef void (*url_trap_cb_t)(int, const char *, unsigned int, void *);
+
+int url_traps_check(const char *, const url_parts_t *, url_id_t) __nonnull((1,2)) __wur;
+unsigned int url_traps_nr_suppressed(void);
+void url_traps_for_each(url_trap_cb_t, void *) __nonnull((1));
+const char *url_trap_kind_name(int);
+void url_traps_destroy(void);
+
+#endif /* !defined URL_TRAPS_H */
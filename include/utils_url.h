@@ -3,9 +3,21 @@
 
 #include "buffer.h"
 #include "http.h"
+#include "url_arena.h"
+
+/*
+ * Optional rules for canonicalize_url(), on top of the
+ * RFC 3986 normalisations that are always done.
+ */
+#define URL_CANON_DROP_TRACKING	0x1 /* drop utm_* and other click-tracking parameters */
+#define URL_CANON_SORT_QUERY	0x2 /* sort the query parameters */
+#define URL_CANON_STRIP_SESSION	0x4 /* drop session IDs from the path and query */
 
 int make_full_url(struct http_t *, buf_t *, buf_t *) __nonnull((1,2,3)) __wur;
-int make_local_url(struct http_t *, buf_t *, buf_t *) __nonnull((1,2,3)) __wur;
+int normalize_full_url(buf_t *) __nonnull((1)) __wur;
+int canonicalize_url(buf_t *, unsigned int) __nonnull((1));
+int local_archive_name(buf_t *, buf_t *) __nonnull((1,2)) __wur;
+int make_relative_url(const char *, const char *, buf_t *) __nonnull((1,2,3)) __wur;
 void encode_url(buf_t *) __nonnull((1));
 int is_xdomain(struct http_t *, buf_t *) __nonnull((1,2)) __wur;
 
@@ -14,10 +26,11 @@ int is_xdomain(struct http_t *, buf_t *) __nonnull((1,2)) __wur;
  * We need the HTTP object as an argument to access
  * the function pointers in http->ops.
  */
-int local_archive_exists(struct http_t *, char *) __nonnull((1)) __wur;
+int local_archive_exists(const char *) __nonnull((1)) __wur;
 int has_extension(char *) __nonnull((1)) __wur;
 
 int URL_parseable(char *);
-void transform_document_URLs(struct http_t *);
+struct link_table;
+void transform_document_URLs(struct http_t *, struct link_table *) __nonnull((1,2));
 
 #endif /* !defined UTILS_URL_H */
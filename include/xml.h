@@ -1,6 +1,8 @@
 #ifndef __XML_h__
 #define __XML_h__ 1
 
+#include <stddef.h>
+
 /*
  * For saving attributes of a tag, such as
  * <tagname attribute1="value1" attribute2="value2">
@@ -31,8 +33,16 @@ typedef xml_node_t *node_ptr;
 
 typedef void(*XML_cb_t)(xml_node_t *);
 
+/*
+ * For XML_parse_stream(): called with the name and
+ * value of each element as it ends, and its depth.
+ */
+typedef int(*XML_element_cb_t)(const char *, const char *, int, void *);
+
 struct XML *XML_new(void);
 int XML_parse_file(struct XML *, char *);
+int XML_parse_buffer(struct XML *, const char *, size_t);
+int XML_parse_stream(const char *, size_t, XML_element_cb_t, void *);
 xml_node_t *XML_find_by_path(struct XML *, char *);
 xml_node_t *XML_find_parent_node_for_value(xml_node_t *, char *);
 char *XML_get_node_value(xml_node_t *, char *);
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "archive_index.h"
+#include "content_store.h"
+#include "hash_bucket.h"
+
+static bucket_obj_t *Archive_index = NULL;
+static pthread_rwlock_t Archive_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static char *Archive_root = NULL; /* with a trailing '/' */
+static size_t Archive_root_len = 0;
+
+#define ARCHIVE_INDEX_WALK_FDS 32
+
+/*
+ * Path of PATH relative to the archive directory,
+ * or PATH itself if it is already relative.
+ */
+static const char *
+__relative(const char *path)
+{
+	if (Archive_root && !strncmp(path, Archive_root, Archive_root_len))
+		return (path + Archive_root_len);
+
+	return path;
+}
+
+static void
+__add(const char *rel)
+{
+	static char present = 1;
+
+	if (Archive_index->get(Archive_index, (char *)rel))
+		return;
+
+	Archive_index->put(Archive_index, (char *)rel, (void *)&present, sizeof(present), 0);
+
+	return;
+}
+
+static int
+__has_suffix(const char *path, size_t len, const char *suffix)
+{
+	size_t suffix_len = strlen(suffix);
+
+	return (len >= suffix_len && !strcmp((path + len - suffix_len), suffix));
+}
+
+static int
+__walk_one(const char *path, const struct stat *statb, int type, struct FTW *ftw)
+{
+	size_t len;
+
+	(void)statb;
+
+/*
+ * The content store holds the same bodies again
+ * under their hashes; they aren't pages.
+ */
+	if (FTW_D == type && !strcmp(path + ftw->base, CONTENT_STORE_DIR))
+		return FTW_SKIP_SUBTREE;
+
+	if (FTW_F != type)
+		return 0;
+
+/*
+ * Bodies we only have part of aren't archived yet.
+ */
+	len = strlen(path);
+
+	if (__has_suffix(path, len, PARTIAL_SUFFIX) || __has_suffix(path, len, PARTIAL_INFO_SUFFIX))
+		return 0;
+
+	__add(__relative(path));
+
+	return 0;
+}
+
+/**
+ * Set up the index and fill it with the files
+ * already under ROOT, the archive directory.
+ *
+ * @root The archive directory
+ */
+int
+archive_index_load(const char *root)
+{
+	assert(root);
+
+	size_t root_len = strlen(root);
+	int rv;
+
+	pthread_rwlock_wrlock(&Archive_index_lock);
+
+	if (!Archive_index)
+	{
+		Archive_index = BUCKET_object_new();
+
+		if (!Archive_index)
+			goto fail_unlock;
+	}
+
+	free(Archive_root);
+
+	Archive_root = calloc(root_len + 2, 1);
+	if (!Archive_root)
+		goto fail_unlock;
+
+	memcpy(Archive_root, root, root_len);
+
+	if (!root_len || root[root_len - 1] != '/')
+		Archive_root[root_len++] = '/';
+
+	Archive_root_len = root_len;
+
+	rv = nftw(root, __walk_one, ARCHIVE_INDEX_WALK_FDS, FTW_PHYS|FTW_ACTIONRETVAL);
+
+	pthread_rwlock_unlock(&Archive_index_lock);
+
+	return rv;
+
+fail_unlock:
+
+	pthread_rwlock_unlock(&Archive_index_lock);
+
+	return -1;
+}
+
+/**
+ * Record that PATH (which may be relative to the
+ * archive directory, or a full pathname under it)
+ * has been archived.
+ */
+void
+archive_index_add(const char *path)
+{
+	assert(path);
+
+	pthread_rwlock_wrlock(&Archive_index_lock);
+
+	if (Archive_index)
+		__add(__relative(path));
+
+	pthread_rwlock_unlock(&Archive_index_lock);
+
+	return;
+}
+
+/**
+ * Check whether PATH has been archived.
+ */
+int
+archive_index_has(const char *path)
+{
+	assert(path);
+
+	int has = 0;
+
+	pthread_rwlock_rdlock(&Archive_index_lock);
+
+	if (Archive_index)
+		has = (NULL != Archive_index->get(Archive_index, (char *)__relative(path)));
+
+	pthread_rwlock_unlock(&Archive_index_lock);
+
+	return has;
+}
+
+void
+archive_index_destroy(void)
+{
+	pthread_rwlock_wrlock(&Archive_index_lock);
+
+	if (Archive_index)
+		Archive_index->destroy(Archive_index, 0);
+
+	Archive_index = NULL;
+
+	free(Archive_root);
+	Archive_root = NULL;
+	Archive_root_len = 0;
+
+	pthread_rwlock_unlock(&Archive_index_lock);
+
+	return;
+}
@@ -58,17 +58,11 @@ Dead_URL_cache_ctor(void *dlObj)
 
 	Dead_URL_t *dl = (Dead_URL_t *)dlObj;
 
-	dl->URL = calloc(HTTP_URL_MAX, 1);
-
-	assert(dl->URL);
-
+	dl->URL_id = URL_ID_NONE;
 	dl->code = 0;
 	dl->timestamp = 0;
 	dl->times_seen = 0;
 
-	if (NULL == dl->URL)
-		return -1;
-
 	return 0;
 }
 
@@ -82,12 +76,7 @@ Dead_URL_cache_dtor(void *dlObj)
 
 	Dead_URL_t *dl = (Dead_URL_t *)dlObj;
 
-	if (NULL != dl->URL)
-	{
-		free(dl->URL);
-		dl->URL = NULL;
-	}
-
+	dl->URL_id = URL_ID_NONE;
 	dl->code = 0;
 	dl->timestamp = 0;
 	dl->times_seen = 0;
@@ -96,17 +85,13 @@ Dead_URL_cache_dtor(void *dlObj)
 }
 
 Dead_URL_t *
-search_dead_URL(cache_t *cache, const char *URL)
+search_dead_URL(cache_t *cache, url_id_t URL_id)
 {
 	assert(cache);
-	assert(URL);
 
 	Dead_URL_t *dead = NULL;
 	int i;
 	int capacity = cache->capacity;
-	size_t URL_len = strlen(URL);
-
-	dead = (Dead_URL_t *)cache->cache;
 
 	for (dead = (Dead_URL_t *)cache->cache, i = 0;
 		i < capacity;
@@ -115,7 +100,7 @@ search_dead_URL(cache_t *cache, const char *URL)
 		if (!cache_obj_used(cache, (void *)dead))
 			continue;
 
-		if (!memcmp((void *)dead->URL, (void *)URL, URL_len))
+		if (dead->URL_id == URL_id)
 			return dead; 
 	}
 
@@ -125,16 +110,18 @@ search_dead_URL(cache_t *cache, const char *URL)
 static Dead_URL_t dummy_dead_URL;
 
 void
-cache_dead_URL(cache_t *cache, const char *URL, int code)
+cache_dead_URL(cache_t *cache, url_id_t URL_id, int code)
 {
 	assert(cache);
-	assert(URL);
+
+	if (URL_ID_NONE == URL_id)
+		return;
 
 	Dead_URL_t *dead = cache_alloc(cache, &dummy_dead_URL);
 	if (!dead)
 		return;
 
-	memcpy((void *)dead->URL, (void *)URL, strlen(URL));
+	dead->URL_id = URL_id;
 	dead->code = code;
 	dead->timestamp = time(NULL);
 	dead->times_seen = 1;
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <linux/fs.h> /* for FICLONE */
+#endif
+#include <openssl/evp.h>
+#include "content_store.h"
+#include "hash_bucket.h"
+
+#define CONTENT_HEX_LEN (CONTENT_DIGEST_LEN * 2)
+#define CONTENT_READ_BLOCK 65536
+
+static bucket_obj_t *Content_index = NULL; /* hex digests of the objects we have */
+static pthread_rwlock_t Content_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static char *Store_root = NULL; /* <archive>/.objects/ */
+static size_t Bytes_saved = 0;
+
+static void
+__hex(const unsigned char *digest, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < CONTENT_DIGEST_LEN; ++i)
+	{
+		hex[i * 2] = digits[digest[i] >> 4];
+		hex[i * 2 + 1] = digits[digest[i] & 0xf];
+	}
+
+	hex[CONTENT_HEX_LEN] = 0;
+
+	return;
+}
+
+/*
+ * <archive>/.objects/ab/cdef...
+ */
+static int
+__object_path(const char *hex, char *path, size_t size)
+{
+	if ((size_t)snprintf(path, size, "%s%.2s/%s", Store_root, hex, (hex + 2)) >= size)
+		return -1;
+
+	return 0;
+}
+
+static void
+__add(const char *hex)
+{
+	static char present = 1;
+
+	if (Content_index->get(Content_index, (char *)hex))
+		return;
+
+	Content_index->put(Content_index, (char *)hex, (void *)&present, sizeof(present), 0);
+
+	return;
+}
+
+static int
+__has(const char *hex)
+{
+	int has = 0;
+
+	pthread_rwlock_rdlock(&Content_index_lock);
+
+	if (Content_index)
+		has = (NULL != Content_index->get(Content_index, (char *)hex));
+
+	pthread_rwlock_unlock(&Content_index_lock);
+
+	return has;
+}
+
+/**
+ * Set up the store under ROOT, the archive directory,
+ * and note the objects already in it.
+ */
+int
+content_store_load(const char *root)
+{
+	assert(root);
+
+	char path[PATH_MAX];
+	char hex[CONTENT_HEX_LEN+1];
+	DIR *top = NULL;
+	DIR *sub;
+	struct dirent *d;
+	struct dirent *e;
+
+	pthread_rwlock_wrlock(&Content_index_lock);
+
+	if (!Content_index && !(Content_index = BUCKET_object_new()))
+		goto fail_unlock;
+
+	free(Store_root);
+
+	if (asprintf(&Store_root, "%s%s" CONTENT_STORE_DIR "/", root, (root[strlen(root) - 1] == '/' ? "" : "/")) < 0)
+	{
+		Store_root = NULL;
+		goto fail_unlock;
+	}
+
+	if (mkdir(Store_root, S_IRWXU) < 0 && EEXIST != errno)
+		goto fail_unlock;
+
+	if (!(top = opendir(Store_root)))
+		goto fail_unlock;
+
+	while ((d = readdir(top)))
+	{
+		if (strlen(d->d_name) != 2 || '.' == d->d_name[0])
+			continue;
+
+		snprintf(path, sizeof(path), "%s%s", Store_root, d->d_name);
+
+		if (!(sub = opendir(path)))
+			continue;
+
+		while ((e = readdir(sub)))
+		{
+			if (strlen(e->d_name) != (CONTENT_HEX_LEN - 2))
+				continue;
+
+			memcpy(hex, d->d_name, 2);
+			memcpy(hex + 2, e->d_name, (CONTENT_HEX_LEN - 2));
+			hex[CONTENT_HEX_LEN] = 0;
+
+			__add(hex);
+		}
+
+		closedir(sub);
+	}
+
+	closedir(top);
+
+	pthread_rwlock_unlock(&Content_index_lock);
+
+	return 0;
+
+fail_unlock:
+
+	free(Store_root);
+	Store_root = NULL;
+
+	pthread_rwlock_unlock(&Content_index_lock);
+
+	return -1;
+}
+
+/*
+ * Give TMP the contents of OBJECT without copying them,
+ * on filesystems that can share extents between files.
+ */
+static int
+__reflink(const char *object, const char *tmp)
+{
+#ifdef FICLONE
+	int src;
+	int dst;
+	int rv;
+
+	if ((src = open(object, O_RDONLY)) < 0)
+		return -1;
+
+	if ((dst = open(tmp, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR)) < 0)
+	{
+		close(src);
+		return -1;
+	}
+
+	rv = ioctl(dst, FICLONE, src);
+
+	close(src);
+	close(dst);
+
+	if (rv < 0)
+		unlink(tmp);
+
+	return rv;
+#else
+	(void)object;
+	(void)tmp;
+
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/*
+ * Make PATH a link to OBJECT, replacing whatever
+ * is at PATH.
+ */
+static int
+__link_into(const char *object, const char *path)
+{
+	char tmp[PATH_MAX];
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.link", path) >= sizeof(tmp))
+		return -1;
+
+	unlink(tmp);
+
+	if (link(object, tmp) < 0)
+	{
+		if (EMLINK != errno || __reflink(object, tmp) < 0)
+			return -1;
+	}
+
+	if (rename(tmp, path) < 0)
+	{
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * If we already have a body with DIGEST, make PATH
+ * a link to it. Returns 1 if we did, and the caller
+ * need not write the SIZE bytes of it out.
+ */
+int
+content_store_link(const unsigned char *digest, const char *path, size_t size)
+{
+	assert(digest);
+	assert(path);
+
+	char hex[CONTENT_HEX_LEN+1];
+	char object[PATH_MAX];
+
+	if (!Store_root)
+		return 0;
+
+	__hex(digest, hex);
+
+	if (!__has(hex) || __object_path(hex, object, sizeof(object)) < 0)
+		return 0;
+
+	if (__link_into(object, path) < 0)
+		return 0;
+
+	__sync_fetch_and_add(&Bytes_saved, size);
+
+	return 1;
+}
+
+/**
+ * PATH has just been written with a body whose hash
+ * is DIGEST. If we already have that body, replace
+ * PATH with a link to it and return 1; otherwise
+ * make PATH's the copy that others link to.
+ */
+int
+content_store_adopt(const unsigned char *digest, const char *path)
+{
+	assert(digest);
+	assert(path);
+
+	char hex[CONTENT_HEX_LEN+1];
+	char object[PATH_MAX];
+	struct stat statb;
+	char *slash;
+
+	if (!Store_root)
+		return 0;
+
+	__hex(digest, hex);
+
+	if (__object_path(hex, object, sizeof(object)) < 0)
+		return -1;
+
+	if (__has(hex))
+	{
+		if (stat(path, &statb) < 0 || __link_into(object, path) < 0)
+			return -1;
+
+		__sync_fetch_and_add(&Bytes_saved, (size_t)statb.st_size);
+
+		return 1;
+	}
+
+	slash = strrchr(object, '/');
+	*slash = 0;
+	mkdir(object, S_IRWXU);
+	*slash = '/';
+
+	if (link(path, object) < 0 && EEXIST != errno)
+		return -1;
+
+	pthread_rwlock_wrlock(&Content_index_lock);
+
+	if (Content_index)
+		__add(hex);
+
+	pthread_rwlock_unlock(&Content_index_lock);
+
+	return 0;
+}
+
+/**
+ * Bytes we didn't have to store again.
+ */
+size_t
+content_store_bytes_saved(void)
+{
+	return __sync_fetch_and_add(&Bytes_saved, 0);
+}
+
+void
+content_store_destroy(void)
+{
+	pthread_rwlock_wrlock(&Content_index_lock);
+
+	if (Content_index)
+		Content_index->destroy(Content_index, 0);
+
+	Content_index = NULL;
+
+	free(Store_root);
+	Store_root = NULL;
+
+	pthread_rwlock_unlock(&Content_index_lock);
+
+	return;
+}
+
+int
+content_digest(const void *data, size_t len, unsigned char *digest)
+{
+	assert(data);
+	assert(digest);
+
+	return (EVP_Digest(data, len, digest, NULL, EVP_sha256(), NULL) == 1 ? 0 : -1);
+}
+
+/**
+ * Hash the file at PATH, for bodies we couldn't
+ * hash as they were received.
+ */
+int
+content_digest_file(const char *path, unsigned char *digest)
+{
+	assert(path);
+	assert(digest);
+
+	EVP_MD_CTX *ctx = NULL;
+	char block[CONTENT_READ_BLOCK];
+	ssize_t n;
+	int fd = -1;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		goto fail;
+
+	if (!(ctx = EVP_MD_CTX_new()) || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+		goto fail;
+
+	while ((n = read(fd, block, sizeof(block))) != 0)
+	{
+		if (n < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			goto fail;
+		}
+
+		if (EVP_DigestUpdate(ctx, block, (size_t)n) != 1)
+			goto fail;
+	}
+
+	if (EVP_DigestFinal_ex(ctx, digest, NULL) != 1)
+		goto fail;
+
+	EVP_MD_CTX_free(ctx);
+	close(fd);
+
+	return 0;
+
+fail:
+
+	if (ctx)
+		EVP_MD_CTX_free(ctx);
+
+	if (fd != -1)
+		close(fd);
+
+	return -1;
+}
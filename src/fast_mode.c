@@ -8,15 +8,17 @@
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
-#include "btree.h"
 #include "buffer.h"
 #include "cache.h"
 #include "cache_management.h"
 #include "fast_mode.h"
 #include "http.h"
+#include "link_scan.h"
 #include "malloc.h"
 #include "queue.h"
+#include "robots.h"
 #include "screen_utils.h"
+#include "sitemap.h"
 #include "netwasabi.h"
 #include "utils_url.h"
 
@@ -32,7 +34,7 @@ typedef pthread_mutex_t mutex_t;
 #define mutex_destroy(m) pthread_mutex_destroy(&(m))
 
 #define queue_lock() mutex_lock(Mutex_Queue)
-#define queue_unlock() mutex_lock(Mutex_Queue)
+#define queue_unlock() mutex_unlock(Mutex_Queue)
 #define tree_lock() mutex_lock(Mutex_Tree)
 #define tree_unlock() mutex_unlock(Mutex_Tree)
 
@@ -93,10 +95,11 @@ struct worker_thread
 	char *main_url;
 	uint32_t runtime_options;
 	unsigned int max_queue;
+	unsigned int page_depth; /* of the page being fetched, UINT_MAX if none; guarded by Mutex_Queue */
 };
 
 static queue_obj_t *URL_queue = NULL;
-static btree_obj_t *tree_archived = NULL;
+static url_set_t *URLs_archived = NULL;
 
 static struct worker_thread workers[FAST_MODE_NR_WORKERS];
 static pthread_attr_t attr;
@@ -107,6 +110,7 @@ static pthread_once_t once = PTHREAD_ONCE_INIT;
 static volatile long unsigned Initializing_Worker = 0;
 static volatile int Threads_Exit = 0;
 static volatile int Nr_Threads_Working = FAST_MODE_NR_WORKERS;
+static int Nr_Asset_Fetches = 0; /* guarded by Mutex_Queue */
 
 //static volatile int nr_workers_eoc = 0;
 
@@ -258,18 +262,93 @@ worker_signal_recon(void)
 	return;
 }
 
+/*
+ * The least depth of the pages the workers other
+ * than WT are fetching. With the queue locked.
+ */
+static unsigned int
+__lowest_page_depth(struct worker_thread *wt)
+{
+	unsigned int lowest = UINT_MAX;
+	int i;
+
+	for (i = 0; i < FAST_MODE_NR_WORKERS; ++i)
+	{
+		if (&workers[i] != wt && workers[i].page_depth < lowest)
+			lowest = workers[i].page_depth;
+	}
+
+	return lowest;
+}
+
+/*
+ * Take the next URL for WT to fetch, with the queue
+ * locked. *ASSET is set if it's from the asset lane,
+ * and then takes up one of its FAST_MODE_NR_ASSET_WORKERS
+ * places until the worker comes back for another.
+ *
+ * A page from the next level isn't started while one
+ * from this level is still being fetched, since its
+ * links could then go in ahead of those still to come
+ * from this level. *HELD is set if that's why we
+ * returned URL_ID_NONE.
+ */
+static url_id_t
+__next_URL_id(struct worker_thread *wt, int *asset, int *held)
+{
+	url_id_t id;
+
+	if (*asset)
+		--Nr_Asset_Fetches;
+
+	*asset = 0;
+	*held = 0;
+	wt->page_depth = UINT_MAX;
+
+	if (Nr_Asset_Fetches < FAST_MODE_NR_ASSET_WORKERS
+	&& (wt->idx < FAST_MODE_NR_ASSET_WORKERS || asset_due(URL_queue)))
+	{
+		if (URL_ID_NONE != (id = dequeue_asset_id()))
+		{
+			++Nr_Asset_Fetches;
+			*asset = 1;
+
+			return id;
+		}
+	}
+
+	if (URLs_queued(URL_queue) && next_page_depth(URL_queue) > __lowest_page_depth(wt))
+	{
+		*held = 1;
+		return URL_ID_NONE;
+	}
+
+	if (URL_ID_NONE != (id = dequeue_page_id(URL_queue)))
+		wt->page_depth = URL_depth(id);
+
+	return id;
+}
+
 static void *
 worker_crawl(void *args)
 {
 	struct worker_thread *wt = (struct worker_thread *)args;
 	struct http_t *http = NULL;
-	queue_item_t *item = NULL;
 	Dead_URL_t *dead = NULL;
+	struct link_stream stream;
+	struct link_table links;
+	int have_stream = 0;
+	int have_links = 0;
+	int asset = 0;
+	int assets_left;
+	int held;
+	int streamed;
+	int rv;
 
 	char *main_url = NULL;
-	char URL[HTTP_URL_MAX];
+	const char *URL;
+	url_id_t URL_id;
 	int status_code;
-	size_t URL_len;
 
 	main_url = wt->main_url;
 
@@ -280,8 +359,27 @@ worker_crawl(void *args)
 	}
 
 	http->followRedirects = 1;
+	http->sink_open = archive_open_sink;
+	http->sink_close = archive_close_sink;
+	http->digest_sink = nwctx.config.dedup_content;
 	http->verb = GET;
 
+	if (link_table_init(&links) < 0)
+	{
+		put_error_msg("failed to set up link table");
+		goto thread_fail;
+	}
+
+	have_links = 1;
+
+	if (link_stream_init(&stream, &links, http, URL_queue, URLs_archived, &Mutex_Queue, &Mutex_Tree) < 0)
+	{
+		put_error_msg("failed to set up link stream");
+		goto thread_fail;
+	}
+
+	have_stream = 1;
+
 	strcpy(http->URL, main_url);
 	http->URL_len = strlen(main_url);
 
@@ -306,11 +404,37 @@ worker_crawl(void *args)
  */
 	pthread_once(&once, init_worker_environ);
 
-	if (Initializing_Worker == pthread_self())
+	if (Initializing_Worker == pthread_self() && nwctx.config.use_sitemaps)
+	{
+	/*
+	 * With the queue seeded from the sitemaps, the seed page
+	 * is just another URL and all workers start at once. It
+	 * goes in first, as in single mode, so that it is crawled
+	 * at depth 0 ahead of the pages the sitemaps list.
+	 */
+		enqueue_URL_id(URL_queue, http_URL_id(http));
+
+		if (sitemap_seed(http, URL_queue, URLs_archived) > 0)
+		{
+			wlog("Queued %d URLs from sitemaps\n", URLs_queued(URL_queue));
+		}
+		else
+		{
+		/*
+		 * Take it back out; it is fetched below before
+		 * the other workers are let go.
+		 */
+			URL_id = dequeue_URL_id(URL_queue);
+			wlog("No URLs in sitemaps; starting from the initial page\n");
+		}
+	}
+
+	if (Initializing_Worker == pthread_self() && !URLs_queued(URL_queue))
 	{
 		http->ops->send_request(http);
 		http->ops->recv_response(http);
 
+		streamed = link_stream_finish(&stream);
 		status_code = http->code;
 
 		if (HTTP_OK != status_code)
@@ -320,17 +444,25 @@ worker_crawl(void *args)
 		}
 		else
 		{
-			wlog("[0x%lx] calling parse_URLs()\n", pthread_self());
-			parse_URLs(http, URL_queue, tree_archived);
+			if (streamed)
+				link_stream_release(&stream, 1);
 
-			if (!URL_queue->nr_items)
+			if (!streamed && link_table_build(&links, http) >= 0)
+			{
+				wlog("[0x%lx] calling parse_URLs()\n", pthread_self());
+
+				if (parse_URLs(http, &links, URL_queue, URLs_archived) < 0)
+					put_error_msg("Failed to queue the links in %s", http->URL);
+			}
+
+			if (!URLs_queued(URL_queue))
 			{
 				wlog("No URLs parsed from initial page\n");
 				Threads_Exit = 1;
 			}
 			else
 			{
-				wlog("Parsed %d URLs from initial page\n", URL_queue->nr_items);
+				wlog("Parsed %d URLs from initial page\n", URLs_queued(URL_queue));
 			}
 		}
 	}
@@ -352,22 +484,32 @@ worker_crawl(void *args)
 	{
 		queue_lock();
 
-		item = QUEUE_dequeue(URL_queue);
+		URL_id = __next_URL_id(wt, &asset, &held);
+		assets_left = assets_queued();
 
 		queue_unlock();
 
-		if (!item)
+		if (URL_ID_NONE == URL_id)
 		{
+		/*
+		 * The next page waits for this level to be done, or
+		 * only assets are left and as many workers as may
+		 * are fetching them; wait for a place.
+		 */
+			if (held || assets_left)
+			{
+				usleep(FAST_MODE_ASSET_WAIT_USEC);
+				continue;
+			}
+
 			goto thread_exit;
 		}
 
-		URL_len = item->data_len;
-		strncpy(URL, (char *)item->data, URL_len);
-		URL[URL_len] = 0;
+		URL = URL_ARENA_string(URL_arena, URL_id);
 
 		cache_lock(Dead_URL_cache);
 		// O(n)
-		dead = search_dead_URL(Dead_URL_cache, URL);
+		dead = search_dead_URL(Dead_URL_cache, URL_id);
 
 		if (dead)
 		{
@@ -378,8 +520,8 @@ worker_crawl(void *args)
 		cache_unlock(Dead_URL_cache);
 
 		tree_lock();
-		// ~O(logN)
-		if (BTREE_search_data(tree_archived, (void *)URL, URL_len))
+		// O(1)
+		if (URL_SET_has(URLs_archived, URL_id))
 		{
 			tree_unlock();
 			continue;
@@ -387,26 +529,45 @@ worker_crawl(void *args)
 
 		tree_unlock();
 
-		strcpy(http->URL, URL);
+		if (load_URL(http, URL_id) < 0)
+			continue;
 
-		http->ops->URL_parse_host(URL, http->host);
-		http->ops->URL_parse_page(URL, http->page);
+		if (robots_load(http) < 0)
+			put_error_msg("failed to get robots.txt for %s", http->host);
+
+		if (!robots_allow(http_host_id(http), http->page, strlen(http->page)))
+			continue;
+
+		robots_pace(http_host_id(http), 0);
+
+		archive_prepare_resume(http);
 
 		http->ops->send_request(http);
-		http->ops->recv_response(http);
+		rv = http->ops->recv_response(http);
 
+		streamed = link_stream_finish(&stream);
 		update_current_url(URL);
 
+		if (rv < 0 && archive_retry_partial(http))
+		{
+			queue_lock();
+			enqueue_URL_id(URL_queue, http_URL_id(http));
+			queue_unlock();
+
+			goto next;
+		}
+
 		switch(http->code)
 		{
 			case HTTP_OK:
+			case HTTP_PARTIAL_CONTENT:
 
 				break;
 
 			case HTTP_NOT_FOUND:
 
 				cache_lock(Dead_URL_cache);
-				cache_dead_URL(Dead_URL_cache, http->URL, http->code);
+				cache_dead_URL(Dead_URL_cache, http_URL_id(http), http->code);
 				cache_unlock(Dead_URL_cache);
 
 			default:
@@ -415,34 +576,62 @@ worker_crawl(void *args)
 		}
 
 		tree_lock();
-		BTREE_put_data(tree_archived, (void *)URL, strlen(URL));
+		rv = URL_SET_add(URLs_archived, URL_id);
 		tree_unlock();
 
-		if (URL_parseable(http->URL))
+		if (rv < 0)
 		{
-			queue_lock();
-			tree_lock();
+			put_error_msg("failed to record %s as archived", http->URL);
+			goto thread_exit;
+		}
 
-			parse_URLs(http, URL_queue, tree_archived);
+		if (URL_parseable(http->URL) && page_is_near_duplicate(http))
+		{
+			link_stream_release(&stream, 0);
 
-			tree_unlock();
-			queue_unlock();
+			if (NEAR_DUPS_NOFOLLOW == nwctx.config.near_dups && archive_page(http) < 0)
+				wlog("[0x%lx] Failed to archive %s\n", pthread_self(), http->URL);
 
-			transform_document_URLs(http);
+			goto next;
 		}
 
-		archive_page(http);
+		if (streamed)
+			link_stream_release(&stream, 1);
+
+		if (URL_parseable(http->URL) && (streamed || link_table_build(&links, http) >= 0))
+		{
+			if (!streamed)
+			{
+				queue_lock();
+				tree_lock();
+
+				rv = parse_URLs(http, &links, URL_queue, URLs_archived);
+
+				tree_unlock();
+				queue_unlock();
+
+				if (rv < 0)
+					put_error_msg("Failed to queue the links in %s", http->URL);
+			}
+
+			transform_document_URLs(http, &links);
+		}
+
+		if (archive_page(http) < 0)
+			wlog("[0x%lx] Failed to archive %s\n", pthread_self(), http->URL);
 
 	next:
 
 		pthread_mutex_lock(&Mutex_Reconnect);
 
+		rv = 0;
+
 		if (__do_reconnect)
 		{
 			http_disconnect(http);
-			http_connect(http);
+			rv = http_connect(http);
 
-			wlog("[0x%lx] Doing reconnect!\n");
+			wlog("[0x%lx] Doing reconnect!\n", pthread_self());
 
 			++nr_reconnected;
 
@@ -454,12 +643,38 @@ worker_crawl(void *args)
 		}
 
 		pthread_mutex_unlock(&Mutex_Reconnect);
+
+		/*
+		 * Still counted above, so the others
+		 * don't wait on us to reconnect.
+		 */
+		if (rv < 0)
+		{
+			put_error_msg("failed to reconnect to remote server");
+			goto thread_exit;
+		}
 	}
 
 thread_exit:
 
 	wlog("[0x%lx] Exiting\n", pthread_self());
 
+/*
+ * Give back our place in the asset lane if we
+ * leave holding one, or no one could take it.
+ */
+	queue_lock();
+	wt->page_depth = UINT_MAX;
+	if (asset)
+		--Nr_Asset_Fetches;
+	queue_unlock();
+
+	if (have_stream)
+		link_stream_destroy(&stream);
+
+	if (have_links)
+		link_table_destroy(&links);
+
 	if (http)
 	{
 		http_disconnect(http);
@@ -477,6 +692,12 @@ thread_fail:
 	worker_signal_fin(wt);
 	//worker_signal_eoc();
 
+	if (have_stream)
+		link_stream_destroy(&stream);
+
+	if (have_links)
+		link_table_destroy(&links);
+
 	if (http)
 	{
 		http_disconnect(http);
@@ -540,7 +761,12 @@ do_fast_mode(char *remote_host)
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
 	URL_queue = QUEUE_object_new();
-	tree_archived = BTREE_object_new();
+
+	if (!(URLs_archived = URL_SET_object_new()))
+	{
+		fprintf(stderr, "__fast_mode_init: failed to create set of archived URLs\n");
+		goto fail;
+	}
 
 	if (!(Dead_URL_cache = cache_create(
 			"dead_url_cache",
@@ -569,6 +795,7 @@ do_fast_mode(char *remote_host)
 		workers[i].idx = i;
 		workers[i].main_url = strdup(remote_host); /* give each their own copy of the main URL */
 		workers[i].runtime_options = runtime_options;
+		workers[i].page_depth = UINT_MAX;
 
 		if (option_set(OPT_CACHE_THRESHOLD))
 			workers[i].max_queue = nwctx.config.max_queue;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* for splice() */
 #include <arpa/inet.h>
 #include <assert.h>
 #include <arpa/inet.h>
@@ -8,12 +9,15 @@
 #include <netinet/in.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/ssl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include "buffer.h"
 #include "cache.h"
@@ -35,13 +39,32 @@
  *
  */
 
+/*
+ * Token bucket for limiting how fast we receive.
+ * TOKENS is the number of bytes we may read right
+ * now; it refills at RATE bytes per second up to
+ * one second's worth, and can go negative when
+ * several readers draw on it at once.
+ */
+struct rate_bucket
+{
+	pthread_mutex_t lock;
+	size_t rate;
+	double tokens;
+	struct timespec last;
+};
+
 typedef struct HTTP_Cookie
 {
-	char *whole_cookie;
+	char *whole_cookie; /* name=value, as we send it back */
 	size_t cookie_len;
-	time_t expires;
+	size_t name_len; /* length of the name part of WHOLE_COOKIE */
+	time_t expires; /* 0 for a session cookie */
 	char *for_path;
-	char *for_domain;
+	size_t path_len;
+	int host_only; /* no Domain attribute: only for the exact host that set it */
+	int secure;
+	struct HTTP_Cookie *next;
 } cookie_t;
 
 #define HTTP_VERSION_1_0 0x10000000u
@@ -116,11 +139,16 @@ struct HTTP_private
 	struct http_t http;
 
 	bucket_obj_t *headers;
-	cache_t *cookies;
-	bucket_obj_t *redirects;
+	int feed_blocks; /* pass the body being received to http->recv_block */
+	off_t block_off; /* offset in the read buffer up to which we have done so */
+	int splice_pipe[2]; /* for moving body data from the socket to the sink */
+	struct rate_bucket *host_rate; /* token bucket for RATE_HOST, NULL if unlimited */
+	char rate_host[HTTP_HOST_MAX+1];
+	EVP_MD_CTX *sink_digest; /* for http->body_digest */
+	int sink_digesting; /* everything written to the sink so far has gone into it */
 };
 
-void http_check_host(struct http_t *) __nonnull((1));
+int http_check_host(struct http_t *) __nonnull((1)) __wur;
 int http_connection_closed(struct http_t *) __nonnull((1)) __wur;
 
 static int send_request_1_1(struct http_t *);
@@ -157,21 +185,59 @@ struct HTTP_methods *Default_Version_Methods = &Methods_v1_1;
  * their current URL if we stumble upon another
  * URL on the site that would elicit a redirect.
  *
- * XXX
- *
- *	After a session, we should save these
- *	mappings in a compressed file in the
- *	event that we crawl the same site
- *	at a future date, sparing bandwidth
- *	wastage.
+ * There is one map for the whole process, so a
+ * redirect discovered by one fast-mode worker
+ * spares the others the round trip. The key of
+ * each bucket is the URL that elicited the
+ * redirect. Permanent redirects are saved to a
+ * file at the end of a session and loaded again
+ * at the start of the next one (see
+ * HTTP_redirects_save() and HTTP_redirects_load()).
  */
 struct HTTP_redirected
 {
-	char *fromURL; // The URL that elicits an HTTP redirect
-	char *toURL; // The URL found in the Location header field
 	time_t when; // When we first encountered the original URL
+	int code; // The 3xx code that told us about the redirect
+	size_t to_len;
+	char toURL[]; // The URL found in the Location header field ("" if it pointed back to itself)
 };
 
+#define HTTP_MAX_REDIRECT_HOPS 8
+#define HTTP_REDIRECTS_MAGIC "NWRD"
+#define HTTP_REDIRECTS_VERSION 1u
+#define HTTP_REDIRECTS_MAX_AGE (30 * 24 * 60 * 60) // don't trust saved mappings older than this
+
+static bucket_obj_t *HTTP_redirects = NULL;
+static pthread_rwlock_t HTTP_redirects_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * The cookie jar is shared by every HTTP object in the
+ * process so that a session cookie obtained by one
+ * fast-mode worker is presented by all of them.
+ *
+ * Cookies are indexed by the domain they are for (the
+ * bucket key, lower case without any leading '.'), and
+ * each domain's list is kept sorted by path length,
+ * longest first, which is the order RFC 6265 wants them
+ * sent in.
+ */
+static bucket_obj_t *HTTP_cookie_jar = NULL;
+static pthread_rwlock_t HTTP_cookie_jar_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void free_cookie_jar(void);
+
+/*
+ * Receive rate limits. One bucket is shared by every
+ * HTTP object and another is kept for each remote
+ * host, indexed by host name.
+ */
+static struct rate_bucket HTTP_global_rate = { PTHREAD_MUTEX_INITIALIZER, 0, 0.0, { 0, 0 } };
+static size_t HTTP_host_rate = 0;
+static bucket_obj_t *HTTP_host_rates = NULL;
+static pthread_mutex_t HTTP_host_rates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_host_rates(void);
+
 #ifdef DEBUG
 # define PATH_MAX_GUESS 1024
 static char *LOG_FILE = NULL;
@@ -200,6 +266,15 @@ _log(char *fmt, ...)
 static void
 __ctor HTTP_init(void)
 {
+	HTTP_redirects = BUCKET_object_new();
+	assert(HTTP_redirects);
+
+	HTTP_cookie_jar = BUCKET_object_new();
+	assert(HTTP_cookie_jar);
+
+	HTTP_host_rates = BUCKET_object_new();
+	assert(HTTP_host_rates);
+
 #ifdef DEBUG
 	char *userHome = getenv("HOME");
 	if (!userHome)
@@ -225,6 +300,17 @@ __ctor HTTP_init(void)
 static void
 __dtor private_fini(void)
 {
+	if (NULL != HTTP_redirects)
+		HTTP_redirects->destroy(HTTP_redirects, 0);
+
+	HTTP_redirects = NULL;
+
+	if (NULL != HTTP_cookie_jar)
+		free_cookie_jar();
+
+	if (NULL != HTTP_host_rates)
+		free_host_rates();
+
 #ifdef DEBUG
 	if (NULL != LOG_FILE)
 		free(LOG_FILE);
@@ -235,42 +321,6 @@ __dtor private_fini(void)
 	return;
 }
 
-static int
-cookie_cache_ctor(void *cookieObj)
-{
-	if (!cookieObj)
-		return -1;
-
-	cookie_t *cookie = (cookie_t *)cookieObj;
-
-	memset(cookie, 0, sizeof(*cookie));
-
-	cookie->whole_cookie = calloc(HTTP_ALIGN_SIZE(HTTP_COOKIE_MAX), 1);
-	cookie->for_path = calloc(HTTP_ALIGN_SIZE(HTTP_COOKIE_MAX), 1);
-	cookie->for_domain = calloc(HTTP_ALIGN_SIZE(HTTP_COOKIE_MAX), 1);
-
-	assert(cookie->whole_cookie);
-	assert(cookie->for_path);
-	assert(cookie->for_domain);
-
-	return 0;
-}
-
-static void
-cookie_cache_dtor(void *cookieObj)
-{
-	if (!cookieObj)
-		return;
-
-	cookie_t *cookie = (cookie_t *)cookieObj;
-
-	free(cookie->whole_cookie);
-	free(cookie->for_path);
-	free(cookie->for_domain);
-
-	return;
-}
-
 //#define LOG_FILE "./http_debug_log.txt"
 
 /*
@@ -302,138 +352,357 @@ use_rand:
 }
 */
 
+#define HTTP_COOKIE_ATTR_MAX 256
+
 static void
-parse_cookies(struct http_t *http)
+free_cookie(cookie_t *cookie)
 {
-	assert(http);
+	free(cookie->whole_cookie);
+	free(cookie->for_path);
+	free(cookie);
+}
 
-	struct HTTP_private *private = (struct HTTP_private *)http;
-	bucket_t *bucket = private->headers->get(private->headers, "set-cookie");
-	if (!bucket)
-		return;
+static void
+free_cookie_jar(void)
+{
+	bucket_t *bucket;
+	cookie_t *cookie;
+	cookie_t *next;
+	unsigned int i;
 
-	cache_clear_all(private->cookies);
+	for (i = 0; i < HTTP_cookie_jar->nr_buckets; ++i)
+	{
+		bucket = &HTTP_cookie_jar->buckets[i];
+		if (!bucket->used)
+			continue;
 
-	char *p = NULL;
-	char *q = NULL;
-	char *end = NULL;
-	cookie_t *cookie = NULL;
+		for (; bucket; bucket = bucket->next)
+		{
+			for (cookie = (cookie_t *)bucket->data; cookie; cookie = next)
+			{
+				next = cookie->next;
+				free_cookie(cookie);
+			}
+		}
+	}
+
+	HTTP_cookie_jar->destroy(HTTP_cookie_jar, BUCKET_FL_NO_FREE);
+	HTTP_cookie_jar = NULL;
+
+	return;
+}
+
+/*
+ * RFC 6265 5.1.3
+ */
+static int
+cookie_domain_match(const char *host, const char *domain, int host_only)
+{
+	size_t host_len = strlen(host);
+	size_t domain_len = strlen(domain);
+
+	if (!strcasecmp(host, domain))
+		return 1;
+
+	if (host_only || domain_len >= host_len)
+		return 0;
+
+	if (host[host_len - domain_len - 1] != '.')
+		return 0;
+
+	return !strcasecmp(host + (host_len - domain_len), domain);
+}
+
+/*
+ * RFC 6265 5.1.4
+ */
+static int
+cookie_path_match(const char *page, size_t page_len, const char *path, size_t path_len)
+{
+	if (path_len > page_len)
+		return 0;
+
+	if (strncmp(page, path, path_len))
+		return 0;
+
+	if (path_len == page_len
+	|| path[path_len - 1] == '/'
+	|| page[path_len] == '/'
+	|| page[path_len] == '?')
+		return 1;
 
-	while (bucket)
+	return 0;
+}
+
+/*
+ * The default path of a cookie is the directory
+ * of the page that set it.
+ */
+static void
+cookie_default_path(const char *page, char *path)
+{
+	const char *e = page + strcspn(page, "?");
+	const char *slash = NULL;
+	const char *p;
+
+	for (p = page; p < e; ++p)
 	{
-		cookie = cache_alloc(private->cookies, NULL);
+		if (*p == '/')
+			slash = p;
+	}
 
-		memcpy((void *)cookie->whole_cookie, bucket->data, bucket->data_len);
-		cookie->whole_cookie[bucket->data_len] = 0;
+	if (*page != '/' || !slash || slash == page)
+	{
+		strcpy(path, "/");
+		return;
+	}
 
-		p = (char *)bucket->data;
-		end = (char *)bucket->data + bucket->data_len;
+	memcpy(path, page, (slash - page));
+	path[slash - page] = 0;
 
-		q = memchr(p, ';', (end - p));
+	return;
+}
 
-		if (!q)
+/**
+ * Put COOKIE into the jar under DOMAIN, replacing
+ * any cookie with the same name and path. A cookie
+ * that has already expired just removes the old one.
+ */
+static void
+store_cookie(char *domain, cookie_t *cookie)
+{
+	bucket_t *bucket;
+	cookie_t *head;
+	cookie_t *c;
+	cookie_t *prev;
+	int expired = (cookie->expires && cookie->expires <= time(NULL));
+
+	pthread_rwlock_wrlock(&HTTP_cookie_jar_lock);
+
+	bucket = HTTP_cookie_jar->get(HTTP_cookie_jar, domain);
+	head = bucket ? (cookie_t *)bucket->data : NULL;
+
+	for (prev = NULL, c = head; c; prev = c, c = c->next)
+	{
+		if (c->name_len == cookie->name_len
+		&& !memcmp(c->whole_cookie, cookie->whole_cookie, c->name_len)
+		&& !strcmp(c->for_path, cookie->for_path))
 		{
-			bucket = bucket->next;
-			continue;
+			if (prev)
+				prev->next = c->next;
+			else
+				head = c->next;
+
+			free_cookie(c);
+			break;
 		}
+	}
 
-		p = ++q;
+	if (expired)
+	{
+		free_cookie(cookie);
+	}
+	else
+	{
+		for (prev = NULL, c = head; c && c->path_len >= cookie->path_len; prev = c, c = c->next)
+			;
 
-		while (1)
-		{
-			if (p >= end)
-				break;
+		cookie->next = c;
 
-			while (*p == ' ' && p < end)
-				++p;
+		if (prev)
+			prev->next = cookie;
+		else
+			head = cookie;
+	}
 
-			if (p == end)
-			{
-				break;
-			}
+	if (bucket)
+		bucket->data = (void *)head;
+	else
+	if (head)
+		HTTP_cookie_jar->put(HTTP_cookie_jar, domain, (void *)head, sizeof(cookie_t), BUCKET_FL_NO_COPY);
 
-			q = memchr(p, '=', (end - p));
+	pthread_rwlock_unlock(&HTTP_cookie_jar_lock);
 
-			if (!q)
-			{
-				break;
-			}
+	return;
+}
 
-			if (!memcmp((void *)p, (void *)"expires", 7))
-			{
-				char expiry[64];
+/**
+ * Parse one Set-Cookie header field value.
+ */
+static void
+parse_cookie(struct http_t *http, char *value, size_t value_len)
+{
+	assert(http);
+	assert(value);
+
+	char domain[HTTP_HOST_MAX+1];
+	char path[HTTP_URL_MAX+1];
+	char attr[HTTP_COOKIE_ATTR_MAX];
+	char *p = value;
+	char *q;
+	char *e;
+	char *end = value + value_len;
+	cookie_t *cookie = NULL;
+	time_t max_age_expires = 0;
+	int have_max_age = 0;
+	size_t len;
 
-				p = ++q;
-				q = memchr(p, ';', (end - p));
-				if (!q)
-					q = end;
+	if (value_len >= HTTP_COOKIE_MAX)
+		return;
 
-				memcpy((void *)expiry, (void *)p, (q - p));
-				expiry[q - p] = 0;
+	cookie = calloc(1, sizeof(cookie_t));
+	if (!cookie)
+		return;
 
-				cookie->expires = date_string_to_timestamp(expiry);
+	q = memchr(p, ';', (end - p));
+	if (!q)
+		q = end;
 
-				p = ++q;
-			}
-			else
-			if (!memcmp((void *)p, (void *)"domain", 6))
-			{
-				char domain[128];
+	while ((q - 1) > p && *(q - 1) == ' ')
+		--q;
 
-				p = ++q;
-				q = memchr(p, ';', (end  - p));
-				if (!q)
-					q = end;
+	e = memchr(p, '=', (q - p));
+	if (!e || e == p)
+		goto fail;
 
-				memcpy((void *)domain, (void *)p, (q - p));
-				domain[q - p] = 0;
+	cookie->name_len = (e - p);
+	cookie->cookie_len = (q - p);
+	cookie->whole_cookie = malloc(cookie->cookie_len + 1);
+	if (!cookie->whole_cookie)
+		goto fail;
 
-				memcpy((void *)cookie->for_domain, (void *)p, (q - p));
-				cookie->for_domain[q - p] = 0;
+	memcpy(cookie->whole_cookie, p, cookie->cookie_len);
+	cookie->whole_cookie[cookie->cookie_len] = 0;
 
-				p = ++q;
-			}
-			else
-			if (!memcmp((void *)p, (void *)"path", 4))
-			{
-				char Path[128];
+	assert(strlen(http->host) <= HTTP_HOST_MAX);
+	strcpy(domain, http->host);
+	cookie_default_path(http->page, path);
+	cookie->host_only = 1;
+
+	p = memchr(p, ';', (end - p));
+
+	while (p && p < end)
+	{
+		++p;
 
-				p = ++q;
-				q = memchr(p, ';', (end  - p));
-				if (!q)
-					q = end;
+		while (p < end && *p == ' ')
+			++p;
 
-				memcpy((void *)Path, (void *)p, (q - p));
-				Path[q - p] = 0;
+		q = memchr(p, ';', (end - p));
+		if (!q)
+			q = end;
 
-				memcpy((void *)cookie->for_path, (void *)p, (q - p));
-				cookie->for_path[q - p] = 0;
+		e = memchr(p, '=', (q - p));
 
-				p = ++q;
-			}
-			else
+		if (!e)
+		{
+			if (!strncasecmp("secure", p, (q - p)) && (q - p) == 6)
+				cookie->secure = 1;
+
+			p = (q < end ? q : NULL);
+			continue;
+		}
+
+		len = (q - (e + 1));
+		if (len >= HTTP_COOKIE_ATTR_MAX)
+			len = HTTP_COOKIE_ATTR_MAX - 1;
+
+		memcpy(attr, e + 1, len);
+		attr[len] = 0;
+
+		if (!strncasecmp("expires", p, 7) && (e - p) == 7)
+		{
+			cookie->expires = date_string_to_timestamp(attr);
+			if (cookie->expires < 0)
+				cookie->expires = 0;
+		}
+		else
+		if (!strncasecmp("max-age", p, 7) && (e - p) == 7)
+		{
+			long secs = strtol(attr, NULL, 10);
+
+			have_max_age = 1;
+			max_age_expires = (secs > 0 ? time(NULL) + secs : 1);
+		}
+		else
+		if (!strncasecmp("domain", p, 6) && (e - p) == 6)
+		{
+			char *d = attr;
+
+			while (*d == '.')
+				++d;
+
+			if (*d && strlen(d) <= HTTP_HOST_MAX)
 			{
-				p = ++q;
-				q = memchr(p, ';', (end - p));
-				if (!q)
-					break;
+				to_lower_case(d);
 
-				p = ++q;
+			/*
+			 * A server can't set cookies for
+			 * a domain that it isn't part of.
+			 */
+				if (!cookie_domain_match(http->host, d, 0))
+					goto fail;
+
+				strcpy(domain, d);
+				cookie->host_only = 0;
 			}
-		} // while (1)
+		}
+		else
+		if (!strncasecmp("path", p, 4) && (e - p) == 4)
+		{
+			if (attr[0] == '/')
+				strcpy(path, attr);
+		}
+
+		p = (q < end ? q : NULL);
+	}
+
+	if (have_max_age)
+		cookie->expires = max_age_expires;
+
+	to_lower_case(domain);
+
+	cookie->path_len = strlen(path);
+	cookie->for_path = strdup(path);
+	if (!cookie->for_path)
+		goto fail;
+
+	_log(
+		"Cookie\n\n"
+		"value: %s\n"
+		"expires timestamp: %ld\n"
+		"for domain: %s\n"
+		"for path: %s\n",
+		cookie->whole_cookie,
+		cookie->expires,
+		domain,
+		cookie->for_path);
+
+	store_cookie(domain, cookie);
+	return;
 
-		_log(
-			"Cookie\n\n"
-			"value: %s\n"
-			"expires timestamp: %ld\n"
-			"for domain: %s\n"
-			"for path: %s\n",
-			cookie->whole_cookie,
-			cookie->expires,
-			cookie->for_domain,
-			cookie->for_path);
+fail:
+	free(cookie->whole_cookie);
+	free(cookie->for_path);
+	free(cookie);
+
+	return;
+}
+
+static void
+parse_cookies(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = (struct HTTP_private *)http;
+	bucket_t *bucket = private->headers->get(private->headers, "set-cookie");
+
+	for (; bucket; bucket = bucket->next)
+	{
+		if (strcmp(bucket->key, "set-cookie"))
+			continue;
 
-		bucket = bucket->next;
+		parse_cookie(http, (char *)bucket->data, bucket->data_len);
 	}
 
 	return;
@@ -648,6 +917,16 @@ build_request_header_1_1(struct http_t *http)
 	free(header_buf);
 	header_buf = NULL;
 
+	if (GET == http->verb && http->resume_from > 0 && http->resume_validator[0])
+	{
+		char range[64];
+
+		snprintf(range, sizeof(range), "bytes=%lld-", (long long)http->resume_from);
+
+		append_header_1_1(http, "Range", range);
+		append_header_1_1(http, "If-Range", http->resume_validator);
+	}
+
 	append_cookies_1_1(http);
 
 	buf_destroy(&tmp);
@@ -670,6 +949,7 @@ rewrite_URL_protocol(struct http_t *http, char *replace, char *replacement)
 	buf_replace(&buf, replace, replacement);
 
 	strcpy(http->URL, (char *)buf.data);
+	http->URL_id = 0;
 	_log("URL: %s\n", http->URL);
 
 	return;
@@ -698,39 +978,311 @@ check_target_URL(struct http_t *http, int wantSecure)
 	return;
 }
 
-int
-send_request_1_1(struct http_t *http)
+/**
+ * Remember that FROMURL redirects to TOURL.
+ *
+ * @fromURL The URL that elicited the redirect
+ * @toURL The new location ("" if it pointed back to FROMURL)
+ * @code The 3xx status code
+ * @when When we first saw the redirect
+ */
+static void
+cache_redirect(char *fromURL, char *toURL, int code, time_t when)
 {
-	assert(http);
+	assert(fromURL);
+	assert(toURL);
 
-	//struct HTTP_private *private = (struct HTTP_private *)http;
+	struct HTTP_redirected *r;
+	bucket_t *bucket;
+	size_t to_len = strlen(toURL);
 
-	buf_t *buf = &http->conn.write_buf;
-	buf_clear(buf);
+	if (!*fromURL || to_len >= HTTP_URL_MAX)
+		return;
 
-	check_target_URL(http, http->usingSecure);
+	r = malloc(sizeof(*r) + to_len + 1);
+	if (!r)
+		return;
+
+	r->when = when;
+	r->code = code;
+	r->to_len = to_len;
+	memcpy(r->toURL, toURL, to_len);
+	r->toURL[to_len] = 0;
+
+	pthread_rwlock_wrlock(&HTTP_redirects_lock);
+
+	bucket = HTTP_redirects->get(HTTP_redirects, fromURL);
 
-/*
- * Check if this URL has a redirect URL that we cached.
- *
- * If the redirect we received was the exact same URL
- * as the redirected one, we put the empty string ""
- * in as the data for the key. Check for zero length
- * and return -1 if we find it.
- */
-	struct HTTP_private *private = (struct HTTP_private *)http;
-	bucket_t *bucket = private->redirects->get(private->redirects, http->URL);
 	if (bucket)
 	{
-		if (0 < strlen((char *)bucket->data))
-			memcpy(http->URL, bucket->data, bucket->data_len);
-		else
-			return -1;
+		r->when = ((struct HTTP_redirected *)bucket->data)->when;
+		free(bucket->data);
+		bucket->data = (void *)r;
+		bucket->data_len = sizeof(*r) + to_len + 1;
 	}
-	//set_verb(http, GET);
-	build_request_header_1_1(http);
-
-#ifdef DEBUG
+	else
+	{
+		HTTP_redirects->put(HTTP_redirects, fromURL, (void *)r, sizeof(*r) + to_len + 1, BUCKET_FL_NO_COPY);
+	}
+
+	pthread_rwlock_unlock(&HTTP_redirects_lock);
+
+	_log("Cached redirect %s => %s (%d)\n", fromURL, *toURL ? toURL : "(itself)", code);
+	return;
+}
+
+/**
+ * Replace URL with where it will end up according
+ * to the redirects we have seen so far, following
+ * chains of them (A => B => C).
+ *
+ * Returns 1 if URL was rewritten, 0 if there was
+ * nothing cached for it and -1 if it is known to
+ * redirect back to itself.
+ *
+ * @URL Buffer of at least HTTP_URL_MAX+1 bytes
+ */
+static int
+resolve_cached_redirect(char *URL)
+{
+	assert(URL);
+
+	struct HTTP_redirected *r;
+	bucket_t *bucket;
+	int hops;
+	int rewritten = 0;
+
+	pthread_rwlock_rdlock(&HTTP_redirects_lock);
+
+	for (hops = 0; hops < HTTP_MAX_REDIRECT_HOPS; ++hops)
+	{
+		bucket = HTTP_redirects->get(HTTP_redirects, URL);
+		if (!bucket)
+			break;
+
+		r = (struct HTTP_redirected *)bucket->data;
+
+		if (!r->to_len)
+		{
+			rewritten = -1;
+			break;
+		}
+
+		memcpy(URL, r->toURL, r->to_len);
+		URL[r->to_len] = 0;
+		rewritten = 1;
+	}
+
+	pthread_rwlock_unlock(&HTTP_redirects_lock);
+
+	return rewritten;
+}
+
+/**
+ * Save the permanent redirects we know about so the
+ * next session can skip the round trips. Temporary
+ * ones (302/303) are only trusted for this session.
+ *
+ * The file is a small header followed by packed
+ * records, in host byte order:
+ *
+ * "NWRD" | u32 version | u32 nr_records
+ * u64 when | u16 from_len | u16 to_len | from | to ...
+ *
+ * @path Where to save the redirects
+ */
+int
+HTTP_redirects_save(const char *path)
+{
+	assert(path);
+
+	FILE *fp = NULL;
+	bucket_t *bucket;
+	struct HTTP_redirected *r;
+	uint32_t version = HTTP_REDIRECTS_VERSION;
+	uint32_t nr_records = 0;
+	uint64_t when;
+	uint16_t from_len;
+	uint16_t to_len;
+	unsigned int i;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+
+	fwrite(HTTP_REDIRECTS_MAGIC, 1, 4, fp);
+	fwrite(&version, sizeof(version), 1, fp);
+	fwrite(&nr_records, sizeof(nr_records), 1, fp); /* patched below */
+
+	pthread_rwlock_rdlock(&HTTP_redirects_lock);
+
+	for (i = 0; i < HTTP_redirects->nr_buckets; ++i)
+	{
+		bucket = &HTTP_redirects->buckets[i];
+		if (!bucket->used)
+			continue;
+
+		for (; bucket; bucket = bucket->next)
+		{
+			r = (struct HTTP_redirected *)bucket->data;
+
+			if (HTTP_MOVED_PERMANENTLY != r->code)
+				continue;
+
+			if (r->to_len && strncmp("http", r->toURL, 4))
+				continue;
+
+			when = (uint64_t)r->when;
+			from_len = (uint16_t)strlen(bucket->key);
+			to_len = (uint16_t)r->to_len;
+
+			fwrite(&when, sizeof(when), 1, fp);
+			fwrite(&from_len, sizeof(from_len), 1, fp);
+			fwrite(&to_len, sizeof(to_len), 1, fp);
+			fwrite(bucket->key, 1, from_len, fp);
+			fwrite(r->toURL, 1, to_len, fp);
+
+			++nr_records;
+		}
+	}
+
+	pthread_rwlock_unlock(&HTTP_redirects_lock);
+
+	fseek(fp, 4 + sizeof(version), SEEK_SET);
+	fwrite(&nr_records, sizeof(nr_records), 1, fp);
+
+	if (fclose(fp) != 0)
+		return -1;
+
+	_log("Saved %u redirects to %s\n", nr_records, path);
+	return 0;
+}
+
+/**
+ * Load redirects saved by a previous session.
+ *
+ * @path The file written by HTTP_redirects_save()
+ */
+int
+HTTP_redirects_load(const char *path)
+{
+	assert(path);
+
+	FILE *fp = NULL;
+	char magic[4];
+	char fromURL[HTTP_URL_MAX];
+	char toURL[HTTP_URL_MAX];
+	uint32_t version;
+	uint32_t nr_records;
+	uint32_t i;
+	uint64_t when;
+	uint16_t from_len;
+	uint16_t to_len;
+	time_t now = time(NULL);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	if (fread(magic, 1, 4, fp) != 4
+	|| memcmp(magic, HTTP_REDIRECTS_MAGIC, 4)
+	|| fread(&version, sizeof(version), 1, fp) != 1
+	|| HTTP_REDIRECTS_VERSION != version
+	|| fread(&nr_records, sizeof(nr_records), 1, fp) != 1)
+		goto fail;
+
+	for (i = 0; i < nr_records; ++i)
+	{
+		if (fread(&when, sizeof(when), 1, fp) != 1
+		|| fread(&from_len, sizeof(from_len), 1, fp) != 1
+		|| fread(&to_len, sizeof(to_len), 1, fp) != 1)
+			goto fail;
+
+		if (from_len >= HTTP_URL_MAX || to_len >= HTTP_URL_MAX)
+			goto fail;
+
+		if (fread(fromURL, 1, from_len, fp) != from_len
+		|| fread(toURL, 1, to_len, fp) != to_len)
+			goto fail;
+
+		fromURL[from_len] = 0;
+		toURL[to_len] = 0;
+
+		if ((now - (time_t)when) > HTTP_REDIRECTS_MAX_AGE)
+			continue;
+
+		cache_redirect(fromURL, toURL, HTTP_MOVED_PERMANENTLY, (time_t)when);
+	}
+
+	fclose(fp);
+
+	_log("Loaded %u redirects from %s\n", nr_records, path);
+	return 0;
+
+fail:
+	fclose(fp);
+	return -1;
+}
+
+int
+send_request_1_1(struct http_t *http)
+{
+	assert(http);
+
+	buf_t *buf = &http->conn.write_buf;
+	char old_host[HTTP_HOST_MAX+1];
+
+	buf_clear(buf);
+
+	check_target_URL(http, http->usingSecure);
+
+/*
+ * Check if this URL has a redirect URL that we cached
+ * before doing any I/O. If the redirect we received
+ * was the exact same URL as the redirected one, we
+ * put the empty string "" in as the target; there is
+ * no point in asking again, so return -1.
+ */
+	switch(resolve_cached_redirect(http->URL))
+	{
+		case -1:
+
+			return -1;
+
+		case 1:
+
+			check_target_URL(http, http->usingSecure);
+			http->URL_len = strlen(http->URL);
+			http->URL_id = http->host_id = 0;
+
+			_log("Using cached redirect %s\n", http->URL);
+
+		/*
+		 * The cached location may well be on another
+		 * server (http => https, www., etc).
+		 */
+			assert(strlen(http->host) < HTTP_HOST_MAX);
+			strcpy(old_host, http->host);
+
+			http->ops->URL_parse_host(http->URL, http->host);
+			http->ops->URL_parse_page(http->URL, http->page);
+
+			if (strcmp(old_host, http->host))
+			{
+				if (http_reconnect(http) < 0)
+					goto fail;
+			}
+
+			break;
+
+		default:
+			break;
+	}
+
+	//set_verb(http, GET);
+	build_request_header_1_1(http);
+
+#ifdef DEBUG
 	_log("Request header:\n\n");
 	_log(buf->buf_head);
 #endif
@@ -758,6 +1310,268 @@ fail:
 	return -1;
 }
 
+static void
+free_host_rates(void)
+{
+	bucket_t *bucket;
+	struct rate_bucket *rb;
+	unsigned int i;
+
+	for (i = 0; i < HTTP_host_rates->nr_buckets; ++i)
+	{
+		bucket = &HTTP_host_rates->buckets[i];
+		if (!bucket->used)
+			continue;
+
+		for (; bucket; bucket = bucket->next)
+		{
+			rb = (struct rate_bucket *)bucket->data;
+			pthread_mutex_destroy(&rb->lock);
+			free(rb);
+		}
+	}
+
+	HTTP_host_rates->destroy(HTTP_host_rates, BUCKET_FL_NO_FREE);
+	HTTP_host_rates = NULL;
+
+	return;
+}
+
+static void
+rate_bucket_init(struct rate_bucket *rb, size_t rate)
+{
+	rb->rate = rate;
+	rb->tokens = (double)rate;
+	clock_gettime(CLOCK_MONOTONIC, &rb->last);
+
+	return;
+}
+
+/**
+ * Set the receive rate limits. Meant to be called
+ * once, before any HTTP objects are in use.
+ *
+ * @global_rate Bytes per second for all connections together
+ * @host_rate Bytes per second for each remote host
+ */
+void
+HTTP_set_rate_limits(size_t global_rate, size_t host_rate)
+{
+	pthread_mutex_lock(&HTTP_global_rate.lock);
+	rate_bucket_init(&HTTP_global_rate, global_rate);
+	pthread_mutex_unlock(&HTTP_global_rate.lock);
+
+	pthread_mutex_lock(&HTTP_host_rates_lock);
+	HTTP_host_rate = host_rate;
+	pthread_mutex_unlock(&HTTP_host_rates_lock);
+
+	return;
+}
+
+/*
+ * Find (or create) the bucket for the host HTTP is
+ * talking to, remembering it until the host changes.
+ */
+static struct rate_bucket *
+http_host_rate(struct http_t *http)
+{
+	struct HTTP_private *private = HTTP_private(http);
+	struct rate_bucket *rb = NULL;
+	bucket_t *bucket;
+
+	if (!HTTP_host_rate)
+		return NULL;
+
+	if (private->host_rate && !strcmp(private->rate_host, http->host))
+		return private->host_rate;
+
+	pthread_mutex_lock(&HTTP_host_rates_lock);
+
+	bucket = HTTP_host_rates->get(HTTP_host_rates, http->host);
+
+	if (bucket)
+	{
+		rb = (struct rate_bucket *)bucket->data;
+	}
+	else
+	if ((rb = malloc(sizeof(*rb))))
+	{
+		pthread_mutex_init(&rb->lock, NULL);
+		rate_bucket_init(rb, HTTP_host_rate);
+		HTTP_host_rates->put(HTTP_host_rates, http->host, (void *)rb, sizeof(*rb), BUCKET_FL_NO_COPY);
+	}
+
+	pthread_mutex_unlock(&HTTP_host_rates_lock);
+
+	private->host_rate = rb;
+	strncpy(private->rate_host, http->host, HTTP_HOST_MAX);
+	private->rate_host[HTTP_HOST_MAX] = 0;
+
+	return rb;
+}
+
+/*
+ * Top up the bucket for the time passed since we
+ * last did. Caller holds RB->lock.
+ */
+static void
+rate_bucket_refill(struct rate_bucket *rb)
+{
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	elapsed = (double)(now.tv_sec - rb->last.tv_sec) +
+		(double)(now.tv_nsec - rb->last.tv_nsec) / 1000000000.0;
+
+	rb->last = now;
+	rb->tokens += elapsed * (double)rb->rate;
+
+	if (rb->tokens > (double)rb->rate)
+		rb->tokens = (double)rb->rate;
+
+	return;
+}
+
+static double
+rate_bucket_available(struct rate_bucket *rb)
+{
+	double tokens;
+
+	pthread_mutex_lock(&rb->lock);
+	rate_bucket_refill(rb);
+	tokens = rb->tokens;
+	pthread_mutex_unlock(&rb->lock);
+
+	return tokens;
+}
+
+static void
+rate_bucket_take(struct rate_bucket *rb, size_t bytes)
+{
+	pthread_mutex_lock(&rb->lock);
+	rb->tokens -= (double)bytes;
+	pthread_mutex_unlock(&rb->lock);
+
+	return;
+}
+
+/*
+ * We don't bother reading anything smaller than
+ * this while waiting on the limits (unless the
+ * limit itself is smaller).
+ */
+#define HTTP_RATE_MIN_READ 1024
+
+/**
+ * Wait until the rate limits allow us to receive some
+ * data, and return how much of WANT we may read. While
+ * a bucket is short, we sleep for as long as it takes to
+ * refill it at its rate and then look again. Call
+ * http_rate_charge() with the number of bytes actually
+ * read.
+ *
+ * @http The HTTP object
+ * @want The number of bytes the caller would like to read
+ */
+static size_t
+http_rate_wait(struct http_t *http, size_t want)
+{
+	struct rate_bucket *host_rb = http_host_rate(http);
+	double avail;
+	double tokens;
+	double wait;
+	struct timespec ts;
+	size_t need;
+
+	if (!HTTP_global_rate.rate && !host_rb)
+		return want;
+
+	need = (want < HTTP_RATE_MIN_READ ? want : HTTP_RATE_MIN_READ);
+
+	if (HTTP_global_rate.rate && need > HTTP_global_rate.rate)
+		need = HTTP_global_rate.rate;
+	if (host_rb && need > host_rb->rate)
+		need = host_rb->rate;
+
+	while (1)
+	{
+		avail = (double)want;
+		wait = 0.0;
+
+		if (HTTP_global_rate.rate)
+		{
+			tokens = rate_bucket_available(&HTTP_global_rate);
+			if (tokens < avail)
+				avail = tokens;
+			if (tokens < (double)need)
+				wait = ((double)need - tokens) / (double)HTTP_global_rate.rate;
+		}
+
+		if (host_rb)
+		{
+			tokens = rate_bucket_available(host_rb);
+			if (tokens < avail)
+				avail = tokens;
+			if (tokens < (double)need && ((double)need - tokens) / (double)host_rb->rate > wait)
+				wait = ((double)need - tokens) / (double)host_rb->rate;
+		}
+
+		if (avail >= (double)need)
+			break;
+
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1000000000.0) + 1;
+
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			++ts.tv_sec;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		nanosleep(&ts, NULL);
+	}
+
+	return (size_t)avail;
+}
+
+static void
+http_rate_charge(struct http_t *http, size_t bytes)
+{
+	struct HTTP_private *private = HTTP_private(http);
+
+	if (HTTP_global_rate.rate)
+		rate_bucket_take(&HTTP_global_rate, bytes);
+
+	if (private->host_rate && HTTP_host_rate)
+		rate_bucket_take(private->host_rate, bytes);
+
+	return;
+}
+
+/*
+ * Read up to TOREAD bytes from the connection into
+ * BUF, within the receive rate limits.
+ */
+static ssize_t
+http_recv(struct http_t *http, buf_t *buf, size_t toread)
+{
+	ssize_t n;
+
+	toread = http_rate_wait(http, toread);
+
+	if (http->usingSecure)
+		n = buf_read_tls(http_tls(http), buf, toread);
+	else
+		n = buf_read_socket(http_socket(http), buf, toread);
+
+	if (n > 0)
+		http_rate_charge(http, (size_t)n);
+
+	return n;
+}
+
 #define CYCLES_MAX 100000000
 
 static int
@@ -782,10 +1596,7 @@ read_until_eoh(struct http_t *http, char **p)
 			return HTTP_OPERATION_TIMEOUT;
 		}
 
-		if (http->usingSecure)
-			n = buf_read_tls(http_tls(http), buf, HTTP_SMALL_READ_BLOCK);
-		else
-			n = buf_read_socket(http_socket(http), buf, HTTP_SMALL_READ_BLOCK);
+		n = http_recv(http, buf, HTTP_SMALL_READ_BLOCK);
 
 		if (n == -1)
 		{
@@ -810,92 +1621,348 @@ read_until_eoh(struct http_t *http, char **p)
 				if (!strstr(buf->buf_head, "HTTP/") && strncmp("\r\n", buf->buf_head, 2))
 					goto out;
 
-				*p = strstr(buf->buf_head, HTTP_EOH_SENTINEL);
+				*p = strstr(buf->buf_head, HTTP_EOH_SENTINEL);
+
+				if (*p)
+				{
+					is_http = 1;
+					goto out;
+				}
+		}
+	}
+
+out:
+
+	if (is_http)
+	{
+		assert(!strncmp(HTTP_EOH_SENTINEL, *p, strlen(HTTP_EOH_SENTINEL)));
+		*p += strlen(HTTP_EOH_SENTINEL);
+	}
+
+	_log("Returning %d bytes\n", bytes);
+	return bytes;
+}
+
+#ifdef DEBUG
+static void
+__dump_buf(buf_t *buf)
+{
+	assert(buf);
+
+	int fd = -1;
+
+	fd = open("./DUMPED_BUF.LOG", O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	
+	if (fd != -1)
+	{
+		buf_write_fd(fd, buf);
+		sync();
+		close(fd);
+		fd = -1;
+	}
+
+	return;
+}
+#endif
+
+static ssize_t
+read_bytes(struct http_t *http, size_t toread)
+{
+	assert(http);
+	assert(toread > 0);
+
+	ssize_t n;
+	size_t read = 0;
+	size_t r = toread;
+	buf_t *buf = &http->conn.read_buf;
+	register int cycles = 0;
+
+/*
+ * XXX
+ *
+ * CYCLES_MAX is our crude way of
+ * deciding we have timed out.
+ */
+	while (r)
+	{
+		++cycles;
+		if (cycles > CYCLES_MAX)
+			break;
+
+		n = http_recv(http, buf, r);
+
+		if (n < 0)
+			return -1;
+		else
+		if (!n)
+			continue;
+		else
+		{
+			r -= n;
+			read += n;
+		}
+	}
+
+	return read;
+}
+
+static int
+http_sink_write(struct http_t *http, char *p, size_t len)
+{
+	struct HTTP_private *private = HTTP_private(http);
+	ssize_t n;
+
+	if (private->sink_digesting && EVP_DigestUpdate(private->sink_digest, p, len) != 1)
+		private->sink_digesting = 0;
+
+	while (len)
+	{
+		n = write(http->sink_fd, p, len);
+
+		if (n < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			_log("%s: write to sink failed (%s)\n", __func__, strerror(errno));
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Start hashing a body on its way to the sink.
+ * Returns non-zero if we are.
+ */
+static int
+http_digest_start(struct HTTP_private *private)
+{
+	if (!private->sink_digest && !(private->sink_digest = EVP_MD_CTX_new()))
+		return 0;
+
+	return (EVP_DigestInit_ex(private->sink_digest, EVP_sha256(), NULL) == 1);
+}
+
+/**
+ * Hand the body data in the read buffer from BODY_OFF
+ * up to UPTO to the sink and remove it from the buffer,
+ * leaving the response header where it is.
+ *
+ * @http The HTTP object
+ * @body_off Offset of the first byte after the header
+ * @upto Offset of the end of the data to flush
+ */
+static ssize_t
+http_sink_flush(struct http_t *http, off_t body_off, off_t upto)
+{
+	assert(http);
+
+	buf_t *buf = &http->conn.read_buf;
+	char *p = buf->buf_head + body_off;
+	size_t len = (size_t)(upto - body_off);
+
+	if (HTTP_SINK_MEMORY == http->sink_fd || !len)
+		return 0;
+
+	if (HTTP_SINK_DISCARD != http->sink_fd)
+	{
+		if (http_sink_write(http, p, len) < 0)
+			return -1;
+	}
+
+	buf_collapse(buf, body_off, len);
+
+	return (ssize_t)len;
+}
+
+/*
+ * With a plain socket and a file to put the body
+ * in, the kernel can move the data from one to
+ * the other without it passing through our
+ * read buffer.
+ */
+#ifdef __linux__
+# define http_can_splice(h) ((!(h)->usingSecure || (h)->conn.ktls_recv) && (h)->sink_fd >= 0)
+#else
+# define http_can_splice(h) 0
+#endif
+
+static void
+http_close_splice_pipe(struct HTTP_private *private)
+{
+	if (-1 == private->splice_pipe[0])
+		return;
+
+	close(private->splice_pipe[0]);
+	close(private->splice_pipe[1]);
+
+	private->splice_pipe[0] = -1;
+	private->splice_pipe[1] = -1;
+
+	return;
+}
+
+/**
+ * Move the next LEN bytes of the body from the
+ * socket to the sink with splice() via a pipe.
+ * Only call this when http_can_splice() and the
+ * read buffer holds nothing beyond the header.
+ *
+ * @http The HTTP object
+ * @len Number of bytes to move
+ */
+static ssize_t
+http_splice_body(struct http_t *http, size_t len)
+{
+	assert(http);
+
+#ifdef __linux__
+	struct HTTP_private *private = HTTP_private(http);
+	struct pollfd pfd;
+	size_t total = 0;
+	size_t in_pipe;
+	size_t want;
+	ssize_t n;
+
+	if (-1 == private->splice_pipe[0])
+	{
+		if (pipe(private->splice_pipe) < 0)
+		{
+			_log("%s: pipe() failed (%s)\n", __func__, strerror(errno));
+			private->splice_pipe[0] = private->splice_pipe[1] = -1;
+			return -1;
+		}
+	}
+
+	pfd.fd = http_socket(http);
+	pfd.events = POLLIN;
+
+/*
+ * With kTLS, OpenSSL may already have taken some of
+ * the body off the socket while we were reading the
+ * header. That has to go to the sink first.
+ */
+	if (http->usingSecure)
+	{
+		char pending[HTTP_SMALL_READ_BLOCK];
+
+		while (total < len && SSL_pending(http_tls(http)) > 0)
+		{
+			want = http_rate_wait(http, ((len - total) < sizeof(pending) ? (len - total) : sizeof(pending)));
+			n = SSL_read(http_tls(http), pending, want);
+
+			if (n <= 0)
+				return -1;
+
+			http_rate_charge(http, (size_t)n);
+
+			if (http_sink_write(http, pending, (size_t)n) < 0)
+				return -1;
+
+			total += n;
+		}
+	}
+
+/*
+ * The rest never passes through us to be hashed.
+ */
+	if (total < len)
+		private->sink_digesting = 0;
+
+	while (total < len)
+	{
+		want = http_rate_wait(http, (len - total));
+		n = splice(http_socket(http), NULL, private->splice_pipe[1], NULL,
+				want, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+		if (!n)
+		{
+			_log("%s: connection closed with %lu bytes of body to go\n", __func__, (len - total));
+			return -1;
+		}
+		else
+		if (n < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+			{
+				n = poll(&pfd, 1, HTTP_MAX_WAIT_TIME * 1000);
+
+				if (n > 0 || (n < 0 && EINTR == errno))
+					continue;
 
-				if (*p)
-				{
-					is_http = 1;
-					goto out;
-				}
+				_log("%s: timed out waiting for body data\n", __func__);
+				return -1;
+			}
+
+			_log("%s: splice from socket failed (%s)\n", __func__, strerror(errno));
+			return -1;
 		}
-	}
 
-out:
+		in_pipe = (size_t)n;
+		http_rate_charge(http, in_pipe);
 
-	if (is_http)
-	{
-		assert(!strncmp(HTTP_EOH_SENTINEL, *p, strlen(HTTP_EOH_SENTINEL)));
-		*p += strlen(HTTP_EOH_SENTINEL);
-	}
+		while (in_pipe)
+		{
+			n = splice(private->splice_pipe[0], NULL, http->sink_fd, NULL, in_pipe, SPLICE_F_MOVE);
 
-	_log("Returning %d bytes\n", bytes);
-	return bytes;
-}
+			if (n <= 0)
+			{
+				if (n < 0 && EINTR == errno)
+					continue;
 
-#ifdef DEBUG
-static void
-__dump_buf(buf_t *buf)
-{
-	assert(buf);
+				_log("%s: splice to sink failed (%s)\n", __func__, strerror(errno));
 
-	int fd = -1;
+			/*
+			 * Don't leave stale data in the pipe
+			 * to be written into the next file.
+			 */
+				http_close_splice_pipe(private);
+				return -1;
+			}
 
-	fd = open("./DUMPED_BUF.LOG", O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
-	
-	if (fd != -1)
-	{
-		buf_write_fd(fd, buf);
-		sync();
-		close(fd);
-		fd = -1;
+			in_pipe -= n;
+			total += n;
+		}
 	}
 
-	return;
-}
+	return (ssize_t)total;
+#else
+	(void)len;
+	return -1;
 #endif
+}
 
-static ssize_t
-read_bytes(struct http_t *http, size_t toread)
+/**
+ * Pass the body data received since the last call,
+ * up to offset UPTO in the read buffer, to the
+ * caller's recv_block hook.
+ */
+static void
+http_feed_block(struct http_t *http, off_t upto)
 {
 	assert(http);
-	assert(toread > 0);
 
-	ssize_t n;
-	size_t read = 0;
-	size_t r = toread;
+	struct HTTP_private *private = HTTP_private(http);
 	buf_t *buf = &http->conn.read_buf;
-	register int cycles = 0;
-
-/*
- * XXX
- *
- * CYCLES_MAX is our crude way of
- * deciding we have timed out.
- */
-	while (r)
-	{
-		++cycles;
-		if (cycles > CYCLES_MAX)
-			break;
 
-		if (http->usingSecure)
-			n = buf_read_tls(http_tls(http), buf, r);
-		else
-			n = buf_read_socket(http_socket(http), buf, r);
+	if (!private->feed_blocks)
+		return;
 
-		if (n < 0)
-			return -1;
-		else
-		if (!n)
-			continue;
-		else
-		{
-			r -= n;
-			read += n;
-		}
+	if (upto > private->block_off)
+	{
+		http->recv_block(http, buf->buf_head + private->block_off, (size_t)(upto - private->block_off));
+		private->block_off = upto;
 	}
 
-	return read;
+	return;
 }
 
 #define HTTP_MAX_CHUNK_STR 10
@@ -1023,7 +2090,7 @@ read_until_next_chunk_size(struct http_t *http, buf_t *buf, char **cur_pos)
  * Ends with sequence \r\n0\r\n
  *
  */
-static size_t
+static ssize_t
 do_chunked_recv(struct http_t *http)
 {
 	assert(http);
@@ -1048,6 +2115,11 @@ do_chunked_recv(struct http_t *http)
 #endif
 #endif
 
+	struct HTTP_private *private = HTTP_private(http);
+	off_t body_off;
+	ssize_t n;
+	ssize_t flushed;
+
 	p = HTTP_EOH(buf);
 
 	while (!p)
@@ -1062,6 +2134,9 @@ do_chunked_recv(struct http_t *http)
 		return -1;
 	}
 
+	body_off = (p - buf->buf_head);
+	private->block_off = body_off;
+
 	read_until_next_chunk_size(http, buf, &p);
 
 	while (1)
@@ -1142,10 +2217,14 @@ do_chunked_recv(struct http_t *http)
 		{
 /*
  * Then we just dealt with the last chunk and there are no more to come.
- * Collapse the buffer to get rid of the final "0\r\n" sequence.
+ * Collapse the buffer to get rid of the final "0\r\n" sequence (the
+ * \r\n before it was already collapsed above, so P is on the '0').
  */
-			--p;
 			buf_collapse(buf, (off_t)(p - buf->buf_head), (buf->buf_tail - p));
+
+			if (http_sink_flush(http, body_off, (off_t)(buf->buf_tail - buf->buf_head)) < 0)
+				return -1;
+
 			break;
 		}
 
@@ -1182,17 +2261,55 @@ do_chunked_recv(struct http_t *http)
 /*
  * Check if we already received some of the chunk data.
  */
-		if (overread >= chunk_size)
-		{
-			p = (e + save_size);
-			read_until_next_chunk_size(http, buf, &p);
-		}
-		else
+		flushed = 0;
+
+		if (overread < chunk_size)
 		{
 			chunk_size -= overread;
-		}
 
-		read_bytes(http, chunk_size);
+			if (http_can_splice(http))
+			{
+				n = http_sink_flush(http, body_off, (off_t)(buf->buf_tail - buf->buf_head));
+				if (n < 0)
+					return -1;
+
+				flushed += n;
+
+				n = http_splice_body(http, chunk_size);
+				if (n < 0)
+					return -1;
+
+				flushed += n;
+				chunk_size = 0;
+			}
+
+/*
+ * Read the rest of the chunk in blocks. If the body is
+ * going to a sink, everything up to the tail of the
+ * buffer is chunk data at this point, so hand it over
+ * after each block rather than holding the whole chunk.
+ */
+			while (chunk_size)
+			{
+				n = read_bytes(http, (chunk_size < HTTP_SINK_BLOCK ? chunk_size : HTTP_SINK_BLOCK));
+
+				if (n <= 0)
+				{
+					_log("%s: read_bytes() returned %ld\n", __func__, (long)n);
+					return -1;
+				}
+
+				chunk_size -= n;
+
+				http_feed_block(http, (off_t)(buf->buf_tail - buf->buf_head));
+
+				n = http_sink_flush(http, body_off, (off_t)(buf->buf_tail - buf->buf_head));
+				if (n < 0)
+					return -1;
+
+				flushed += n;
+			}
+		}
 
 #if 0
 /*
@@ -1209,12 +2326,14 @@ do_chunked_recv(struct http_t *http)
  * After this, P should be pointing to where the initial
  * \r is/will be in the "\r\nchunk_size\r\n" sequence.
  */
-		p = (buf->buf_head + chunk_offset + save_size);
+		p = (buf->buf_head + chunk_offset + save_size - flushed);
+		http_feed_block(http, (off_t)(p - buf->buf_head));
+
 		read_until_next_chunk_size(http, buf, &p);
 	}
 
 	_log("Returning %lu from %s\n", total_bytes, __func__);
-	return total_bytes;
+	return (ssize_t)total_bytes;
 }
 
 /**
@@ -1241,6 +2360,7 @@ set_new_location(struct http_t *http)
 
 	assert(bucket->data_len < HTTP_URL_MAX);
 	strcpy(http->URL, (char *)bucket->data);
+	http->URL_id = http->host_id = 0;
 
 	_log("Got new location: %s\n", (char *)bucket->data);
 
@@ -1322,7 +2442,7 @@ _drain_socket(struct http_t *http)
 	while (1)
 	{
 		ret = read_bytes(http, block);
-		if (ret < block || 0 == ret)
+		if (ret < (ssize_t)block || 0 == ret)
 			break;
 		_log("Drained %ld bytes from socket\n", ret);
 	}
@@ -1330,6 +2450,35 @@ _drain_socket(struct http_t *http)
 	return;
 }
 
+#define http_clear_resume(h) \
+do {\
+	(h)->resume_from = 0;\
+	(h)->resume_validator[0] = 0;\
+} while (0)
+
+/**
+ * Check that a 206 response starts where we asked
+ * it to (Content-Range: bytes START-END/TOTAL).
+ */
+static int
+http_range_matches(struct http_t *http)
+{
+	assert(http);
+
+	char *range = fetch_header_1_1(http, "content-range");
+	char *p;
+
+	if (!range || http->resume_from <= 0)
+		return 0;
+
+	if (strncasecmp("bytes ", range, 6))
+		return 0;
+
+	p = range + 6;
+
+	return (strtoll(p, NULL, 10) == (long long)http->resume_from);
+}
+
 /**
  * recv_response_1_1 - receive HTTP response.
  * @http HTTP object
@@ -1369,6 +2518,8 @@ recv_response_1_1(struct http_t *http)
 rp_receive:
 
 	total_bytes = 0;
+	http->body_sunk = 0;
+	private->feed_blocks = 0;
 	buf_clear(&http->conn.read_buf);
 /*
  * This wasn't being reset to NULL, so everytime
@@ -1399,6 +2550,12 @@ rp_receive:
 	if (0 > _rv)
 		return -1;
 
+	if (HTTP_PARTIAL_CONTENT == code && !http_range_matches(http))
+	{
+		_log("206 response for a range we did not ask for\n");
+		goto fail;
+	}
+
 /*
  * With HEAD, always send back the code
  * we received. With a GET, we will follow
@@ -1428,6 +2585,8 @@ rp_receive:
 
 			if (!http->followRedirects)
 				break;
+
+			http_clear_resume(http);
 /*
  * Cache the URL that caused the redirect.
  */
@@ -1449,21 +2608,35 @@ rp_receive:
 		 * Still need to receive the body of the HTML page
 		 * that comes with the redirect header.
 		 */
-			bucket_obj_t *bObjR = private->redirects;
-			if (!memcmp(tmpURL, http->URL, strlen(http->URL)))
+			if (!strcmp(tmpURL, http->URL))
 			{
-				bObjR->put(bObjR, (void *)tmpURL, (void *)"", strlen(http->URL), 0);
+				cache_redirect(tmpURL, "", code, time(NULL));
 				needResend = 0;
 			}
 			else
 			{
-				bObjR->put(bObjR, (void *)tmpURL, (void *)http->URL, strlen(http->URL), 0);
+				cache_redirect(tmpURL, http->URL, code, time(NULL));
 				needResend = 1;
 			}
 
 			break;
 	}
 
+/*
+ * Let the caller take the body of the page as
+ * it arrives instead of us holding all of it.
+ */
+	if ((HTTP_OK == code || HTTP_PARTIAL_CONTENT == code) && http->sink_open)
+		http->sink_fd = http->sink_open(http);
+
+	http->body_digest_valid = 0;
+
+	if (HTTP_OK == code && http->digest_sink && http->sink_fd >= 0)
+		private->sink_digesting = http_digest_start(private);
+
+	if (HTTP_OK == code && http->recv_block && HTTP_SINK_MEMORY == http->sink_fd)
+		private->feed_blocks = 1;
+
 	bucket_t *bucket = NULL;
 	bucket = bObj->get(bObj, "transfer-encoding");
 
@@ -1482,20 +2655,37 @@ rp_receive:
 
 	if (bucket)
 	{
+		off_t body_off = (p - buf->buf_head);
+
 		clen = strtoul((char *)bucket->data, NULL, 0);
 
 		overread = (buf->buf_tail - p);
 
+		private->block_off = body_off;
+		http_feed_block(http, (off_t)(buf->buf_tail - buf->buf_head));
+
+		if (http_sink_flush(http, body_off, (off_t)(buf->buf_tail - buf->buf_head)) < 0)
+			goto fail;
+
 		if (overread < clen)
 		{
 			clen -= overread;
 
+			if (http_can_splice(http))
+			{
+				bytes = http_splice_body(http, clen);
+				if (bytes < 0)
+					goto fail;
+
+				total_bytes += (int)bytes;
+				clen = 0;
+			}
+
 			while (clen)
 			{
-				if (http->usingSecure)
-					bytes = buf_read_tls(http_tls(http), buf, clen);
-				else
-					bytes = buf_read_socket(http_socket(http), buf, clen);
+				size_t toread = (HTTP_SINK_MEMORY == http->sink_fd || clen < HTTP_SINK_BLOCK ? clen : HTTP_SINK_BLOCK);
+
+				bytes = http_recv(http, buf, toread);
 
 				if (bytes < 0)
 				{
@@ -1511,6 +2701,11 @@ rp_receive:
 				{
 					total_bytes += (int)bytes;
 					clen -= bytes;
+
+					http_feed_block(http, (off_t)(buf->buf_tail - buf->buf_head));
+
+					if (http_sink_flush(http, body_off, (off_t)(buf->buf_tail - buf->buf_head)) < 0)
+						goto fail;
 				}
 			}
 		}
@@ -1524,6 +2719,20 @@ rp_receive:
 
 done_reading:
 
+	if (HTTP_SINK_MEMORY != http->sink_fd)
+	{
+		if (private->sink_digesting && EVP_DigestFinal_ex(private->sink_digest, http->body_digest, NULL) == 1)
+			http->body_digest_valid = 1;
+
+		private->sink_digesting = 0;
+
+		if (http->sink_close)
+			http->sink_close(http, http->sink_fd, 0);
+
+		http->sink_fd = HTTP_SINK_MEMORY;
+		http->body_sunk = 1;
+	}
+
 	if (needResend)
 	{
 		_log("Resending request to web server\n");
@@ -1534,9 +2743,23 @@ done_reading:
 	}
 
 out:
+	http_clear_resume(http);
 	return total_bytes;
 
 fail:
+	http_clear_resume(http);
+
+	if (HTTP_SINK_MEMORY != http->sink_fd)
+	{
+		private->sink_digesting = 0;
+
+		if (http->sink_close)
+			http->sink_close(http, http->sink_fd, 1);
+
+		http->sink_fd = HTTP_SINK_MEMORY;
+		http->body_sunk = 1; /* what we got of it went to the sink */
+	}
+
 	_drain_socket(http);
 	return -1;
 }
@@ -1601,6 +2824,9 @@ code_as_string(struct http_t *http)
 			//sprintf(code_string, "%s%u OK%s", COL_DARKGREEN, HTTP_OK, COL_END);
 			return "200 OK";
 			break;
+		case HTTP_PARTIAL_CONTENT:
+			return "206 Partial content";
+			break;
 		case HTTP_MOVED_PERMANENTLY:
 			//sprintf(code_string, "%s%u Moved Permanently%s", COL_ORANGE, HTTP_MOVED_PERMANENTLY, COL_END);
 			return "301 Moved permanently";
@@ -1929,46 +3155,101 @@ fetch_header_1_1(struct http_t *http, char *key)
 	return (char *)bucket->data;
 }
 
+/**
+ * Add a single Cookie header field with every cookie
+ * in the jar that is for this host and page.
+ */
 void
 append_cookies_1_1(struct http_t *http)
 {
 	assert(http);
 
-	struct HTTP_private *private = (struct HTTP_private *)http;
-
-	bucket_t *bucket = private->headers->get(private->headers, "set-cookie");
-
-	if (!bucket)
-		return;
-
 	buf_t *buf = &http->conn.write_buf;
 	buf_t tmp;
 	char *p = HTTP_EOH(buf);
+	char *domain;
+	char host[HTTP_HOST_MAX+1];
+	size_t page_len = strlen(http->page);
+	bucket_t *bucket;
+	cookie_t *cookie;
+	time_t now = time(NULL);
+	int nr_cookies = 0;
 
 	if (!p)
 		return;
 
 	p -= 2;
 
-	buf_init(&tmp, HTTP_COOKIE_MAX+256);
+	assert(strlen(http->host) <= HTTP_HOST_MAX);
+	strcpy(host, http->host);
+	to_lower_case(host);
+
+	tmp.magic = 0;
+	if (buf_init(&tmp, HTTP_COOKIE_MAX+256) < 0)
+		return;
+
+	if (buf_append(&tmp, "Cookie: ") < 0)
+		goto out_destroy_tmp;
+
+	pthread_rwlock_rdlock(&HTTP_cookie_jar_lock);
 
-	while (bucket)
+/*
+ * Cookies set for a parent domain also apply, so try
+ * www.site.com, then site.com (but not com).
+ */
+	for (domain = host; domain; domain = strchr(domain, '.'))
 	{
-		buf_append(&tmp, "Cookie: ");
-		buf_append_ex(&tmp, (char *)bucket->data, bucket->data_len);
-		buf_append_ex(&tmp, HTTP_EOL, 2);
+		if (*domain == '.')
+		{
+			++domain;
+			if (!strchr(domain, '.'))
+				break;
+		}
 
-		buf_shift(buf, (off_t)(p - buf->buf_head), tmp.data_len);
+		bucket = HTTP_cookie_jar->get(HTTP_cookie_jar, domain);
+		if (!bucket)
+			continue;
+
+		for (cookie = (cookie_t *)bucket->data; cookie; cookie = cookie->next)
+		{
+			if (cookie->expires && cookie->expires <= now)
+				continue;
+
+			if (cookie->secure && !http->usingSecure)
+				continue;
+
+			if (cookie->host_only && domain != host)
+				continue;
+
+			if (!cookie_path_match(http->page, page_len, cookie->for_path, cookie->path_len))
+				continue;
 
-		strncpy(p, tmp.buf_head, tmp.data_len);
+			if ((nr_cookies && buf_append(&tmp, "; ") < 0)
+			|| buf_append_ex(&tmp, cookie->whole_cookie, cookie->cookie_len) < 0)
+			{
+			/*
+			 * Better to send none than a header cut short.
+			 */
+				nr_cookies = 0;
+				goto out_unlock;
+			}
 
-		p += tmp.data_len;
+			++nr_cookies;
+		}
+	}
 
-		buf_clear(&tmp);
+out_unlock:
 
-		bucket = bucket->next;
+	pthread_rwlock_unlock(&HTTP_cookie_jar_lock);
+
+	if (nr_cookies && buf_append_ex(&tmp, HTTP_EOL, 2) == 0)
+	{
+		buf_shift(buf, (off_t)(p - buf->buf_head), tmp.data_len);
+		memcpy((void *)p, (void *)tmp.buf_head, tmp.data_len);
 	}
 
+out_destroy_tmp:
+
 	buf_destroy(&tmp);
 }
 
@@ -2017,8 +3298,9 @@ append_header_1_1(struct http_t *http, char *field_name, char *field_value)
  * The URL for which the next request is to be
  * made may be on a different server. We would
  * need establish a new connection in that case.
+ * Returns -1 if that failed.
  */
-void
+int
 http_check_host(struct http_t *http)
 {
 	assert(http);
@@ -2027,21 +3309,16 @@ http_check_host(struct http_t *http)
 	//struct HTTP_private *private = (struct HTTP_private *)http;
 
 	if (!http->URL[0])
-		return;
+		return 0;
 
 	assert(strlen(http->host) < HTTP_HNAME_MAX);
 	strcpy(old_host, http->host);
 	http->ops->URL_parse_host(http->URL, http->host);
 
 	if (strcmp(http->host, old_host))
-	{
-		//if (cache_nr_used(private->cookies) > 0)
-		//	cache_clear_all(private->cookies);
-
-		http_reconnect(http);
-	}
+		return http_reconnect(http);
 
-	return;
+	return 0;
 }
 
 /**
@@ -2069,26 +3346,12 @@ static int
 HTTP_init_object(struct HTTP_private *private, uint32_t id)
 {
 	struct http_t *http;
-	char cache_name[128];
 
 	http = (struct http_t *)private;
 	http->id = id;
 
 	private->headers = BUCKET_object_new();
-	snprintf(cache_name, 128, "HTTP_cookie_cache-%x", id);
-
-	private->cookies = cache_create(
-			cache_name,
-			sizeof(cookie_t),
-			0,
-			cookie_cache_ctor,
-			cookie_cache_dtor);
-
-	if (!private->cookies)
-		goto fail;
-
-	private->redirects = BUCKET_object_new();
-	if (!private->redirects)
+	if (!private->headers)
 		goto fail;
 
 	http->host = calloc(HTTP_HOST_MAX+1, 1);
@@ -2100,6 +3363,32 @@ HTTP_init_object(struct HTTP_private *private, uint32_t id)
 	http->ops = Default_Version_Methods;
 	http->version = HTTP_DEFAULT_VERSION;
 
+	http->URL_id = 0;
+	http->host_id = 0;
+	http->depth = 0;
+
+	http->sink_open = NULL;
+	http->sink_close = NULL;
+	http->sink_fd = HTTP_SINK_MEMORY;
+	http->body_sunk = 0;
+
+	http->recv_block = NULL;
+	http->hook_data = NULL;
+	http_clear_resume(http);
+	private->feed_blocks = 0;
+	private->block_off = 0;
+	private->splice_pipe[0] = -1;
+	private->splice_pipe[1] = -1;
+	private->host_rate = NULL;
+	private->rate_host[0] = 0;
+	private->sink_digest = NULL;
+	private->sink_digesting = 0;
+	http->digest_sink = 0;
+	http->body_digest_valid = 0;
+
+	http->conn.ktls_send = 0;
+	http->conn.ktls_recv = 0;
+
 	if (buf_init(&http->conn.read_buf, HTTP_DEFAULT_READ_BUF_SIZE) < 0)
 	{
 		fprintf(stderr, "HTTP_init_object: failed to initialise read buf\n");
@@ -2127,12 +3416,6 @@ fail:
 	if (private->headers)
 		private->headers->destroy(private->headers, 0);
 
-	if (private->cookies)
-		cache_destroy(private->cookies);
-
-	if (private->redirects)
-		private->redirects->destroy(private->redirects, 0);
-
 	return -1;
 }
 
@@ -2179,9 +3462,10 @@ HTTP_delete(struct http_t *http)
 	free(http->URL);
 
 	private->headers->destroy(private->headers, 0);
-	private->redirects->destroy(private->redirects, 0);
-	cache_clear_all(private->cookies);
-	cache_destroy(private->cookies);
+	http_close_splice_pipe(private);
+
+	if (private->sink_digest)
+		EVP_MD_CTX_free(private->sink_digest);
 
 	buf_destroy(&http->conn.read_buf);
 	buf_destroy(&http->conn.write_buf);
@@ -2218,6 +3502,59 @@ __init_openssl(void)
 	ERR_load_crypto_strings();
 }
 
+/**
+ * http_tls_connect - do the TLS handshake on the connected socket
+ * @http: HTTP object
+ *
+ * We ask OpenSSL to hand the record layer to the kernel
+ * (kTLS) once the handshake is done. Whether it could
+ * depends on the OpenSSL build, the kernel having the
+ * tls module and the cipher agreed on, so check after.
+ */
+static int
+http_tls_connect(struct http_t *http)
+{
+	assert(http);
+
+	http->conn.ktls_send = 0;
+	http->conn.ktls_recv = 0;
+
+	http->conn.ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
+	if (!http->conn.ssl_ctx)
+		goto fail;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(http->conn.ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	http_tls(http) = SSL_new(http->conn.ssl_ctx);
+	if (!http_tls(http))
+		goto fail;
+
+	SSL_set_fd(http_tls(http), http_socket(http)); /* Set the socket for reading/writing */
+	SSL_set_connect_state(http_tls(http)); /* Set as client */
+
+	if (SSL_connect(http_tls(http)) != 1)
+	{
+		_log("TLS handshake with %s failed\n", http->host);
+		goto fail;
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	http->conn.ktls_send = BIO_get_ktls_send(SSL_get_wbio(http_tls(http)));
+	http->conn.ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(http_tls(http)));
+#endif
+
+	_log("kTLS send %s, receive %s\n",
+		http->conn.ktls_send ? "on" : "off",
+		http->conn.ktls_recv ? "on" : "off");
+
+	return 0;
+
+fail:
+	return -1;
+}
+
 /**
  * http_connect - set up a connection with the target site
  * @http: HTTP object with remote host information
@@ -2281,11 +3618,9 @@ http_connect(struct http_t *http)
  * pthread_once() to do it once only.
  */
 		pthread_once(&__ossl_init_once, __init_openssl);
-		http->conn.ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-		http_tls(http) = SSL_new(http->conn.ssl_ctx);
 
-		SSL_set_fd(http_tls(http), http_socket(http)); /* Set the socket for reading/writing */
-		SSL_set_connect_state(http_tls(http)); /* Set as client */
+		if (http_tls_connect(http) < 0)
+			goto fail_release_ainf;
 	}
 
 	http->conn.sock_nonblocking = 0;
@@ -2316,6 +3651,8 @@ http_disconnect(struct http_t *http)
 		SSL_free(http_tls(http));
 		http->conn.ssl_ctx = NULL;
 		http_tls(http) = NULL;
+		http->conn.ktls_send = 0;
+		http->conn.ktls_recv = 0;
 	}
 
 	return;
@@ -2338,6 +3675,8 @@ http_reconnect(struct http_t *http)
 		SSL_free(http_tls(http));
 		http->conn.ssl_ctx = NULL;
 		http_tls(http) = NULL;
+		http->conn.ktls_send = 0;
+		http->conn.ktls_recv = 0;
 	}
 
 	clear_struct(&sock4);
@@ -2381,11 +3720,8 @@ http_reconnect(struct http_t *http)
 
 	if (http->usingSecure)
 	{
-		http->conn.ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-		http_tls(http) = SSL_new(http->conn.ssl_ctx);
-
-		SSL_set_fd(http_tls(http), http_socket(http)); // Set the socket for reading/writing
-		SSL_set_connect_state(http_tls(http)); // Set as client
+		if (http_tls_connect(http) < 0)
+			goto fail_release_ainf;
 	}
 
 	http->conn.sock_nonblocking = 0;
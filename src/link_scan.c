@@ -0,0 +1,673 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "http.h"
+#include "link_scan.h"
+#include "netwasabi.h"
+#include "utils_url.h"
+
+/**
+ * Initialise a link scanner.
+ *
+ * @scanner The scanner
+ * @found Called with a buffer holding each URL found
+ * @arg Stored in the scanner for FOUND to use
+ */
+int
+link_scanner_init(struct link_scanner *scanner, void (*found)(struct link_scanner *, buf_t *), void *arg)
+{
+	assert(scanner);
+	assert(found);
+
+	if (buf_init(&scanner->url, HTTP_URL_MAX) < 0)
+		return -1;
+
+	scanner->found = found;
+	scanner->arg = arg;
+
+	link_scanner_reset(scanner);
+
+	return 0;
+}
+
+/**
+ * Forget any partial match, ready for a new document.
+ */
+void
+link_scanner_reset(struct link_scanner *scanner)
+{
+	assert(scanner);
+
+	memset(scanner->matched, 0, sizeof(scanner->matched));
+	scanner->in_url = -1;
+	scanner->too_long = 0;
+	scanner->off = 0;
+	scanner->url_off = 0;
+
+	buf_clear(&scanner->url);
+
+	return;
+}
+
+static void
+__append_url(struct link_scanner *scanner, char *data, size_t len)
+{
+	if (scanner->too_long || !len)
+		return;
+
+	if ((scanner->url.data_len + len) >= HTTP_URL_MAX)
+	{
+		scanner->too_long = 1;
+		return;
+	}
+
+/*
+ * Drop the URL, as we would one too long,
+ * rather than report part of it.
+ */
+	if (buf_append_ex(&scanner->url, data, len) < 0)
+		scanner->too_long = 1;
+
+	return;
+}
+
+/**
+ * Scan the next block of the document.
+ *
+ * None of the url_types strings repeat their first
+ * character, so if a byte breaks a partial match we
+ * only need to check whether it starts a new one.
+ *
+ * SCANNER->off is taken to be where the block is in
+ * the document, so that the found callback can know
+ * where each URL is (SCANNER->url_off); it is moved
+ * on past the block before we return.
+ *
+ * @scanner The scanner
+ * @data The block
+ * @len Length of the block
+ */
+void
+link_scanner_feed(struct link_scanner *scanner, char *data, size_t len)
+{
+	assert(scanner);
+	assert(data);
+
+	char *p = data;
+	char *e;
+	char *end = (data + len);
+	char delim;
+	int i;
+
+	while (p < end)
+	{
+		if (scanner->in_url >= 0)
+		{
+			delim = url_types[scanner->in_url].delim;
+			e = memchr(p, delim, (end - p));
+
+			if (!e)
+			{
+				__append_url(scanner, p, (end - p));
+				break;
+			}
+
+			__append_url(scanner, p, (e - p));
+
+			if (!scanner->too_long && scanner->url.data_len)
+			{
+				BUF_NULL_TERMINATE(&scanner->url);
+				scanner->found(scanner, &scanner->url);
+			}
+
+			scanner->in_url = -1;
+			scanner->too_long = 0;
+			buf_clear(&scanner->url);
+
+			p = ++e;
+			continue;
+		}
+
+		for (i = 0; url_types[i].delim != 0; ++i)
+		{
+			if (*p == url_types[i].string[scanner->matched[i]])
+				++scanner->matched[i];
+			else
+				scanner->matched[i] = (*p == url_types[i].string[0]);
+
+			if (scanner->matched[i] == url_types[i].len)
+			{
+				memset(scanner->matched, 0, sizeof(scanner->matched));
+				scanner->in_url = i;
+				scanner->url_off = (scanner->off + (size_t)(p + 1 - data));
+				break;
+			}
+		}
+
+		++p;
+	}
+
+	scanner->off += len;
+
+	return;
+}
+
+void
+link_scanner_destroy(struct link_scanner *scanner)
+{
+	assert(scanner);
+
+	buf_destroy(&scanner->url);
+
+	return;
+}
+
+/**
+ * Find the next link in DATA, starting at offset *POS,
+ * in a single pass over the document.
+ *
+ * Every url_types string ends with '=' and then the
+ * delimiter, so we let memchr() skip to each '=' and
+ * only then see which (if any) of the patterns ends
+ * there. *POS is left just after the closing delimiter.
+ * Returns 1 if a link was found, 0 at the end of DATA.
+ *
+ * @data The document
+ * @len Length of the document
+ * @pos Offset to start from, updated for the next call
+ * @span Set to where the URL is
+ */
+int
+link_span_next(const char *data, size_t len, size_t *pos, struct link_span *span)
+{
+	assert(data);
+	assert(pos);
+	assert(span);
+
+	const char *end = (data + len);
+	const char *p = (data + *pos);
+	const char *eq;
+	const char *url;
+	const char *close;
+	size_t plen;
+	int i;
+
+	while (p < end)
+	{
+		eq = memchr(p, '=', (end - p));
+
+		if (!eq || (eq + 1) >= end)
+			break;
+
+		p = (eq + 1);
+
+		for (i = 0; url_types[i].delim != 0; ++i)
+		{
+			plen = (url_types[i].len - 2); /* bytes before the '=' */
+
+			if (*p != url_types[i].delim || (size_t)(eq - data) < plen)
+				continue;
+
+			if (memcmp((eq - plen), url_types[i].string, plen))
+				continue;
+
+			url = (p + 1);
+			close = memchr(url, url_types[i].delim, (end - url));
+
+			if (!close)
+			{
+				*pos = len;
+				return 0;
+			}
+
+			span->off = (size_t)(url - data);
+			span->len = (size_t)(close - url);
+			span->delim = url_types[i].delim;
+
+			*pos = (size_t)(close - data) + 1;
+			return 1;
+		}
+	}
+
+	*pos = len;
+	return 0;
+}
+
+#define LINK_TABLE_DEFAULT_SIZE 256
+
+int
+link_table_init(struct link_table *table)
+{
+	assert(table);
+
+	table->links = calloc(LINK_TABLE_DEFAULT_SIZE, sizeof(struct link));
+	if (!table->links)
+		goto fail;
+
+	table->nr_links = 0;
+	table->nr_allocated = LINK_TABLE_DEFAULT_SIZE;
+
+	table->strings.magic = 0;
+	table->doc.magic = 0;
+	table->full.magic = 0;
+	table->name.magic = 0;
+	table->path.magic = 0;
+
+	if (buf_init(&table->strings, (LINK_TABLE_DEFAULT_SIZE * 64)) < 0)
+		goto fail_destroy_bufs;
+
+	if (buf_init(&table->doc, HTTP_URL_MAX) < 0)
+		goto fail_destroy_bufs;
+
+	if (buf_init(&table->full, HTTP_URL_MAX) < 0)
+		goto fail_destroy_bufs;
+
+	if (buf_init(&table->name, HTTP_URL_MAX) < 0)
+		goto fail_destroy_bufs;
+
+	if (buf_init(&table->path, HTTP_URL_MAX) < 0)
+		goto fail_destroy_bufs;
+
+	return 0;
+
+fail_destroy_bufs:
+
+	if (buf_integrity(&table->strings))
+		buf_destroy(&table->strings);
+	if (buf_integrity(&table->doc))
+		buf_destroy(&table->doc);
+	if (buf_integrity(&table->full))
+		buf_destroy(&table->full);
+	if (buf_integrity(&table->name))
+		buf_destroy(&table->name);
+
+	free(table->links);
+	table->links = NULL;
+
+fail:
+
+	return -1;
+}
+
+/*
+ * Add a null-terminated copy of STR to the table's
+ * strings and return its offset there.
+ */
+static int
+__link_table_save(struct link_table *table, buf_t *str, size_t *off)
+{
+	*off = (size_t)(table->strings.buf_tail - table->strings.buf_head);
+
+	if (buf_append_ex(&table->strings, str->buf_head, str->data_len) < 0)
+		return -1;
+
+	buf_pull_tail(&table->strings, 1);
+	*(table->strings.buf_tail - 1) = 0;
+
+	return 0;
+}
+
+/**
+ * Empty the table, ready for the links of the document
+ * HTTP is about to receive (or has received).
+ */
+int
+link_table_start(struct link_table *table, struct http_t *http)
+{
+	assert(table);
+	assert(http);
+
+	table->nr_links = 0;
+	buf_clear(&table->strings);
+
+/*
+ * Links are rewritten relative to where this
+ * document is in the archive.
+ */
+	buf_clear(&table->name);
+
+	if (buf_append(&table->name, http->URL) < 0)
+		return -1;
+
+	return local_archive_name(&table->name, &table->doc);
+}
+
+/**
+ * Add the link URL, found at offset OFF in the document,
+ * to the table and work out its full URL and the path of
+ * its copy in the archive, relative to the document's own.
+ * Returns the new link, or NULL if we ran out of memory.
+ *
+ * @table The link table, set up with link_table_start()
+ * @http The HTTP object the document was received with
+ * @URL The URL as it is in the document, null terminated
+ * @off Where it is in the document
+ */
+struct link *
+link_table_add(struct link_table *table, struct http_t *http, buf_t *URL, size_t off)
+{
+	assert(table);
+	assert(http);
+	assert(URL);
+
+	struct link *link;
+	struct link *links;
+	buf_t *full = &table->full;
+
+	if (table->nr_links >= table->nr_allocated)
+	{
+		links = realloc(table->links, (table->nr_allocated * 2 * sizeof(struct link)));
+		if (!links)
+			return NULL;
+
+		table->links = links;
+		table->nr_allocated *= 2;
+	}
+
+	link = &table->links[table->nr_links++];
+	link->off = off;
+	link->len = URL->data_len;
+	link->full_len = 0;
+	link->local_len = 0;
+	link->id = URL_ID_NONE;
+
+	if (make_full_url(http, URL, full) < 0 || !full->data_len)
+		return link;
+
+	if (__link_table_save(table, full, &link->full_off) < 0)
+		return NULL;
+
+	link->full_len = full->data_len;
+	link->id = URL_ARENA_intern(URL_arena, full->buf_head, full->data_len);
+
+/*
+ * This is how transform_document_URLs()
+ * has always decided what to leave alone.
+ */
+	if (!strncmp("http://", URL->buf_head, URL->data_len) || !strncmp("https://", URL->buf_head, URL->data_len))
+		return link;
+
+	if (local_archive_name(full, &table->name) < 0
+	|| make_relative_url(table->doc.buf_head, table->name.buf_head, &table->path) < 0
+	|| !table->path.data_len)
+		return link;
+
+	if (__link_table_save(table, &table->path, &link->local_off) < 0)
+		return NULL;
+
+	link->local_len = table->path.data_len;
+
+	return link;
+}
+
+/**
+ * Find the links in the document in HTTP's read
+ * buffer and add them all to the table. For pages
+ * that weren't scanned by a link stream as they
+ * arrived.
+ *
+ * @table The link table, emptied first
+ * @http The HTTP object holding the document
+ */
+int
+link_table_build(struct link_table *table, struct http_t *http)
+{
+	assert(table);
+	assert(http);
+
+	buf_t *buf = &http_rbuf(http);
+	size_t doc_len = (buf->buf_tail - buf->buf_head);
+	size_t pos = 0;
+	struct link_span span;
+	buf_t url;
+
+	if (link_table_start(table, http) < 0)
+		goto fail;
+
+	url.magic = 0;
+	if (buf_init(&url, HTTP_URL_MAX) < 0)
+		goto fail;
+
+	while (link_span_next(buf->buf_head, doc_len, &pos, &span))
+	{
+		if (!span.len || span.len >= HTTP_URL_MAX)
+			continue;
+
+		buf_clear(&url);
+
+		if (buf_append_ex(&url, (buf->buf_head + span.off), span.len) < 0)
+			goto fail_destroy_url;
+
+		BUF_NULL_TERMINATE(&url);
+
+		if (!link_table_add(table, http, &url, span.off))
+			goto fail_destroy_url;
+	}
+
+	buf_destroy(&url);
+
+	return table->nr_links;
+
+fail_destroy_url:
+
+	buf_destroy(&url);
+
+fail:
+
+	table->nr_links = 0;
+	return -1;
+}
+
+void
+link_table_destroy(struct link_table *table)
+{
+	assert(table);
+
+	free(table->links);
+	table->links = NULL;
+	table->nr_links = table->nr_allocated = 0;
+
+	buf_destroy(&table->strings);
+	buf_destroy(&table->doc);
+	buf_destroy(&table->full);
+	buf_destroy(&table->name);
+	buf_destroy(&table->path);
+
+	return;
+}
+
+static void
+__lock_stream(struct link_stream *stream)
+{
+	if (stream->queue_mutex)
+		pthread_mutex_lock(stream->queue_mutex);
+	if (stream->archived_mutex)
+		pthread_mutex_lock(stream->archived_mutex);
+
+	return;
+}
+
+static void
+__unlock_stream(struct link_stream *stream)
+{
+	if (stream->archived_mutex)
+		pthread_mutex_unlock(stream->archived_mutex);
+	if (stream->queue_mutex)
+		pthread_mutex_unlock(stream->queue_mutex);
+
+	return;
+}
+
+static void
+link_stream_found(struct link_scanner *scanner, buf_t *url)
+{
+	struct link_stream *stream = (struct link_stream *)scanner->arg;
+	struct link *link;
+
+	if (stream->failed)
+		return;
+
+	if (!(link = link_table_add(stream->table, stream->http, url, scanner->url_off)))
+	{
+		stream->failed = 1;
+		return;
+	}
+
+	if (stream->defer || URL_ID_NONE == link->id)
+		return;
+
+	__lock_stream(stream);
+
+	if (enqueue_URL_id_if_acceptable(stream->http, stream->queue, stream->archived, link->id) > 0)
+		++stream->nr_found;
+
+	__unlock_stream(stream);
+
+	return;
+}
+
+static void
+link_stream_block(struct http_t *http, char *data, size_t len)
+{
+	struct link_stream *stream = (struct link_stream *)http->hook_data;
+
+	if (!stream->active)
+		return;
+
+/*
+ * Links are kept by where they are in the read
+ * buffer, which is where transform_document_URLs()
+ * will look for them.
+ */
+	stream->scanner.off = (size_t)(data - http_rbuf(http).buf_head);
+	stream->fed = 1;
+
+	link_scanner_feed(&stream->scanner, data, len);
+
+	return;
+}
+
+/**
+ * Set up a link stream and register it with HTTP.
+ *
+ * @stream The link stream
+ * @table Table to put the links of each page in
+ * @http The HTTP object pages are received with
+ * @queue Queue to add URLs to
+ * @archived IDs of the URLs already archived
+ * @queue_mutex Held while adding to QUEUE (may be NULL)
+ * @archived_mutex Held while looking in ARCHIVED (may be NULL)
+ */
+int
+link_stream_init(struct link_stream *stream, struct link_table *table, struct http_t *http,
+		queue_obj_t *queue, url_set_t *archived, pthread_mutex_t *queue_mutex, pthread_mutex_t *archived_mutex)
+{
+	assert(stream);
+	assert(table);
+	assert(http);
+	assert(queue);
+	assert(archived);
+
+	if (link_scanner_init(&stream->scanner, link_stream_found, (void *)stream) < 0)
+		return -1;
+
+	stream->table = table;
+	stream->http = http;
+	stream->queue = queue;
+	stream->archived = archived;
+	stream->queue_mutex = queue_mutex;
+	stream->archived_mutex = archived_mutex;
+	stream->active = 0;
+	stream->fed = 0;
+	stream->failed = 0;
+	stream->nr_found = 0;
+	stream->defer = 0;
+
+	http->recv_block = link_stream_block;
+	http->hook_data = (void *)stream;
+
+	return 0;
+}
+
+/**
+ * Start scanning the page about to be received.
+ */
+void
+link_stream_start(struct link_stream *stream)
+{
+	assert(stream);
+
+	link_scanner_reset(&stream->scanner);
+	stream->nr_found = 0;
+	stream->fed = 0;
+	stream->failed = (link_table_start(stream->table, stream->http) < 0);
+	stream->defer = (NEAR_DUPS_FOLLOW != nwctx.config.near_dups);
+	stream->active = 1;
+
+	return;
+}
+
+/**
+ * Stop scanning. Returns non-zero if the page just
+ * received was scanned as it arrived, in which case
+ * its links are all in the stream's table and the
+ * caller need neither build the table nor call
+ * parse_URLs().
+ */
+int
+link_stream_finish(struct link_stream *stream)
+{
+	assert(stream);
+
+	int scanned = (stream->active && stream->fed && !stream->failed);
+
+	stream->active = 0;
+
+	return scanned;
+}
+
+/**
+ * Queue the URLs of the links held back while the
+ * page was being received if FOLLOW, else leave them.
+ */
+void
+link_stream_release(struct link_stream *stream, int follow)
+{
+	assert(stream);
+
+	int nr;
+
+	if (!follow || !stream->defer)
+		return;
+
+	stream->defer = 0;
+
+	__lock_stream(stream);
+	nr = parse_URLs(stream->http, stream->table, stream->queue, stream->archived);
+	__unlock_stream(stream);
+
+	if (nr < 0)
+		put_error_msg("Failed to queue the links in %s", stream->http->URL);
+	else
+		stream->nr_found += nr;
+
+	return;
+}
+
+void
+link_stream_destroy(struct link_stream *stream)
+{
+	assert(stream);
+
+	if (stream->http->hook_data == (void *)stream)
+	{
+		stream->http->recv_block = NULL;
+		stream->http->hook_data = NULL;
+	}
+
+	link_scanner_destroy(&stream->scanner);
+
+	return;
+}
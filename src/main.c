@@ -12,10 +12,11 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
-#include "btree.h"
+#include "archive_index.h"
 #include "buffer.h"
 #include "cache.h"
 #include "cache_management.h"
+#include "content_store.h"
 #include "fast_mode.h"
 #include "hash_bucket.h"
 #include "http.h"
@@ -23,7 +24,11 @@
 #include "netwasabi.h"
 #include "queue.h"
 #include "screen_utils.h"
+#include "sitemap.h"
 #include "string_utils.h"
+#include "url_arena.h"
+#include "url_filter.h"
+#include "url_traps.h"
 #include "utils_url.h"
 #include "xml.h"
 
@@ -35,6 +40,13 @@ static char *home_dir = NULL;
  */
 struct netwasabi_ctx nwctx = {0};
 
+/*
+ * Every URL we see is interned here once; the
+ * queues, sets and caches hold only its ID.
+ */
+url_arena_t *URL_arena = NULL;
+url_filter_t *URL_filter = NULL;
+
 size_t httplen; // length of "http://"
 size_t httpslen; // length of "https://"
 
@@ -43,7 +55,7 @@ pthread_attr_t thread_screen_attr;
 pthread_mutex_t screen_mutex;
 
 static queue_obj_t *URL_queue = NULL;
-static btree_obj_t *tree_archived = NULL;
+static url_set_t *URLs_archived = NULL;
 static bucket_obj_t *bObj_hashed_opts = NULL;
 
 static int FAST_MODE = 0;
@@ -63,6 +75,8 @@ struct url_types url_types[] =
 
 int path_max = 0;
 
+int get_opts(int, char *[]);
+
 static void
 __ctor __wr_init(void)
 {
@@ -181,12 +195,24 @@ static void
 __noret usage(int exit_status)
 {
 	fprintf(stderr,
-		"netwasabi <url> [options]\n\n"
+		"netwasabi <url> [--max-rate <rate>] [--host-rate <rate>]\n"
+		"                [--exclude <rule>] [--include <rule>] [--sitemaps]\n"
+		"                [--near-duplicates follow|nofollow|skip] [--no-dedup]\n"
+		"                [--depth <n>]\n\n"
 		"\n"
 		"NetWasabi crawls websites and archives the pages on the local machine.\n"
-		"URLs embedded within HTML documents are modified to use the \"file://\"\n"
-		"protocol and point to the absolute path of the document on the local\n"
-		"machine.\n"
+		"URLs embedded within HTML documents are modified to point to the\n"
+		"archived copy of the document by a path relative to the page they\n"
+		"are in, so that the archive can be moved or served as it is.\n"
+		"\n"
+		"The robots.txt file of each web server is obeyed: URLs it disallows\n"
+		"are not fetched, and its Crawl-delay (if longer than crawlDelay) is\n"
+		"waited between requests, even in fast mode.\n"
+		"\n"
+		"URLs that look like crawler traps (repeating path segments, page\n"
+		"numbers or offsets counting up in the query, calendars, and deep\n"
+		"chains of directories with few links in each) are followed only so\n"
+		"far; the patterns left out are listed in ${HOME}/.NetWasabi/traps.\n"
 		"\n"
 		"Runtime options can be set in the config.xml file in ${HOME}/.NetWasabi\n"
 		"directory. Runtime options include:\n"
@@ -194,9 +220,10 @@ __noret usage(int exit_status)
 		"crawlDelay: the number of seconds to wait before sending another GET\n"
 		"request to the remote web server;\n"
 		"\n"
-		"crawlDepth: the depth at which NetWasabi should stop crawling. For example,\n"
-		"when all the URLs that were parsed from a downloaded document have been\n"
-		"visited, that increments the current depth by 1.\n"
+		"crawlDepth: how many links away from the first page NetWasabi goes.\n"
+		"The pages the first page links to are at depth 1, the pages they link\n"
+		"to at depth 2, and so on; each depth is crawled before the next. 0\n"
+		"means no limit. Also set with --depth.\n"
 		"\n"
 		"queueMax: This is the maximum number of URLs allowed to be in the queue\n"
 		"at any one time waiting to be downloaded from the webserver.\n"
@@ -209,6 +236,42 @@ __noret usage(int exit_status)
 		"embedded within an HTML document that belong to another remote web server.\n"
 		"This can result in arching pages from unwanted ads.\n"
 		"\n"
+		"maxRate: the maximum number of bytes per second to receive over all\n"
+		"connections together. A K or M suffix means kilobytes or megabytes.\n"
+		"0 (the default) means no limit. Also set with --max-rate.\n"
+		"\n"
+		"hostRate: the same, but for each remote web server. Also set with\n"
+		"--host-rate.\n"
+		"\n"
+		"dropTrackingParams, sortQuery, stripSessionIds: setting these to true\n"
+		"means URLs that differ only in utm_* (and similar) parameters, in the\n"
+		"order of their query parameters, or in their session IDs are treated\n"
+		"as the same URL.\n"
+		"\n"
+		"exclude, include: whitespace-separated rules for which URLs to\n"
+		"follow. A rule is prefix:<string>, suffix:<string>, glob:<pattern>\n"
+		"(where '*' matches anything) or just <string> (which the URL must\n"
+		"contain). URLs matching an exclude rule are not followed; if there\n"
+		"are include rules, only URLs matching one of them are followed.\n"
+		"Also set with --exclude and --include, which can be given more\n"
+		"than once.\n"
+		"\n"
+		"sitemaps: setting this to true means the URLs in the site's sitemaps\n"
+		"(those named in its robots.txt, or else /sitemap.xml) are queued\n"
+		"before crawling starts, most recently modified first. Also set\n"
+		"with --sitemaps.\n"
+		"\n"
+		"nearDuplicates: what to do with a page whose text is much the same\n"
+		"as that of a page already crawled (print views, sort orders and the\n"
+		"like): follow (the default) treats it like any other page, nofollow\n"
+		"archives it but doesn't follow its links, and skip does neither.\n"
+		"Also set with --near-duplicates.\n"
+		"\n"
+		"dedupContent: true (the default) means a body identical to one\n"
+		"already archived is stored as a hard link to it rather than as\n"
+		"another copy. The bodies are kept by their SHA-256 hash under\n"
+		"${HOME}/" NETWASABI_DIR "/" CONTENT_STORE_DIR ". Turned off with --no-dedup.\n"
+		"\n"
 		"An example of a config.xml file is the following:\n"
 		"\n"
 		"<options>\n"
@@ -217,6 +280,8 @@ __noret usage(int exit_status)
 		"\t<queueMax>100</queueMax>\n"
 		"\t<xdomain>false</xdomain>\n"
 		"\t<fastMode>false</fastMode>\n"
+		"\t<maxRate>2M</maxRate>\n"
+		"\t<exclude>suffix:.pdf glob:*/tag/*</exclude>\n"
 		"</options>\n\n"
 		"* There is no need for the <?xml version=\"1.0\" ?> line in the config file.\n\n");
 
@@ -301,11 +366,96 @@ check_directory(void)
 	if (access(tmp.buf_head, F_OK) != 0)
 		mkdir(tmp.buf_head, S_IRWXU);
 
+/*
+ * So that we know what we already have
+ * without asking the filesystem each time.
+ */
+	if (archive_index_load(tmp.buf_head) < 0)
+		fprintf(stderr, "Failed to index the archive in %s\n", tmp.buf_head);
+
+	if (nwctx.config.dedup_content && content_store_load(tmp.buf_head) < 0)
+	{
+		fprintf(stderr, "Failed to open the content store in %s\n", tmp.buf_head);
+		CONFIG_DEDUP_CONTENT(&nwctx, 0);
+	}
+
 	buf_destroy(&tmp);
 
 	return;
 }
 
+/*
+ * Redirects seen in previous sessions are kept
+ * in ${HOME}/.NetWasabi so we don't have to
+ * rediscover them every time we crawl a site.
+ */
+#define REDIRECTS_FILENAME "redirects"
+static void
+load_redirects(void)
+{
+	char redirects_file[1024];
+
+	snprintf(redirects_file, 1024, "%s/.NetWasabi/" REDIRECTS_FILENAME, home_dir);
+
+	if (access(redirects_file, F_OK) != 0)
+		return;
+
+	if (HTTP_redirects_load(redirects_file) < 0)
+		fprintf(stderr, "Ignoring corrupt redirects file %s\n", redirects_file);
+
+	return;
+}
+
+static void
+save_redirects(void)
+{
+	char redirects_file[1024];
+
+	snprintf(redirects_file, 1024, "%s/.NetWasabi", home_dir);
+
+	if (access(redirects_file, F_OK) != 0)
+		mkdir(redirects_file, S_IRWXU);
+
+	snprintf(redirects_file, 1024, "%s/.NetWasabi/" REDIRECTS_FILENAME, home_dir);
+	HTTP_redirects_save(redirects_file);
+
+	return;
+}
+
+/*
+ * The crawler traps we stopped following are listed in
+ * ${HOME}/.NetWasabi/traps so that one can see what was
+ * left out (and add include rules if it was wanted).
+ */
+#define TRAPS_FILENAME "traps"
+static void
+__save_trap(int kind, const char *template, unsigned int nr_suppressed, void *arg)
+{
+	fprintf((FILE *)arg, "%s\t%u\t%s\n", url_trap_kind_name(kind), nr_suppressed, template);
+}
+
+static void
+save_traps(void)
+{
+	char traps_file[1024];
+	FILE *fp;
+
+	if (!url_traps_nr_suppressed())
+		return;
+
+	snprintf(traps_file, 1024, "%s/.NetWasabi/" TRAPS_FILENAME, home_dir);
+
+	if (!(fp = fopen(traps_file, "w")))
+		return;
+
+	url_traps_for_each(__save_trap, (void *)fp);
+	fclose(fp);
+
+	update_operation_status("Skipped %u URLs in crawler traps (see %s)", url_traps_nr_suppressed(), traps_file);
+
+	return;
+}
+
 static int
 valid_url(char *url)
 {
@@ -326,6 +476,35 @@ valid_url(char *url)
 	return 1;
 }
 
+/*
+ * Put the URL we were given into the form each link
+ * is put in before it is interned, so that the first
+ * page isn't crawled again under another spelling.
+ * The copy returned is ours to free.
+ */
+static char *
+canonical_seed(char *url)
+{
+	assert(url);
+
+	buf_t tmp;
+	char *seed = NULL;
+
+	tmp.magic = 0;
+	if (buf_init(&tmp, HTTP_URL_MAX) < 0)
+		return NULL;
+
+	if (buf_append(&tmp, url) < 0 || normalize_full_url(&tmp) < 0)
+		goto out;
+
+	seed = strdup(tmp.buf_head);
+
+out:
+	buf_destroy(&tmp);
+
+	return seed;
+}
+
 /**
  * Callback for XML_for_each_child()
  */
@@ -339,6 +518,152 @@ _config_hash_options(xml_node_t *node)
 	return;
 }
 
+/**
+ * Parse a byte rate such as "512K" or "2M".
+ * Returns -1 if it doesn't look like one.
+ */
+static int
+parse_rate(const char *str, size_t *rate)
+{
+	char *e;
+	unsigned long val;
+
+	val = strtoul(str, &e, 10);
+
+	if (e == str)
+		return -1;
+
+	switch(toupper((unsigned char)*e))
+	{
+		case 'K':
+			val *= 1024;
+			++e;
+			break;
+		case 'M':
+			val *= (1024 * 1024);
+			++e;
+			break;
+	}
+
+	if (*e)
+		return -1;
+
+	*rate = (size_t)val;
+	return 0;
+}
+
+static char *
+config_value(const char *name)
+{
+	bucket_t *bucket;
+
+	if (NULL == bObj_hashed_opts)
+		return NULL;
+
+	bucket = BUCKET_get_bucket(bObj_hashed_opts, (char *)name);
+	if (!bucket)
+		return NULL;
+
+	return (char *)bucket->data;
+}
+
+/*
+ * follow, nofollow or skip.
+ */
+static int
+parse_near_dups(const char *str)
+{
+	if (!strcasecmp("follow", str))
+		CONFIG_NEAR_DUPS(&nwctx, NEAR_DUPS_FOLLOW);
+	else
+	if (!strcasecmp("nofollow", str))
+		CONFIG_NEAR_DUPS(&nwctx, NEAR_DUPS_NOFOLLOW);
+	else
+	if (!strcasecmp("skip", str))
+		CONFIG_NEAR_DUPS(&nwctx, NEAR_DUPS_SKIP);
+	else
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Take the runtime options that were given
+ * in the config file, overriding the defaults.
+ */
+static void
+apply_configuration(void)
+{
+	char *value;
+	size_t rate;
+
+	if ((value = config_value(CRAWL_DELAY_OPTION_NAME)))
+		CONFIG_CRAWL_DELAY(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+	if ((value = config_value(CRAWL_DEPTH_OPTION_NAME)))
+		CONFIG_CRAWL_DEPTH(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+	if ((value = config_value(MAX_QUEUE_OPTION_NAME)))
+		CONFIG_MAX_QUEUE(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+	if ((value = config_value(FAST_MODE_OPTION_NAME)))
+		FAST_MODE = !strcasecmp("true", value);
+
+	if ((value = config_value(XDOMAIN_OPTION_NAME)))
+		CONFIG_CROSS_DOMAIN(&nwctx, !strcasecmp("true", value));
+
+	if ((value = config_value(DROP_TRACKING_OPTION_NAME)))
+		CONFIG_CANON_FLAG(&nwctx, URL_CANON_DROP_TRACKING, !strcasecmp("true", value));
+
+	if ((value = config_value(SORT_QUERY_OPTION_NAME)))
+		CONFIG_CANON_FLAG(&nwctx, URL_CANON_SORT_QUERY, !strcasecmp("true", value));
+
+	if ((value = config_value(STRIP_SESSION_OPTION_NAME)))
+		CONFIG_CANON_FLAG(&nwctx, URL_CANON_STRIP_SESSION, !strcasecmp("true", value));
+
+	if ((value = config_value(MAX_RATE_OPTION_NAME)))
+	{
+		if (parse_rate(value, &rate) < 0)
+			fprintf(stderr, "Ignoring invalid " MAX_RATE_OPTION_NAME " \"%s\"\n", value);
+		else
+			CONFIG_MAX_RATE(&nwctx, rate);
+	}
+
+	if ((value = config_value(HOST_RATE_OPTION_NAME)))
+	{
+		if (parse_rate(value, &rate) < 0)
+			fprintf(stderr, "Ignoring invalid " HOST_RATE_OPTION_NAME " \"%s\"\n", value);
+		else
+			CONFIG_HOST_RATE(&nwctx, rate);
+	}
+
+	if ((value = config_value(SITEMAPS_OPTION_NAME)))
+		CONFIG_USE_SITEMAPS(&nwctx, !strcasecmp("true", value));
+
+	if ((value = config_value(NEAR_DUPS_OPTION_NAME)))
+	{
+		if (parse_near_dups(value) < 0)
+			fprintf(stderr, "Ignoring invalid " NEAR_DUPS_OPTION_NAME " \"%s\"\n", value);
+	}
+
+	if ((value = config_value(DEDUP_CONTENT_OPTION_NAME)))
+		CONFIG_DEDUP_CONTENT(&nwctx, !strcasecmp("true", value));
+
+	if ((value = config_value(EXCLUDE_OPTION_NAME)))
+	{
+		if (URL_FILTER_add_rules(URL_filter, value, URL_FILTER_EXCLUDE) < 0)
+			fprintf(stderr, "Ignoring invalid " EXCLUDE_OPTION_NAME " rules \"%s\"\n", value);
+	}
+
+	if ((value = config_value(INCLUDE_OPTION_NAME)))
+	{
+		if (URL_FILTER_add_rules(URL_filter, value, URL_FILTER_INCLUDE) < 0)
+			fprintf(stderr, "Ignoring invalid " INCLUDE_OPTION_NAME " rules \"%s\"\n", value);
+	}
+
+	return;
+}
+
 /**
  * Parse the config.xml file and add runtime
  * options to hash bucket to retrieve when needed.
@@ -348,21 +673,31 @@ static void
 get_configuration(void)
 {
 	char config_file[1024];
+	struct XML *xml = NULL;
 
 	sprintf(config_file, "%s/.NetWasabi/" CONFIG_FILENAME, home_dir);
 	bObj_hashed_opts = NULL;
 
+	CONFIG_CRAWL_DELAY(&nwctx, DEFAULT_CRAWL_DELAY);
+	CONFIG_CRAWL_DEPTH(&nwctx, DEFAULT_CRAWL_DEPTH);
+	CONFIG_MAX_QUEUE(&nwctx, DEFAULT_MAX_QUEUE);
+	CONFIG_MAX_RATE(&nwctx, 0);
+	CONFIG_HOST_RATE(&nwctx, 0);
+	CONFIG_DEDUP_CONTENT(&nwctx, 1);
+	nwctx.config.canon_flags = 0;
+	FAST_MODE = 0;
+
 	if (access(config_file, F_OK) != 0)
-		goto _default;
+		goto out;
 
-	struct XML *xml = XML_new();
+	xml = XML_new();
 
 	if (0 != XML_parse_file(xml, config_file))
-		goto _default;
+		goto out;
 
 	xml_node_t *n = XML_find_by_path(xml, "options");
 	if (!n)
-		goto _default;
+		goto out;
 
 	bObj_hashed_opts = BUCKET_object_new();
 	assert(bObj_hashed_opts);
@@ -371,17 +706,12 @@ get_configuration(void)
 	 * Iterate child nodes of <options> tag and hash the data.
 	 */
 	XML_for_each_child(n, _config_hash_options);
-	XML_free(xml);
+	apply_configuration();
 
-	return;
-
-_default:
-	CONFIG_CRAWL_DELAY(&nwctx, DEFAULT_CRAWL_DELAY);
-	CONFIG_CRAWL_DEPTH(&nwctx, DEFAULT_CRAWL_DEPTH);
-	CONFIG_MAX_QUEUE(&nwctx, DEFAULT_MAX_QUEUE);
-	FAST_MODE = 0;
+out:
+	if (xml)
+		XML_free(xml);
 
-	XML_free(xml);
 	return;
 }
 
@@ -400,9 +730,44 @@ main(int argc, char *argv[])
 	}
 
 	char *url = str_replace(argv[1], "http:", "https:");
+	char *seed;
+	int rv;
+
+	URL_filter = URL_FILTER_object_new();
+	assert(URL_filter);
+
+	if (add_default_URL_rules(URL_filter) < 0)
+		goto fail;
 
 	get_configuration();
+	get_opts(argc, argv);
+
+/*
+ * Only now that we have the configuration
+ * do we know which canonical form to use.
+ */
+	if (!(seed = canonical_seed(url)))
+	{
+		fprintf(stderr, "Failed to canonicalise \"%s\"\n", url);
+		goto fail;
+	}
+
+	free(url);
+	url = seed;
+
+	if (URL_FILTER_compile(URL_filter) < 0)
+	{
+		fprintf(stderr, "Failed to compile URL rules\n");
+		goto fail;
+	}
+
 	check_directory();
+	load_redirects();
+
+	HTTP_set_rate_limits(nwctx.config.max_rate, nwctx.config.host_rate);
+
+	URL_arena = URL_ARENA_object_new();
+	assert(URL_arena);
 
 	/*
 	 * Must be done here and not in the constructor function
@@ -421,7 +786,18 @@ main(int argc, char *argv[])
 
 	if (FAST_MODE)
 	{
-		do_fast_mode(argv[1]);
+		if (!(seed = canonical_seed(argv[1])))
+		{
+			put_error_msg("Failed to canonicalise %s", argv[1]);
+			goto fail_save;
+		}
+
+		rv = do_fast_mode(seed);
+		free(seed);
+
+		if (rv < 0)
+			goto fail_save;
+
 		goto out;
 	}
 
@@ -451,7 +827,6 @@ main(int argc, char *argv[])
 	}
 
 	struct http_t *http;
-	int rv;
 	size_t url_len;
 
 /*
@@ -468,6 +843,9 @@ main(int argc, char *argv[])
 	}
 
 	http->followRedirects = 1; // Tell the HTTP module to automatically follow 3XX redirects.
+	http->sink_open = archive_open_sink; // Write non-HTML documents to the archive as they arrive.
+	http->sink_close = archive_close_sink;
+	http->digest_sink = nwctx.config.dedup_content; // Hash bodies written to the archive as they arrive.
 	http->usingSecure = 1; // Tell the HTTP module to use TLS.
 	http->verb = GET; // We will only be using GET requests anyway.
 
@@ -497,13 +875,13 @@ main(int argc, char *argv[])
 	assert(URL_queue);
 
 	/*
-	 * Keep a binary tree of already-archived URLs so that
-	 * we can avoid duplicate crawling. We query the tree
-	 * when we take a URL from the queue to see if we already
-	 * downloaded it.
+	 * Keep the IDs of already-archived URLs so that
+	 * we can avoid duplicate crawling. We look in the
+	 * set when we take a URL from the queue to see if
+	 * we already downloaded it.
 	 */
-	tree_archived = BTREE_object_new();
-	assert(tree_archived);
+	URLs_archived = URL_SET_object_new();
+	assert(URLs_archived);
 
 /*
 	http->ops->send_request(http);
@@ -528,8 +906,9 @@ main(int argc, char *argv[])
 #ifdef DEBUG
 		fprintf(stderr, "URL is parseable - calling parse_URLs()\n");
 #endif
-		parse_URLs(http, URL_queue, tree_archived);
-		transform_document_URLs(http); // turn href links into file://<path to local dir for pages crawled from this site>
+		link_table_build(&links, http);
+		parse_URLs(http, &links, URL_queue, tree_archived);
+		transform_document_URLs(http, &links); // turn href links into paths to our copies, relative to this page
 		archive_page(http);
 	}
 	else
@@ -539,8 +918,12 @@ main(int argc, char *argv[])
 	}
 */
 
-	QUEUE_enqueue(URL_queue, (void *)url, strlen(url));
-	rv = Crawl_WebSite(http, URL_queue, tree_archived);
+	enqueue_URL_id(URL_queue, URL_ARENA_intern(URL_arena, url, strlen(url)));
+
+	if (nwctx.config.use_sitemaps)
+		sitemap_seed(http, URL_queue, URLs_archived);
+
+	rv = Crawl_WebSite(http, URL_queue, URLs_archived);
 
 	if (rv < 0)
 	{
@@ -562,6 +945,11 @@ out_disconnect:
 
 out:
 
+	if (nwctx.config.dedup_content)
+		update_operation_status("Saved %lu bytes by linking to identical copies", content_store_bytes_saved());
+
+	save_redirects();
+	save_traps();
 	screen_updater_stop = 1;
 
 	usleep(100000);
@@ -569,10 +957,15 @@ out:
 
 fail_disconnect:
 
-	screen_updater_stop = 1;
 	http_disconnect(http);
 	HTTP_delete(http);
 
+fail_save:
+
+	save_redirects();
+	save_traps();
+	screen_updater_stop = 1;
+
 fail:
 
 	fprintf(stderr, "Failed...\n");
@@ -586,8 +979,7 @@ int
 get_opts(int argc, char *argv[])
 {
 	int		i;
-
-	CONFIG_MAX_QUEUE(&nwctx, DEFAULT_MAX_QUEUE);
+	size_t	rate;
 
 	for (i = 1; i < argc; ++i)
 	{
@@ -602,6 +994,70 @@ get_opts(int argc, char *argv[])
 		{
 			usage(EXIT_SUCCESS);
 		}
+		else
+		if (!strcmp("--max-rate", argv[i])
+			|| !strcmp("--host-rate", argv[i]))
+		{
+			if ((i + 1) == argc || parse_rate(argv[i+1], &rate) < 0)
+			{
+				fprintf(stderr, "%s requires a rate in bytes per second (e.g., 512K)\n", argv[i]);
+				usage(EXIT_FAILURE);
+			}
+
+			if (!strcmp("--max-rate", argv[i]))
+				CONFIG_MAX_RATE(&nwctx, rate);
+			else
+				CONFIG_HOST_RATE(&nwctx, rate);
+
+			++i;
+		}
+		else
+		if (!strcmp("--near-duplicates", argv[i]))
+		{
+			if ((i + 1) == argc || parse_near_dups(argv[i+1]) < 0)
+			{
+				fprintf(stderr, "%s requires one of follow, nofollow or skip\n", argv[i]);
+				usage(EXIT_FAILURE);
+			}
+
+			++i;
+		}
+		else
+		if (!strcmp("--sitemaps", argv[i]))
+		{
+			CONFIG_USE_SITEMAPS(&nwctx, 1);
+		}
+		else
+		if (!strcmp("--no-dedup", argv[i]))
+		{
+			CONFIG_DEDUP_CONTENT(&nwctx, 0);
+		}
+		else
+		if (!strcmp("--depth", argv[i]))
+		{
+			if ((i + 1) == argc || !isdigit((unsigned char)argv[i+1][0]))
+			{
+				fprintf(stderr, "%s requires a number of links (0 for no limit)\n", argv[i]);
+				usage(EXIT_FAILURE);
+			}
+
+			CONFIG_CRAWL_DEPTH(&nwctx, (unsigned int)strtoul(argv[i+1], NULL, 10));
+			++i;
+		}
+		else
+		if (!strcmp("--exclude", argv[i])
+			|| !strcmp("--include", argv[i]))
+		{
+			if ((i + 1) == argc
+			|| URL_FILTER_add_rule(URL_filter, argv[i+1],
+				!strcmp("--exclude", argv[i]) ? URL_FILTER_EXCLUDE : URL_FILTER_INCLUDE) < 0)
+			{
+				fprintf(stderr, "%s requires a rule (e.g., suffix:.pdf)\n", argv[i]);
+				usage(EXIT_FAILURE);
+			}
+
+			++i;
+		}
 #if 0
 		else
 		if (!strcmp("--blacklist", argv[i])
@@ -49,24 +49,29 @@ rotate_byte_left(char *c, int amount)
 }
 */
 
-#define GOLDEN_RATIO32 2654435769u
+/*
+ * FNV-1a. The previous hash folded each byte down to
+ * eight bits before XORing them together, so every
+ * key landed in one of 256 buckets no matter how many
+ * we had and the chains just grew instead.
+ */
+#define FNV_OFFSET_BASIS32 2166136261u
+#define FNV_PRIME32 16777619u
 static uint32_t
 hash_Object(char *data)
 {
 	assert(data);
 
-	size_t len = strlen(data);
-	uint64_t rax = 0;
+	uint32_t hash = FNV_OFFSET_BASIS32;
 	unsigned char *p = (unsigned char *)data;
-	unsigned char *e = (unsigned char *)data + len;
 
-	while (p < e)
+	while (*p)
 	{
-		rax ^= ((uint32_t)*p * GOLDEN_RATIO32) >> 24;
-		++p;
+		hash ^= (uint32_t)*p++;
+		hash *= FNV_PRIME32;
 	}
 
-	return (uint32_t)rax;
+	return hash;
 }
 
 static void
@@ -84,12 +89,13 @@ free_bucket_list(bucket_t *list_start, BUCKET_cb_t *funcs, unsigned int nr_cbs)
 
 		if (nr_cbs)
 		{
-			int j;
+			unsigned int j;
 
 			for (j = 0; j < nr_cbs; ++j)
 				funcs[j](prev);
 		}
 
+		free(prev->key);
 		free(prev);
 	}
 
@@ -135,6 +141,8 @@ free_buckets(bucket_obj_t *bucket_obj, int flags)
 				free(bucket->data);
 			}
 
+			free(bucket->key);
+			bucket->key = NULL;
 			bucket->data_len = 0;
 			bucket->used = 0;
 			bucket->next = NULL;
@@ -146,70 +154,127 @@ free_buckets(bucket_obj_t *bucket_obj, int flags)
 	free(bucket_obj->buckets);
 }
 
+static bucket_t *
+new_bucket(void)
+{
+	bucket_t *bucket = malloc(sizeof(bucket_t));
+
+	if (!bucket)
+		return NULL;
+
+	bucket->key = NULL;
+	bucket->hash = 0;
+	bucket->data = NULL;
+	bucket->data_len = 0;
+	bucket->used = 0;
+	bucket->next = NULL;
+
+	return bucket;
+}
+
 /**
  * After increasing the number of buckets, we need
  * to move the buckets around because HASH % NR_BUCKETS
  * will give a different index, which means we wouldn't
  * be able to retrieve our data.
+ *
+ * Only the bucket structures move; the keys and data
+ * they point to are handed over as they are, so this
+ * is safe for objects holding BUCKET_FL_NO_COPY data.
+ * Buckets sharing a key keep their relative order.
  */
 static int
-adjust_buckets(bucket_obj_t *bucket_obj, int flags)
+adjust_buckets(bucket_obj_t *bucket_obj, unsigned int new_nr_buckets)
 {
 	assert(bucket_obj);
 
-	bucket_t *old_bucket;
 	bucket_t *buckets;
-	bucket_obj_t tmp_bucket_obj;
+	bucket_t *old;
+	bucket_t *next;
+	bucket_t *slot;
+	unsigned int nr_used = 0;
 	unsigned int i;
-	unsigned int nr_buckets = bucket_obj->nr_buckets;
+	int is_head;
 
-	buckets = calloc(nr_buckets, sizeof(bucket_t));
-	memset(buckets, 0, sizeof(bucket_t) * nr_buckets);
-
-	tmp_bucket_obj.buckets = buckets;
-	tmp_bucket_obj.nr_buckets = nr_buckets;
-	tmp_bucket_obj.nr_buckets_used = 0;
-	tmp_bucket_obj.load_factor = bucket_obj->load_factor;
-	tmp_bucket_obj.nr_callbacks = 0;
+	buckets = calloc(new_nr_buckets, sizeof(bucket_t));
+	if (!buckets)
+		return -1;
 
 	Log("Adjusting buckets after increasing number of buckets\n");
 
-	for (i = 0; i < nr_buckets; ++i)
+	for (i = 0; i < bucket_obj->nr_buckets; ++i)
 	{
-		old_bucket = &bucket_obj->buckets[i];
-		if (BUCKET_put_data(&tmp_bucket_obj,
-				old_bucket->key,
-				old_bucket->data,
-				old_bucket->data_len,
-				flags) < 0)
+		old = &bucket_obj->buckets[i];
+		if (!old->used)
+			continue;
+
+		is_head = 1;
+
+		while (old)
 		{
-			Log("adjust_buckets: failed to put data into new bucket array\n");
-			goto fail;
+			next = old->next;
+			slot = &buckets[BUCKET(old->hash, new_nr_buckets)];
+
+			if (!slot->used)
+			{
+				slot->key = old->key;
+				slot->hash = old->hash;
+				slot->data = old->data;
+				slot->data_len = old->data_len;
+				slot->used = 1;
+				slot->next = NULL;
+
+				++nr_used;
+
+				if (!is_head)
+					free(old);
+			}
+			else
+			{
+				while (slot->next)
+					slot = slot->next;
+
+				if (is_head)
+				{
+					slot->next = new_bucket();
+					if (!slot->next)
+						goto fail;
+
+					slot = slot->next;
+					slot->key = old->key;
+					slot->hash = old->hash;
+					slot->data = old->data;
+					slot->data_len = old->data_len;
+					slot->used = 1;
+				}
+				else
+				{
+					old->next = NULL;
+					slot->next = old;
+				}
+			}
+
+			is_head = 0;
+			old = next;
 		}
 	}
 
-/*
- * Free the data, linked lists, etc, from the
- * old buckets array and point to the newly
- * created one.
- */
-	free_buckets(bucket_obj, flags);
+	free(bucket_obj->buckets);
 
 	bucket_obj->buckets = buckets;
-	bucket_obj->nr_buckets_used = tmp_bucket_obj.nr_buckets_used;
-
-	memset(&tmp_bucket_obj, 0, sizeof(bucket_obj_t));
+	bucket_obj->nr_buckets = new_nr_buckets;
+	bucket_obj->nr_buckets_used = nr_used;
 
 	Log("New bucket array at %p\n", bucket_obj->buckets);
 	return 0;
 
+/*
+ * Running out of memory halfway through leaves the
+ * old chains partly spliced into the new array, so
+ * there is no going back from here.
+ */
 fail:
-	free_buckets(&tmp_bucket_obj, 0);
-	free_buckets(bucket_obj, flags);
-	buckets = NULL;
-	bucket_obj->buckets = NULL;
-
-	return -1;
+	abort();
 }
 
 /**
@@ -218,7 +283,7 @@ fail:
  * buckets if so.
  */
 static void
-check_load_factor(bucket_obj_t *bucket_obj, int flags)
+check_load_factor(bucket_obj_t *bucket_obj)
 {
 	float load_factor = LOAD_FACTOR(bucket_obj);
 
@@ -226,35 +291,15 @@ check_load_factor(bucket_obj_t *bucket_obj, int flags)
 	{
 		Log("Resizing bucket array (load factor: %f)\n", load_factor);
 
-		bucket_obj->nr_buckets <<= 1;
-		bucket_obj->buckets = realloc(bucket_obj->buckets, (bucket_obj->nr_buckets*sizeof(bucket_t)));
-		assert(bucket_obj->buckets);
+		if (adjust_buckets(bucket_obj, bucket_obj->nr_buckets << 1) < 0)
+			abort(); // XXX Handle this more elegantly
 
 		Log("Number of buckets now %u\n", bucket_obj->nr_buckets);
-
-		if (adjust_buckets(bucket_obj, flags) < 0)
-			abort(); // XXX Handle this more elegantly
 	}
 
 	return;
 }
 
-static bucket_t *
-new_bucket(void)
-{
-	bucket_t *bucket = malloc(sizeof(bucket_t));
-
-	if (!bucket)
-		return NULL;
-
-	bucket->data = NULL;
-	bucket->data_len = 0;
-	bucket->used = 0;
-	bucket->next = NULL;
-
-	return bucket;
-}
-
 void
 BUCKET_dump_all(bucket_obj_t *bucket_obj)
 {
@@ -307,7 +352,7 @@ BUCKET_put_data(bucket_obj_t *bucket_obj, char *key, void *data, size_t data_len
 		++bucket_obj->nr_buckets_used;
 	}
 
-	bucket->key = calloc(ALIGN_SIZE(key_len), 1);
+	bucket->key = calloc(ALIGN_SIZE(key_len + 1), 1);
 
 	if (!bucket->key)
 		goto fail;
@@ -324,7 +369,7 @@ BUCKET_put_data(bucket_obj_t *bucket_obj, char *key, void *data, size_t data_len
 	}
 	else
 	{
-		bucket->data = calloc(ALIGN_SIZE(data_len), 1);
+		bucket->data = calloc(ALIGN_SIZE(data_len + 1), 1);
 		if (!bucket->data)
 			goto fail;
 		memcpy(bucket->data, data, data_len);
@@ -335,7 +380,7 @@ BUCKET_put_data(bucket_obj_t *bucket_obj, char *key, void *data, size_t data_len
 
 	Log("%s => %s\n", key, (char *)bucket->data);
 
-	check_load_factor(bucket_obj, flags);
+	check_load_factor(bucket_obj);
 
 	return 0;
 
@@ -364,10 +409,23 @@ BUCKET_get_bucket(bucket_obj_t *bucket_obj, char *key)
 	int index = BUCKET(hash, bucket_obj->nr_buckets);
 	bucket_t *bucket = &bucket_obj->buckets[index];
 
-	if (bucket->used)
-		return bucket;
-	else
+	if (!bucket->used)
 		return NULL;
+
+/*
+ * Different keys can share an index, so
+ * walk the list for the first one that
+ * is actually ours.
+ */
+	while (bucket)
+	{
+		if (bucket->hash == hash && !strcmp(bucket->key, key))
+			return bucket;
+
+		bucket = bucket->next;
+	}
+
+	return NULL;
 }
 
 bucket_t *
@@ -376,11 +434,9 @@ BUCKET_get_bucket_from_list(bucket_t *bucket, char *key)
 	assert(bucket);
 	assert(key);
 
-	size_t key_len = strlen(key);
-
 	while (bucket)
 	{
-		if (!memcmp((void *)bucket->key, (void *)key, key_len))
+		if (!strcmp(bucket->key, key))
 			return bucket;
 
 		bucket = bucket->next;
@@ -445,6 +501,7 @@ BUCKET_object_new(void)
 	bucket_obj->nr_buckets = DEFAULT_NUMBER_BUCKETS;
 	bucket_obj->nr_buckets_used = 0;
 	bucket_obj->load_factor = DEFAULT_LOAD_FACTOR_THRESHOLD;
+	bucket_obj->nr_callbacks = 0;
 
 	memset(bucket_obj->buckets, 0, sizeof(bucket_t) * DEFAULT_NUMBER_BUCKETS);
 
@@ -0,0 +1,626 @@
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "url_arena.h"
+
+#define URL_ARENA_BLOCK_SIZE 262144
+#define URL_ARENA_DEFAULT_RECORDS 4096
+#define URL_ARENA_DEFAULT_TABLE_SIZE 8192 /* twice the records, so at most half full */
+#define URL_ARENA_DEFAULT_HOSTS 64
+#define URL_ARENA_DEFAULT_HOST_TABLE_SIZE 128
+#define URL_SET_DEFAULT_SIZE 4096 /* bytes, so IDs up to 32767 */
+
+/*
+ * MurmurHash64A (Austin Appleby, public domain).
+ * Well mixed and fast on the short strings URLs are.
+ */
+#define MURMUR_M 0xc6a4a7935bd1e995ull
+#define MURMUR_R 47
+#define MURMUR_SEED 0x4e657457617361ull
+
+uint64_t
+URL_fingerprint(const char *URL, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)URL;
+	const unsigned char *end = (p + (len & ~(size_t)7));
+	uint64_t h = (MURMUR_SEED ^ (len * MURMUR_M));
+	uint64_t k;
+
+	while (p < end)
+	{
+		memcpy(&k, p, sizeof(k));
+		p += 8;
+
+		k *= MURMUR_M;
+		k ^= (k >> MURMUR_R);
+		k *= MURMUR_M;
+
+		h ^= k;
+		h *= MURMUR_M;
+	}
+
+	switch(len & 7)
+	{
+		case 7: h ^= ((uint64_t)p[6] << 48); /* fall through */
+		case 6: h ^= ((uint64_t)p[5] << 40); /* fall through */
+		case 5: h ^= ((uint64_t)p[4] << 32); /* fall through */
+		case 4: h ^= ((uint64_t)p[3] << 24); /* fall through */
+		case 3: h ^= ((uint64_t)p[2] << 16); /* fall through */
+		case 2: h ^= ((uint64_t)p[1] << 8); /* fall through */
+		case 1: h ^= (uint64_t)p[0];
+			h *= MURMUR_M;
+	}
+
+	h ^= (h >> MURMUR_R);
+	h *= MURMUR_M;
+	h ^= (h >> MURMUR_R);
+
+	return h;
+}
+
+/*
+ * Split URL into its parts, without copying any of it.
+ *
+ * @URL The URL
+ * @len Length of URL
+ * @parts Set to where each part is
+ */
+int
+URL_parts_parse(const char *URL, size_t len, url_parts_t *parts)
+{
+	const char *p = URL;
+	const char *end = (URL + len);
+	const char *s;
+	unsigned int port = 0;
+
+	memset(parts, 0, sizeof(*parts));
+
+	if (len > URL_PARTS_MAX)
+		return -1;
+
+	for (s = p; s < end && (isalnum((unsigned char)*s) || *s == '+' || *s == '-' || *s == '.'); ++s)
+		;
+
+	if (s > p && (end - s) >= 3 && !memcmp(s, "://", 3))
+	{
+		parts->scheme_len = (uint16_t)(s - p);
+		p = (s + 3);
+	}
+
+	while (p < end && *p == '/')
+		++p;
+
+	parts->host_off = (uint16_t)(p - URL);
+
+	while (p < end && *p != ':' && *p != '/' && *p != '?' && *p != '#')
+		++p;
+
+	parts->host_len = (uint16_t)((p - URL) - parts->host_off);
+
+	if (p < end && *p == ':')
+	{
+		for (++p; p < end && isdigit((unsigned char)*p); ++p)
+		{
+			port = ((port * 10) + (*p - '0'));
+
+			if (port > 65535)
+				return -1;
+		}
+
+		parts->port = (uint16_t)port;
+	}
+
+	parts->path_off = (uint16_t)(p - URL);
+
+	while (p < end && *p != '?' && *p != '#')
+		++p;
+
+	parts->path_len = (uint16_t)((p - URL) - parts->path_off);
+
+	if (p < end && *p == '?')
+	{
+		parts->query_off = (uint16_t)(++p - URL);
+
+		while (p < end && *p != '#')
+			++p;
+
+		parts->query_len = (uint16_t)((p - URL) - parts->query_off);
+	}
+
+	return 0;
+}
+
+static int
+__index_init(url_index_t *index, uint32_t nr_records, uint32_t table_size)
+{
+	index->records = calloc(nr_records, sizeof(url_record_t));
+	if (!index->records)
+		goto fail;
+
+	index->table = calloc(table_size, sizeof(uint32_t));
+	if (!index->table)
+		goto fail_free_records;
+
+	index->nr_records = 1; /* ID 0 means none */
+	index->nr_allocated = nr_records;
+	index->table_size = table_size;
+
+	return 0;
+
+fail_free_records:
+
+	free(index->records);
+	index->records = NULL;
+
+fail:
+
+	return -1;
+}
+
+url_arena_t *
+URL_ARENA_object_new(void)
+{
+	url_arena_t *arena = calloc(1, sizeof(url_arena_t));
+
+	if (!arena)
+		goto fail;
+
+	if (__index_init(&arena->URLs, URL_ARENA_DEFAULT_RECORDS, URL_ARENA_DEFAULT_TABLE_SIZE) < 0)
+		goto fail_free_arena;
+
+	if (__index_init(&arena->hosts, URL_ARENA_DEFAULT_HOSTS, URL_ARENA_DEFAULT_HOST_TABLE_SIZE) < 0)
+		goto fail_free_URLs;
+
+	arena->blocks = NULL;
+
+	pthread_mutex_init(&arena->lock, NULL);
+
+	return arena;
+
+fail_free_URLs:
+
+	free(arena->URLs.records);
+	free(arena->URLs.table);
+
+fail_free_arena:
+
+	free(arena);
+
+fail:
+
+	return NULL;
+}
+
+void
+URL_ARENA_object_destroy(url_arena_t *arena)
+{
+	assert(arena);
+
+	url_arena_block_t *block;
+	url_arena_block_t *next;
+
+	for (block = arena->blocks; block; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+
+	free(arena->URLs.records);
+	free(arena->URLs.table);
+	free(arena->hosts.records);
+	free(arena->hosts.table);
+
+	pthread_mutex_destroy(&arena->lock);
+	free(arena);
+
+	return;
+}
+
+/*
+ * Slot in the index where the ID for STR is, or
+ * the empty slot where it would go.
+ */
+static uint32_t
+__find_slot(url_index_t *index, const char *str, size_t len, uint64_t fp)
+{
+	uint32_t mask = (index->table_size - 1);
+	uint32_t slot = (uint32_t)fp & mask;
+	url_record_t *record;
+
+	while (index->table[slot] != 0)
+	{
+		record = &index->records[index->table[slot]];
+
+		if (record->fingerprint == fp && record->URL_len == len && !memcmp(record->URL, str, len))
+			break;
+
+		slot = ((slot + 1) & mask);
+	}
+
+	return slot;
+}
+
+static int
+__grow_table(url_index_t *index)
+{
+	uint32_t *old_table = index->table;
+	uint32_t old_size = index->table_size;
+	uint32_t mask;
+	uint32_t slot;
+	uint32_t i;
+
+	index->table = calloc((old_size * 2), sizeof(uint32_t));
+	if (!index->table)
+	{
+		index->table = old_table;
+		return -1;
+	}
+
+	index->table_size = (old_size * 2);
+	mask = (index->table_size - 1);
+
+	for (i = 0; i < old_size; ++i)
+	{
+		if (old_table[i] == 0)
+			continue;
+
+		slot = ((uint32_t)index->records[old_table[i]].fingerprint & mask);
+
+		while (index->table[slot] != 0)
+			slot = ((slot + 1) & mask);
+
+		index->table[slot] = old_table[i];
+	}
+
+	free(old_table);
+
+	return 0;
+}
+
+static char *
+__arena_copy(url_arena_t *arena, const char *str, size_t len)
+{
+	url_arena_block_t *block = arena->blocks;
+	size_t size;
+	char *p;
+
+	if (!block || (block->size - block->used) < (len + 1))
+	{
+		size = ((len + 1) > URL_ARENA_BLOCK_SIZE ? (len + 1) : URL_ARENA_BLOCK_SIZE);
+
+		block = malloc(sizeof(url_arena_block_t) + size);
+		if (!block)
+			return NULL;
+
+		block->size = size;
+		block->used = 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	p = (block->data + block->used);
+	memcpy(p, str, len);
+	p[len] = 0;
+
+	block->used += (len + 1);
+
+	return p;
+}
+
+/*
+ * Get the ID for STR in INDEX, adding a record for
+ * it if need be (with the arena locked). If a record
+ * was added, *ADDED is set.
+ */
+static uint32_t
+__index_intern(url_arena_t *arena, url_index_t *index, const char *str, size_t len, int *added)
+{
+	uint64_t fp = URL_fingerprint(str, len);
+	url_record_t *record;
+	uint32_t slot;
+	uint32_t id;
+
+	*added = 0;
+
+	slot = __find_slot(index, str, len, fp);
+
+	if (index->table[slot] != 0)
+		return index->table[slot];
+
+	if (index->nr_records >= index->nr_allocated)
+	{
+		record = realloc(index->records, (index->nr_allocated * 2 * sizeof(url_record_t)));
+		if (!record)
+			return 0;
+
+		index->records = record;
+		index->nr_allocated *= 2;
+	}
+
+	record = &index->records[index->nr_records];
+	memset(record, 0, sizeof(*record));
+
+	if (!(record->URL = __arena_copy(arena, str, len)))
+		return 0;
+
+	record->URL_len = (uint32_t)len;
+	record->fingerprint = fp;
+
+	id = index->nr_records++;
+	index->table[slot] = id;
+
+	if ((index->nr_records * 2) > index->table_size)
+		__grow_table(index);
+
+	*added = 1;
+
+	return id;
+}
+
+/**
+ * Get the ID for URL, adding it to the arena if
+ * it isn't already there. New URLs are parsed and
+ * their host interned.
+ *
+ * @arena The URL arena
+ * @URL The URL
+ * @len Length of URL
+ */
+url_id_t
+URL_ARENA_intern(url_arena_t *arena, const char *URL, size_t len)
+{
+	assert(arena);
+	assert(URL);
+
+	url_record_t *record;
+	url_parts_t parts;
+	url_id_t id;
+	host_id_t host_id = HOST_ID_NONE;
+	int added;
+
+	if (URL_parts_parse(URL, len, &parts) < 0)
+		return URL_ID_NONE;
+
+	pthread_mutex_lock(&arena->lock);
+
+	id = __index_intern(arena, &arena->URLs, URL, len, &added);
+
+	if (!added)
+		goto out;
+
+/*
+ * The host part runs up to the path, so
+ * includes any port number.
+ */
+	if (parts.host_len)
+		host_id = __index_intern(arena, &arena->hosts, (URL + parts.host_off), (parts.path_off - parts.host_off), &added);
+
+	record = &arena->URLs.records[id];
+	record->parts = parts;
+	record->host_id = host_id;
+
+out:
+
+	pthread_mutex_unlock(&arena->lock);
+
+	return id;
+}
+
+/**
+ * Get the ID for host name HOST (which may end
+ * with a port number), adding it if need be.
+ */
+host_id_t
+URL_ARENA_intern_host(url_arena_t *arena, const char *host, size_t len)
+{
+	assert(arena);
+	assert(host);
+
+	host_id_t id;
+	int added;
+
+	pthread_mutex_lock(&arena->lock);
+	id = __index_intern(arena, &arena->hosts, host, len, &added);
+	pthread_mutex_unlock(&arena->lock);
+
+	return id;
+}
+
+/**
+ * Get the ID for URL, or URL_ID_NONE if
+ * we have never seen it before.
+ */
+url_id_t
+URL_ARENA_lookup(url_arena_t *arena, const char *URL, size_t len)
+{
+	assert(arena);
+	assert(URL);
+
+	uint64_t fp = URL_fingerprint(URL, len);
+	url_id_t id;
+
+	pthread_mutex_lock(&arena->lock);
+	id = arena->URLs.table[__find_slot(&arena->URLs, URL, len, fp)];
+	pthread_mutex_unlock(&arena->lock);
+
+	return id;
+}
+
+/**
+ * Copy the record for the URL with ID into RECORD.
+ * (The records array moves as it grows, so callers
+ * get a copy; RECORD->URL itself stays put.)
+ */
+int
+URL_ARENA_record(url_arena_t *arena, url_id_t id, url_record_t *record)
+{
+	assert(arena);
+	assert(record);
+
+	int rv = -1;
+
+	pthread_mutex_lock(&arena->lock);
+
+	if (id != URL_ID_NONE && id < arena->URLs.nr_records)
+	{
+		memcpy(record, &arena->URLs.records[id], sizeof(*record));
+		rv = 0;
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+
+	return rv;
+}
+
+const char *
+URL_ARENA_string(url_arena_t *arena, url_id_t id)
+{
+	assert(arena);
+
+	const char *URL;
+
+	pthread_mutex_lock(&arena->lock);
+	assert(id != URL_ID_NONE && id < arena->URLs.nr_records);
+	URL = arena->URLs.records[id].URL;
+	pthread_mutex_unlock(&arena->lock);
+
+	return URL;
+}
+
+size_t
+URL_ARENA_length(url_arena_t *arena, url_id_t id)
+{
+	assert(arena);
+
+	size_t len;
+
+	pthread_mutex_lock(&arena->lock);
+	assert(id != URL_ID_NONE && id < arena->URLs.nr_records);
+	len = arena->URLs.records[id].URL_len;
+	pthread_mutex_unlock(&arena->lock);
+
+	return len;
+}
+
+uint64_t
+URL_ARENA_fingerprint(url_arena_t *arena, url_id_t id)
+{
+	assert(arena);
+
+	uint64_t fp;
+
+	pthread_mutex_lock(&arena->lock);
+	assert(id != URL_ID_NONE && id < arena->URLs.nr_records);
+	fp = arena->URLs.records[id].fingerprint;
+	pthread_mutex_unlock(&arena->lock);
+
+	return fp;
+}
+
+host_id_t
+URL_ARENA_host_id(url_arena_t *arena, url_id_t id)
+{
+	assert(arena);
+
+	host_id_t host_id;
+
+	pthread_mutex_lock(&arena->lock);
+	assert(id != URL_ID_NONE && id < arena->URLs.nr_records);
+	host_id = arena->URLs.records[id].host_id;
+	pthread_mutex_unlock(&arena->lock);
+
+	return host_id;
+}
+
+url_set_t *
+URL_SET_object_new(void)
+{
+	url_set_t *set = calloc(1, sizeof(url_set_t));
+
+	if (!set)
+		goto fail;
+
+	if (!(set->bits = calloc(URL_SET_DEFAULT_SIZE, 1)))
+		goto fail_free_set;
+
+	set->size = URL_SET_DEFAULT_SIZE;
+	set->nr_ids = 0;
+
+	return set;
+
+fail_free_set:
+
+	free(set);
+
+fail:
+
+	return NULL;
+}
+
+void
+URL_SET_object_destroy(url_set_t *set)
+{
+	assert(set);
+
+	free(set->bits);
+	free(set);
+
+	return;
+}
+
+/**
+ * Put ID in the set. Returns 1 if it wasn't there
+ * already, 0 if it was, and -1 if we ran out of
+ * memory making room for it.
+ */
+int
+URL_SET_add(url_set_t *set, url_id_t id)
+{
+	assert(set);
+	assert(id != URL_ID_NONE);
+
+	size_t byte = (id >> 3);
+	size_t size;
+	uint8_t *bits;
+
+	if (byte >= set->size)
+	{
+		size = set->size;
+
+		while (size <= byte)
+			size *= 2;
+
+		bits = realloc(set->bits, size);
+		if (!bits)
+			return -1;
+
+		memset(bits + set->size, 0, (size - set->size));
+
+		set->bits = bits;
+		set->size = size;
+	}
+
+	if (set->bits[byte] & (1 << (id & 7)))
+		return 0;
+
+	set->bits[byte] |= (1 << (id & 7));
+	++set->nr_ids;
+
+	return 1;
+}
+
+int
+URL_SET_has(url_set_t *set, url_id_t id)
+{
+	assert(set);
+
+	size_t byte = (id >> 3);
+
+	if (byte >= set->size)
+		return 0;
+
+	return !!(set->bits[byte] & (1 << (id & 7)));
+}
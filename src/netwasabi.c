@@ -1,19 +1,26 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h> /* for mkdir() */
 #include <unistd.h>
-#include "btree.h"
+#include "archive_index.h"
 #include "buffer.h"
 #include "cache.h"
 #include "cache_management.h"
+#include "content_store.h"
 #include "http.h"
+#include "link_scan.h"
 #include "malloc.h"
+#include "robots.h"
 #include "screen_utils.h"
+#include "simhash.h"
+#include "url_arena.h"
+#include "url_traps.h"
 #include "utils_url.h"
 #include "netwasabi.h"
 #include "queue.h"
@@ -79,7 +86,6 @@ do {\
 #define UNBLOCK_SIGNAL(signal) sigprocmask(SIG_SETMASK, &oldset, NULL)
 
 int nr_reaped = 0;
-int current_depth = 0;
 int url_cnt = 0;
 
 void
@@ -491,296 +497,1221 @@ check_local_dirs(struct http_t *http, buf_t *filename)
 	return 0;
 }
 
+/**
+ * Get the local pathname under which the page
+ * in HTTP->URL is archived and, if CREATE_DIRS,
+ * make sure the directories leading up to it exist.
+ *
+ * @http Our HTTP object
+ * @local_url Buffer to hold the pathname
+ * @create_dirs Create any missing directories
+ */
+static int
+local_archive_path(struct http_t *http, buf_t *local_url, int create_dirs)
+{
+	assert(http);
+	assert(local_url);
+
+	buf_t url;
+	buf_t name;
+	int rv = -1;
+
+	url.magic = name.magic = 0;
+
+	if (buf_init(&url, HTTP_URL_MAX) < 0)
+		goto out;
+
+	if (buf_init(&name, HTTP_URL_MAX) < 0)
+		goto out_destroy_url;
+
+	if (buf_append(&url, http->URL) < 0 || local_archive_name(&url, &name) < 0)
+		goto out_destroy_name;
+
+	buf_clear(local_url);
+
+	if (buf_append(local_url, getenv("HOME")) < 0
+	|| buf_append(local_url, "/" NETWASABI_DIR "/") < 0
+	|| buf_append(local_url, name.buf_head) < 0)
+		goto out_destroy_name;
+
+	if (create_dirs)
+		rv = check_local_dirs(http, local_url);
+	else
+	{
+		if (*(local_url->buf_tail - 1) == '/')
+			buf_snip(local_url, 1);
+
+		rv = 0;
+	}
+
+out_destroy_name:
+
+	buf_destroy(&name);
+
+out_destroy_url:
+
+	buf_destroy(&url);
+
+out:
+
+	return rv;
+}
+
+/*
+ * A body that doesn't arrive in full is kept in
+ * <local path>.part so that the next attempt can ask
+ * for just the rest of it. <local path>.part-info
+ * holds the validator the server sent with it (on
+ * the first line) and how many times we've retried
+ * (on the second). Without a validator we can't
+ * safely resume, so the partial body is thrown away.
+ */
+#define RESUME_MAX_TRIES 5
+
+static int
+partial_path(buf_t *local_url, const char *suffix, buf_t *path)
+{
+	buf_clear(path);
+
+	if (buf_append(path, local_url->buf_head) < 0
+	|| buf_append(path, (char *)suffix) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+read_partial_info(buf_t *local_url, char *validator, int *tries)
+{
+	buf_t path;
+	FILE *fp;
+	char line[HTTP_VALIDATOR_MAX+2];
+	int rv = -1;
+
+	buf_init(&path, 1024);
+
+	if (partial_path(local_url, PARTIAL_INFO_SUFFIX, &path) < 0)
+		goto out;
+
+	fp = fopen(path.buf_head, "r");
+	if (!fp)
+		goto out;
+
+	if (!fgets(line, sizeof(line), fp))
+		goto out_close;
+
+	line[strcspn(line, "\r\n")] = 0;
+	if (!line[0])
+		goto out_close;
+
+	strcpy(validator, line);
+	*tries = 0;
+
+	if (fgets(line, sizeof(line), fp))
+		*tries = atoi(line);
+
+	rv = 0;
+
+out_close:
+	fclose(fp);
+
+out:
+	buf_destroy(&path);
+	return rv;
+}
+
+static int
+write_partial_info(buf_t *local_url, const char *validator, int tries)
+{
+	buf_t path;
+	FILE *fp;
+	int rv = -1;
+
+	buf_init(&path, 1024);
+
+	if (partial_path(local_url, PARTIAL_INFO_SUFFIX, &path) < 0)
+		goto out;
+
+	fp = fopen(path.buf_head, "w");
+	if (fp)
+	{
+		fprintf(fp, "%s\n%d\n", validator, tries);
+		if (!fclose(fp))
+			rv = 0;
+	}
+
+out:
+	buf_destroy(&path);
+	return rv;
+}
+
+static void
+remove_partial(buf_t *local_url)
+{
+	buf_t path;
+
+	buf_init(&path, 1024);
+
+	if (!partial_path(local_url, PARTIAL_SUFFIX, &path))
+		unlink(path.buf_head);
+
+	if (!partial_path(local_url, PARTIAL_INFO_SUFFIX, &path))
+		unlink(path.buf_head);
+
+	buf_destroy(&path);
+
+	return;
+}
+
+/*
+ * A weak ETag can't be used in If-Range,
+ * so fall back to Last-Modified.
+ */
+static char *
+response_validator(struct http_t *http)
+{
+	char *v = http->ops->fetch_header(http, "etag");
+
+	if (v && strncmp("W/", v, 2) && strlen(v) < HTTP_VALIDATOR_MAX)
+		return v;
+
+	v = http->ops->fetch_header(http, "last-modified");
+
+	if (v && strlen(v) < HTTP_VALIDATOR_MAX)
+		return v;
+
+	return NULL;
+}
+
+/**
+ * Called by the HTTP module once it has the header
+ * of a page. Documents that we parse for URLs are
+ * kept in memory; anything else is written to
+ * <local path>.part as it is received, and renamed
+ * once it is all there.
+ *
+ * @http Our HTTP object
+ */
+int
+archive_open_sink(struct http_t *http)
+{
+	assert(http);
+
+	buf_t local_url;
+	buf_t part;
+	char *validator;
+	int fd = -1;
+
+/*
+ * Keep the page in memory to rewrite its URLs, and
+ * queue the URLs it links to as they arrive.
+ */
+	if (URL_parseable(http->URL))
+	{
+		if (http->hook_data)
+			link_stream_start((struct link_stream *)http->hook_data);
+
+		return HTTP_SINK_MEMORY;
+	}
+
+	buf_init(&local_url, 1024);
+	buf_init(&part, 1024);
+
+	if (local_archive_path(http, &local_url, 1) < 0)
+	{
+		fd = HTTP_SINK_MEMORY;
+		goto out;
+	}
+
+	if (archive_index_has(local_url.buf_head))
+	{
+		fd = HTTP_SINK_DISCARD;
+		goto out;
+	}
+
+	if (partial_path(&local_url, PARTIAL_SUFFIX, &part) < 0)
+	{
+		fd = HTTP_SINK_MEMORY;
+		goto out;
+	}
+
+/*
+ * The server is sending the rest of the body
+ * we already have the start of.
+ */
+	if (HTTP_PARTIAL_CONTENT == http->code)
+	{
+		fd = open(part.buf_head, O_WRONLY);
+
+		if (fd != -1)
+			lseek(fd, (off_t)0, SEEK_END);
+	}
+	else
+	{
+		fd = open(part.buf_head, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+
+		if (fd != -1)
+		{
+			validator = response_validator(http);
+
+			if (validator)
+				write_partial_info(&local_url, validator, 0);
+			else
+			if (!partial_path(&local_url, PARTIAL_INFO_SUFFIX, &part))
+				unlink(part.buf_head);
+		}
+	}
+
+	if (fd == -1)
+	{
+		put_error_msg("Failed to create local copy (%s)", strerror(errno));
+		fd = HTTP_SINK_DISCARD;
+	}
+
+out:
+	buf_destroy(&local_url);
+	buf_destroy(&part);
+
+	return fd;
+}
+
+/*
+ * Swap the body just written to PATH for a link to the
+ * copy we already have, if we have one; if not, PATH
+ * becomes that copy. Bodies that came in one piece were
+ * hashed as they were received; the rest (resumed ones,
+ * and those spliced straight to the file) we read back.
+ */
+static void
+archive_dedup_file(struct http_t *http, const char *path)
+{
+	unsigned char digest[CONTENT_DIGEST_LEN];
+
+	if (http->body_digest_valid)
+		memcpy(digest, http->body_digest, CONTENT_DIGEST_LEN);
+	else
+	if (content_digest_file(path, digest) < 0)
+		return;
+
+	if (content_store_adopt(digest, path) < 0)
+		put_error_msg("Failed to add %s to the content store (%s)", path, strerror(errno));
+
+	return;
+}
+
+/**
+ * Finish with a file that archive_open_sink() gave
+ * the HTTP module. A complete body is moved into
+ * place. What we got of an incomplete one is kept
+ * for archive_prepare_resume() if it can be resumed.
+ *
+ * @http Our HTTP object
+ * @fd The file descriptor from archive_open_sink()
+ * @failed Non-zero if the body was not received in full
+ */
+void
+archive_close_sink(struct http_t *http, int fd, int failed)
+{
+	assert(http);
+
+	buf_t local_url;
+	buf_t part;
+	char validator[HTTP_VALIDATOR_MAX+2];
+	int tries;
+
+	if (fd < 0)
+		return;
+
+	close(fd);
+
+	buf_init(&local_url, 1024);
+	buf_init(&part, 1024);
+
+	if (local_archive_path(http, &local_url, 0) < 0)
+		goto out;
+
+	if (partial_path(&local_url, PARTIAL_SUFFIX, &part) < 0)
+		goto out;
+
+	if (failed)
+	{
+		if (read_partial_info(&local_url, validator, &tries) < 0)
+			remove_partial(&local_url);
+
+		goto out;
+	}
+
+	if (rename(part.buf_head, local_url.buf_head) < 0)
+	{
+		put_error_msg("Failed to rename %s (%s)", part.buf_head, strerror(errno));
+		goto out;
+	}
+
+	if (!partial_path(&local_url, PARTIAL_INFO_SUFFIX, &part))
+		unlink(part.buf_head);
+
+	if (nwctx.config.dedup_content)
+		archive_dedup_file(http, local_url.buf_head);
+
+	archive_index_add(local_url.buf_head);
+	update_operation_status("Created %s", local_url.buf_head);
+
+out:
+	buf_destroy(&local_url);
+	buf_destroy(&part);
+
+	return;
+}
+
+/**
+ * If we have part of the body for HTTP->URL from an
+ * earlier attempt, set up the HTTP object to ask for
+ * the rest of it.
+ *
+ * @http Our HTTP object
+ */
+int
+archive_prepare_resume(struct http_t *http)
+{
+	assert(http);
+
+	buf_t local_url;
+	buf_t part;
+	struct stat statb;
+	char validator[HTTP_VALIDATOR_MAX+2];
+	int tries;
+	int rv = 0;
+
+	http->resume_from = 0;
+	http->resume_validator[0] = 0;
+
+	if (URL_parseable(http->URL))
+		return 0;
+
+	buf_init(&local_url, 1024);
+	buf_init(&part, 1024);
+
+	if (local_archive_path(http, &local_url, 0) < 0)
+		goto out;
+
+	if (partial_path(&local_url, PARTIAL_SUFFIX, &part) < 0)
+		goto out;
+
+	if (stat(part.buf_head, &statb) < 0 || !statb.st_size)
+		goto out;
+
+	if (read_partial_info(&local_url, validator, &tries) < 0)
+		goto out;
+
+	http->resume_from = statb.st_size;
+	strcpy(http->resume_validator, validator);
+	rv = 1;
+
+out:
+	buf_destroy(&local_url);
+	buf_destroy(&part);
+
+	return rv;
+}
+
+/**
+ * After a failed transfer, decide whether HTTP->URL
+ * is worth another go because we kept what we got.
+ * Gives up (and removes the partial body) after
+ * RESUME_MAX_TRIES attempts.
+ *
+ * @http Our HTTP object
+ */
+int
+archive_retry_partial(struct http_t *http)
+{
+	assert(http);
+
+	buf_t local_url;
+	char validator[HTTP_VALIDATOR_MAX+2];
+	int tries;
+	int rv = 0;
+
+	if (URL_parseable(http->URL))
+		return 0;
+
+	buf_init(&local_url, 1024);
+
+	if (local_archive_path(http, &local_url, 0) < 0)
+		goto out;
+
+	if (read_partial_info(&local_url, validator, &tries) < 0)
+		goto out;
+
+	if (tries >= RESUME_MAX_TRIES)
+	{
+		remove_partial(&local_url);
+		goto out;
+	}
+
+	if (write_partial_info(&local_url, validator, tries + 1) < 0)
+		goto out;
+
+	rv = 1;
+
+out:
+	buf_destroy(&local_url);
+
+	return rv;
+}
+
 int
 archive_page(struct http_t *http)
 {
 	assert(http);
 
-	int fd = -1;
-	buf_t *buf = &http_rbuf(http);
-	buf_t tmp;
-	buf_t local_url;
-	char *p;
-	int rv;
+	int fd = -1;
+	buf_t *buf = &http_rbuf(http);
+	buf_t local_url;
+	unsigned char digest[CONTENT_DIGEST_LEN];
+	int dedup = 0;
+	char *p;
+	int rv;
+
+/*
+ * Already written out by archive_open_sink()
+ * as it was received.
+ */
+	if (http->body_sunk)
+		return 0;
+
+	p = HTTP_EOH(buf);
+
+	if (!p)
+	{
+		put_error_msg("Could not find end of HTTP header");
+		goto fail;
+	}
+
+	buf_collapse(buf, (off_t)0, (p - buf->buf_head));
+
+	buf_init(&local_url, 1024);
+
+	rv = local_archive_path(http, &local_url, 1);
+
+	if (rv < 0)
+		goto fail_free_bufs;
+
+	if (archive_index_has(local_url.buf_head))
+	{
+		goto out_free_bufs;
+	}
+
+/*
+ * If we already have these bytes under another
+ * name, link to them rather than write them again.
+ */
+	if (nwctx.config.dedup_content && !content_digest(buf->buf_head, buf->data_len, digest))
+	{
+		if (content_store_link(digest, local_url.buf_head, buf->data_len) == 1)
+		{
+			archive_index_add(local_url.buf_head);
+			update_operation_status("Linked %s", local_url.buf_head);
+			goto out_free_bufs;
+		}
+
+		dedup = 1;
+	}
+
+	fd = open(local_url.buf_head, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+
+	if (fd == -1)
+	{
+		put_error_msg("Failed to create local copy (%s)", strerror(errno));
+		goto fail_free_bufs;
+	}
+
+/*
+ * Don't leave a short copy to be indexed,
+ * or to be linked to by the content store.
+ */
+	if (buf_write_fd(fd, buf) != (ssize_t)buf->data_len)
+	{
+		put_error_msg("Failed to write local copy (%s)", strerror(errno));
+		close(fd);
+		unlink(local_url.buf_head);
+		goto fail_free_bufs;
+	}
+
+	close(fd);
+	fd = -1;
+
+	update_operation_status("Created %s", local_url.buf_head);
+
+	if (dedup && content_store_adopt(digest, local_url.buf_head) < 0)
+		put_error_msg("Failed to add %s to the content store (%s)", local_url.buf_head, strerror(errno));
+
+	archive_index_add(local_url.buf_head);
+
+out_free_bufs:
+
+	buf_destroy(&local_url);
+
+	return 0;
+
+fail_free_bufs:
+
+	buf_destroy(&local_url);
+
+fail:
+
+	return -1;
+}
+
+static const char *const __disallowed_tokens[] =
+{
+	"javascript:",
+	"data:image",
+	".exe",
+	".dll",
+	"cgi-",
+	(char *)NULL
+};
+
+int nr_urls_call = 0;
+
+/**
+ * Add the rules for URLs we never want to follow.
+ */
+int
+add_default_URL_rules(url_filter_t *filter)
+{
+	assert(filter);
+
+	int i;
+
+	if (URL_FILTER_add_rule(filter, "mailto", URL_FILTER_EXCLUDE) < 0)
+		return -1;
+
+	for (i = 0; __disallowed_tokens[i] != NULL; ++i)
+	{
+		if (URL_FILTER_add_rule(filter, __disallowed_tokens[i], URL_FILTER_EXCLUDE) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Make the URL with ID the one HTTP fetches next.
+ * Its host and page are copied from the URL's
+ * record, rather than parsed out of it again.
+ *
+ * @http our HTTP object
+ * @id ID of the URL in the URL arena
+ */
+int
+load_URL(struct http_t *http, url_id_t id)
+{
+	assert(http);
+
+	url_record_t record;
+	url_parts_t *parts = &record.parts;
+	size_t host_len;
+
+	if (URL_ARENA_record(URL_arena, id, &record) < 0)
+		return -1;
+
+	host_len = (parts->path_off - parts->host_off);
+
+	if (record.URL_len >= HTTP_URL_MAX || host_len > HTTP_HOST_MAX)
+		return -1;
+
+	memcpy(http->URL, record.URL, record.URL_len + 1);
+	http->URL_len = record.URL_len;
+
+	memcpy(http->host, (record.URL + parts->host_off), host_len);
+	http->host[host_len] = 0;
+
+	if (parts->path_off == record.URL_len)
+		strcpy(http->page, "/");
+	else
+		memcpy(http->page, (record.URL + parts->path_off), (record.URL_len - parts->path_off) + 1);
+
+	http->URL_id = id;
+	http->host_id = record.host_id;
+	http->depth = URL_depth(id);
+
+/*
+ * Fast mode workers get here at the same time, so raise
+ * the deepest depth seen with a compare-and-swap and only
+ * the worker that raised it reports it.
+ */
+	for (;;)
+	{
+		uint16_t seen = nwctx.stats.depth;
+
+		if (http->depth <= seen)
+			break;
+
+		if (__sync_bool_compare_and_swap(&nwctx.stats.depth, seen, (uint16_t)http->depth))
+		{
+			update_operation_status("Crawling depth %u", (unsigned int)http->depth);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * ID of the URL in HTTP->URL, interning it if
+ * HTTP has moved on from the one it was given.
+ */
+url_id_t
+http_URL_id(struct http_t *http)
+{
+	assert(http);
+
+	if (URL_ID_NONE == http->URL_id)
+		http->URL_id = URL_ARENA_intern(URL_arena, http->URL, strlen(http->URL));
+
+	return http->URL_id;
+}
+
+/**
+ * ID of the host in HTTP->host.
+ */
+host_id_t
+http_host_id(struct http_t *http)
+{
+	assert(http);
+
+	if (HOST_ID_NONE == http->host_id)
+		http->host_id = URL_ARENA_intern_host(URL_arena, http->host, strlen(http->host));
+
+	return http->host_id;
+}
+
+/**
+ * Check whether the page HTTP has just received says
+ * much the same as one already crawled (which is the
+ * case for print views, sort orders and the like).
+ * Pages too short to tell are never near duplicates.
+ */
+int
+page_is_near_duplicate(struct http_t *http)
+{
+	assert(http);
+
+	struct simhash sh;
+	buf_t *buf = &http_rbuf(http);
+	char *body;
+	uint64_t fp;
+
+	if (NEAR_DUPS_FOLLOW == nwctx.config.near_dups)
+		return 0;
+
+	if (!(body = HTTP_EOH(buf)))
+		return 0;
+
+	simhash_init(&sh);
+	simhash_feed(&sh, body, (buf->buf_tail - body));
+
+	if (simhash_final(&sh, &fp) < 0)
+		return 0;
+
+	return simhash_seen(fp);
+}
+
+/**
+ * Fetch PAGE from the host HTTP is connected to, keeping
+ * it in memory and out of the archive, and hand its body
+ * to CB. HTTP is left with the URL it had.
+ *
+ * Returns the status code of the response (CB is only
+ * called for 200), or -1 if we couldn't get one or CB
+ * returned < 0.
+ *
+ * @http our HTTP object
+ * @page the page on its host, e.g. "/robots.txt"
+ * @cb what to do with the body
+ * @arg passed on to CB
+ */
+int
+fetch_aside(struct http_t *http, const char *page, fetch_aside_cb_t cb, void *arg)
+{
+	assert(http);
+	assert(page);
+	assert(cb);
+
+	char saved_URL[HTTP_URL_MAX+1];
+	char saved_host[HTTP_HOST_MAX+1];
+	char saved_page[HTTP_URL_MAX+1];
+	url_id_t saved_URL_id = http->URL_id;
+	host_id_t saved_host_id = http->host_id;
+	int (*saved_sink_open)(struct http_t *) = http->sink_open;
+	buf_t *buf = &http_rbuf(http);
+	char *body;
+	int rv = -1;
+
+	if (strlen(page) >= (HTTP_URL_MAX - HTTP_HOST_MAX - 16))
+		return -1;
+
+	strcpy(saved_URL, http->URL);
+	strcpy(saved_host, http->host);
+	strcpy(saved_page, http->page);
+
+	snprintf(http->URL, HTTP_URL_MAX, "%s://%s%s", (http->usingSecure ? "https" : "http"), saved_host, page);
+	http->URL_len = strlen(http->URL);
+	http->URL_id = URL_ID_NONE;
+	strcpy(http->page, page);
+
+	http->sink_open = NULL;
+	http->resume_from = 0;
+	http->resume_validator[0] = 0;
+
+	buf_clear(buf);
+	buf_clear(&http_wbuf(http));
+
+	if (http->ops->send_request(http) >= 0 && http->ops->recv_response(http) >= 0)
+	{
+		rv = http->code;
+
+		if (HTTP_OK == http->code && (body = HTTP_EOH(buf)))
+		{
+			if (cb(http, body, (buf->buf_tail - body), arg) < 0)
+				rv = -1;
+		}
+	}
+
+	http->sink_open = saved_sink_open;
+
+	strcpy(http->URL, saved_URL);
+	http->URL_len = strlen(saved_URL);
+	http->URL_id = saved_URL_id;
+	strcpy(http->page, saved_page);
+
+	buf_clear(buf);
+	buf_clear(&http_wbuf(http));
+
+/*
+ * We might have been redirected elsewhere.
+ */
+	if (strcmp(http->host, saved_host))
+	{
+		strcpy(http->host, saved_host);
+
+		if (http_reconnect(http) < 0)
+			rv = -1;
+	}
+
+	http->host_id = saved_host_id;
+
+	return rv;
+}
+
+/**
+ *
+ * @http: our HTTP object with remote host info
+ * @id: ID of the URL in the URL arena
+ */
+static int
+URL_acceptable(struct http_t *http, url_set_t *URLs_archived, url_id_t id)
+{
+	assert(http);
+
+	url_record_t record;
 
-	p = HTTP_EOH(buf);
+	if (URL_ARENA_record(URL_arena, id, &record) < 0)
+		return 0;
 
-	if (!p)
+	if (record.URL_len >= 256)
+		return 0;
+
+	if (record.parts.scheme_len)
 	{
-		put_error_msg("Could not find end of HTTP header");
-		goto fail;
+		if (record.URL_len < httplen || record.URL_len < httpslen)
+			return 0;
 	}
 
-	buf_collapse(buf, (off_t)0, (p - buf->buf_head));
+	if (record.host_id != http_host_id(http))
+		return 0;
 
-	buf_init(&tmp, HTTP_URL_MAX);
-	buf_clear(&tmp);
+	if (URL_SET_has(URLs_archived, id))
+		return 0;
 
-	buf_init(&local_url, 1024);
-	buf_append(&tmp, http->URL);
+	if (memchr(record.URL, '#', record.URL_len))
+		return 0;
+
+	if (URL_FILTER_allows(URL_filter, record.URL, record.URL_len) != 1)
+		return 0;
+
+	if (!robots_allow(record.host_id, (record.URL + record.parts.path_off), (record.URL_len - record.parts.path_off)))
+		return 0;
 
-	make_local_url(http, &tmp, &local_url);
+	if (local_archive_exists(record.URL))
+	{
+		return 0;
+	}
 
 /*
- * Remove the "file://" from start to end up
- * with local filesystem pathname.
+ * Last, so that only URLs we would otherwise
+ * follow count towards a trap's budget.
  */
-	buf_collapse(&local_url, (off_t)0, strlen("file://"));
-	rv = check_local_dirs(http, &local_url);
+	if (url_traps_check(record.URL, &record.parts, id))
+		return 0;
 
-	if (rv < 0)
-		goto fail_free_bufs;
+	return 1;
+}
+
+/*
+ * How many links from the first page each URL we've
+ * queued is, indexed by ID: 0 if we haven't queued it,
+ * else its depth + 1. The first depth we queue a URL at
+ * is its depth, which, going level by level, is the
+ * least it can be.
+ */
+static uint16_t *URL_depths = NULL;
+static size_t URL_depths_size = 0;
+static pthread_mutex_t URL_depths_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+__set_depth(url_id_t id, unsigned int depth)
+{
+	uint16_t *depths;
+	size_t size;
+
+	if (depth >= UINT16_MAX)
+		depth = (UINT16_MAX - 1);
 
-	if (access(local_url.buf_head, F_OK) == 0)
+	pthread_mutex_lock(&URL_depths_lock);
+
+	if (id >= URL_depths_size)
 	{
-		goto out_free_bufs;
+		size = (URL_depths_size ? URL_depths_size : 4096);
+
+		while (size <= id)
+			size *= 2;
+
+		depths = realloc(URL_depths, (size * sizeof(uint16_t)));
+		if (!depths)
+			goto out;
+
+		memset(depths + URL_depths_size, 0, ((size - URL_depths_size) * sizeof(uint16_t)));
+
+		URL_depths = depths;
+		URL_depths_size = size;
 	}
 
-	fd = open(local_url.buf_head, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	if (!URL_depths[id])
+		URL_depths[id] = (uint16_t)(depth + 1);
 
-	if (fd == -1)
+out:
+
+	pthread_mutex_unlock(&URL_depths_lock);
+
+	return;
+}
+
+/**
+ * How many links from the first page the URL
+ * with ID is (0 if we never queued it).
+ */
+unsigned int
+URL_depth(url_id_t id)
+{
+	unsigned int depth = 0;
+
+	pthread_mutex_lock(&URL_depths_lock);
+
+	if (id < URL_depths_size && URL_depths[id])
+		depth = (URL_depths[id] - 1);
+
+	pthread_mutex_unlock(&URL_depths_lock);
+
+	return depth;
+}
+
+/*
+ * Images, stylesheets, scripts and the like wait in a
+ * lane of their own, so that a page with 80 images
+ * doesn't put them all ahead of the next 80 pages.
+ * The lane is guarded by whatever guards the queue.
+ */
+static queue_obj_t *Asset_lane = NULL;
+static unsigned int Pages_since_asset = 0;
+
+/**
+ * Add the URL with ID to the queue: to the asset lane
+ * if it's not a document we'd parse for links. A URL
+ * we've no depth for yet (the first page) is at 0.
+ */
+int
+enqueue_URL_id(queue_obj_t *URL_queue, url_id_t id)
+{
+	assert(URL_queue);
+
+	if (URL_ID_NONE == id)
+		return -1;
+
+	__set_depth(id, 0);
+
+	if (!URL_parseable((char *)URL_ARENA_string(URL_arena, id)))
 	{
-		put_error_msg("Failed to create local copy (%s)", strerror(errno));
-		goto fail_free_bufs;
+		if (!Asset_lane && !(Asset_lane = QUEUE_object_new()))
+			return -1;
+
+		return QUEUE_enqueue(Asset_lane, (void *)&id, sizeof(id));
 	}
 
-	update_operation_status("Created %s", local_url.buf_head);
+	return QUEUE_enqueue(URL_queue, (void *)&id, sizeof(id));
+}
 
-	buf_write_fd(fd, buf);
-	close(fd);
-	fd = -1;
+static url_id_t
+__dequeue(queue_obj_t *queue)
+{
+	queue_item_t *item;
+	url_id_t id;
 
-out_free_bufs:
+	if (!queue || !(item = QUEUE_dequeue(queue)))
+		return URL_ID_NONE;
 
-	buf_destroy(&tmp);
-	buf_destroy(&local_url);
+	id = *(url_id_t *)item->data;
 
-	return 0;
+	free(item->data);
+	free(item);
 
-fail_free_bufs:
+	return id;
+}
 
-	buf_destroy(&tmp);
-	buf_destroy(&local_url);
+/**
+ * Take the next page from the queue, returning its
+ * ID or URL_ID_NONE if there are no pages queued.
+ */
+url_id_t
+dequeue_page_id(queue_obj_t *URL_queue)
+{
+	assert(URL_queue);
 
-fail:
+	return __dequeue(URL_queue);
+}
 
-	return -1;
+/**
+ * Take the next asset from the asset lane.
+ */
+url_id_t
+dequeue_asset_id(void)
+{
+	return __dequeue(Asset_lane);
 }
 
-static const char *const __disallowed_tokens[] =
+static unsigned int
+__front_depth(queue_obj_t *queue)
 {
-	"javascript:",
-	"data:image",
-	".exe",
-	".dll",
-	"cgi-",
-	(char *)NULL
-};
+	if (!queue || !queue->front)
+		return UINT_MAX;
 
-int nr_urls_call = 0;
+	return URL_depth(*(url_id_t *)queue->front->data);
+}
 
 /**
- *
- * @http: our HTTP object with remote host info
+ * How many links from the first page the next page
+ * in the queue is; UINT_MAX if there are none.
  */
-static int
-URL_acceptable(struct http_t *http, btree_obj_t *tree_archived, buf_t *url)
+unsigned int
+next_page_depth(queue_obj_t *URL_queue)
 {
-	assert(http);
+	assert(URL_queue);
 
-	int i;
+	return __front_depth(URL_queue);
+}
 
-	if (url->data_len >= 256)
-		return 0;
+/**
+ * Whether the next asset should be taken ahead of the
+ * next page: when there are no pages, or the asset is
+ * from a level we haven't finished yet.
+ */
+int
+asset_due(queue_obj_t *URL_queue)
+{
+	assert(URL_queue);
 
-	if (strstr(url->buf_head, "mailto"))
+	if (!assets_queued())
 		return 0;
 
-	if (!strncmp("http:", url->buf_head, 5)
-	|| !strncmp("https:", url->buf_head, 6))
-	{
-		if (url->data_len < httplen || url->data_len < httpslen)
-			return 0;
+	return (!URL_queue->nr_items || __front_depth(Asset_lane) < __front_depth(URL_queue));
+}
 
-#if 0
-		if (got_token_graph(nwctx))
-		{
-			http_parse_page(url->buf_head, tmp_page);
-			if (!robots_eval_url(allowed, forbidden, tmp_page))
-			{
-				return 0;
-			}
-		}
-#endif
-	}
+/**
+ * Take the next URL from the queue, returning its ID
+ * or URL_ID_NONE if both lanes are empty. Each level
+ * is done before the next; within one, pages come first
+ * and an asset is taken after every ASSET_LANE_INTERVAL
+ * of them.
+ */
+url_id_t
+dequeue_URL_id(queue_obj_t *URL_queue)
+{
+	assert(URL_queue);
 
-	if (local_archive_exists(http, url->buf_head))
-	{
-		return 0;
-	}
+	url_id_t id;
+	int asset = asset_due(URL_queue);
 
-	if (memchr(url->buf_head, '#', url->buf_tail - url->buf_head))
-		return 0;
+/*
+ * Never one from the next level before this one is done.
+ */
+	if (!asset && Pages_since_asset >= ASSET_LANE_INTERVAL)
+		asset = (assets_queued() && __front_depth(Asset_lane) <= __front_depth(URL_queue));
 
-	for (i = 0; __disallowed_tokens[i] != NULL; ++i)
+	if (!asset && URL_ID_NONE != (id = __dequeue(URL_queue)))
 	{
-		if (strstr(url->buf_head, __disallowed_tokens[i]))
-			return 0;
+		++Pages_since_asset;
+		return id;
 	}
 
-	char Host[1024];
-	http->ops->URL_parse_host(url->buf_head, Host);
-
-	if (memcmp((void *)http->host, (void *)Host, strlen(Host)))
-	{
-		return 0;
-	}
+	Pages_since_asset = 0;
 
-	if (BTREE_search_data(tree_archived, (void *)url->buf_head, url->data_len))
-		return 0;
+	if (URL_ID_NONE != (id = __dequeue(Asset_lane)))
+		return id;
 
-	return 1;
+	return __dequeue(URL_queue);
 }
 
 /**
- * XXX	Should probably go into utils_url.c
- *
- * Parse URLs from document and add them to the queue.
- *
- * @http our HTTP object with remote host info
- * @URL_queue our queue of URLs that we will add to
- * @tree_archived tree of already-archived URLs to search through before adding to queue
+ * How many URLs are waiting in both lanes.
  */
 int
-parse_URLs(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archived)
+URLs_queued(queue_obj_t *URL_queue)
 {
-	assert(http);
 	assert(URL_queue);
-	assert(tree_archived);
-
-	char *p = NULL;
-	char *savep = NULL;
-	char delim;
-	int url_type_idx = 0;
-	size_t url_len = 0;
-	buf_t *buf = &http_rbuf(http);
-	buf_t URL;
-	buf_t full_URL;
-	buf_t path;
 
-	nr_urls_call = 0;
-
-	assert(buf->buf_head);
-
-	if (buf_init(&URL, HTTP_URL_MAX) < 0)
-		goto fail;
+	return (URL_queue->nr_items + assets_queued());
+}
 
-	if (buf_init(&full_URL, HTTP_URL_MAX) < 0)
-		goto fail_destroy_bufs;
+int
+assets_queued(void)
+{
+	return (Asset_lane ? Asset_lane->nr_items : 0);
+}
 
-	if (buf_init(&path, path_max) < 0)
-		goto fail_destroy_bufs;
+/**
+ * Queue the URL with ID if we want to crawl it.
+ *
+ * @http our HTTP object, holding the page the URL was found in
+ * @URL_queue our queue of URLs
+ * @URLs_archived IDs of already-archived URLs
+ * @id the URL's ID in the URL arena
+ */
+int
+enqueue_URL_id_if_acceptable(struct http_t *http, queue_obj_t *URL_queue, url_set_t *URLs_archived, url_id_t id)
+{
+	unsigned int depth = (http->depth + 1);
 
-	savep = buf->buf_head;
+/*
+ * A crawlDepth of 0 means go as deep as there is.
+ */
+	if (nwctx.config.crawl_depth && depth > nwctx.config.crawl_depth)
+		return 0;
 
-	while (1)
+	if (!URL_acceptable(http, URLs_archived, id))
 	{
-		buf_clear(&URL);
-		buf_clear(&full_URL);
-		buf_clear(&path);
-
-		p = strstr(savep, url_types[url_type_idx].string);
-		delim = url_types[url_type_idx].delim;
+		//Log("\nURL is not acceptable\n");
+		return 0;
+	}
 
-		if (!p || p >= buf->buf_tail)
-		{
-			++url_type_idx;
+	__set_depth(id, depth);
 
-			if (url_types[url_type_idx].delim == 0)
-				break;
+	if (enqueue_URL_id(URL_queue, id) < 0)
+		return -1;
 
-			savep = buf->buf_head;
-			continue;
-		}
+	//Log("\nAdded URL to queue: %d items in queue\n", URL_queue->nr_items);
 
-		savep = (p += url_types[url_type_idx].len);
-		p = memchr(savep, delim, (buf->buf_tail - savep));
+	return 1;
+}
 
-		if (!p)
-		{
-			++url_type_idx;
+/**
+ * Add FULL_URL to the queue if it is one we want to crawl.
+ *
+ * @http our HTTP object with remote host info
+ * @URL_queue our queue of URLs
+ * @URLs_archived IDs of already-archived URLs
+ * @full_URL the URL, already made into a full URL
+ */
+int
+enqueue_full_URL(struct http_t *http, queue_obj_t *URL_queue, url_set_t *URLs_archived, buf_t *full_URL)
+{
+	assert(http);
+	assert(URL_queue);
+	assert(URLs_archived);
+	assert(full_URL);
 
-			if (url_types[url_type_idx].delim == 0)
-				break;
+	url_id_t id = URL_ARENA_intern(URL_arena, full_URL->buf_head, full_URL->data_len);
 
-			savep = buf->buf_head;
-			continue;
-		}
+	if (URL_ID_NONE == id)
+		return 0;
 
-		url_len = (p - savep);
+	return enqueue_URL_id_if_acceptable(http, URL_queue, URLs_archived, id);
+}
 
-		if (!url_len || url_len >= HTTP_URL_MAX)
-		{
-			savep = ++p;
-			continue;
-		}
+/**
+ * XXX	Should probably go into utils_url.c
+ *
+ * Add the URLs found in the document to the queue.
+ *
+ * @http our HTTP object with remote host info
+ * @links the document's links, from link_table_build()
+ * @URL_queue our queue of URLs that we will add to
+ * @URLs_archived IDs of already-archived URLs, which we don't add to the queue
+ */
+int
+parse_URLs(struct http_t *http, struct link_table *links, queue_obj_t *URL_queue, url_set_t *URLs_archived)
+{
+	assert(http);
+	assert(links);
+	assert(URL_queue);
+	assert(URLs_archived);
 
-		assert(url_len > 0);
-		assert(url_len < HTTP_URL_MAX);
+	struct link *link;
+	int i;
 
-		buf_append_ex(&URL, savep, url_len);
-		BUF_NULL_TERMINATE(&URL);
+	nr_urls_call = 0;
 
-		//Log("\nMaking full URL from %s\n", URL.buf_head);
-		make_full_url(http, &URL, &full_URL);
-		//Log("\nMade full URL: %s\n", full_URL.buf_head);
+	for (i = 0; i < links->nr_links; ++i)
+	{
+		link = &links->links[i];
 
-		if (!URL_acceptable(http, tree_archived, &full_URL))
-		{
-			//Log("\nURL is not acceptable\n");
-			savep = ++p;
+		if (URL_ID_NONE == link->id)
 			continue;
-		}
 
-		if (QUEUE_enqueue(URL_queue, (void *)full_URL.buf_head, full_URL.data_len) < 0)
-			goto fail_destroy_bufs;
+		switch (enqueue_URL_id_if_acceptable(http, URL_queue, URLs_archived, link->id))
+		{
+			case -1:
+				goto fail;
 
-		//Log("\nAdded URL to queue: %d items in queue\n", URL_queue->nr_items);
+			case 0:
+				continue;
+		}
 
-		savep = ++p;
 		++nr_urls_call;
 	}
 
-	buf_destroy(&URL);
-	buf_destroy(&full_URL);
-	buf_destroy(&path);
-
 #ifdef DEBUG
 	fprintf(stderr, "parse_URLs: returning %d\n", nr_urls_call);
 #endif
 	return nr_urls_call;
 
-fail_destroy_bufs:
+fail:
 
-	buf_destroy(&URL);
-	buf_destroy(&full_URL);
-	buf_destroy(&path);
 #ifdef DEBUG
 	fprintf(stderr, "parse_URLs: failed\n");
 #endif
-
-fail:
 	return -1;
 }
 
 int
-Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archived)
+Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, url_set_t *URLs_archived)
 {
 	assert(http);
 	assert(URL_queue);
-	assert(tree_archived);
+	assert(URLs_archived);
 
-	if (!URL_queue->nr_items)
+	if (!URLs_queued(URL_queue))
 		return 0;
 
 #ifdef DEBUG
@@ -788,12 +1719,16 @@ Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_arc
 			"Entered Crawl_WebSite():\n"
 			"URLs in queue: %d\n"
 			"URLs archived: %d\n",
-			URL_queue->nr_items,
-			tree_archived->nr_nodes);
+			URLs_queued(URL_queue),
+			URLs_archived->nr_ids);
 #endif
-	queue_item_t *item = NULL;
+	url_id_t id;
 	Dead_URL_t *dead = NULL;
+	struct link_stream stream;
+	struct link_table links;
 	int code;
+	int streamed;
+	int rv;
 
 	if (!(Dead_URL_cache = cache_create(
 			"dead_url_cache",
@@ -807,7 +1742,19 @@ Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_arc
 		goto fail;
 	}
 
-	btree_node_t *node = NULL;
+	if (link_table_init(&links) < 0)
+	{
+		put_error_msg("failed to set up link table");
+		goto fail;
+	}
+
+	if (link_stream_init(&stream, &links, http, URL_queue, URLs_archived, NULL, NULL) < 0)
+	{
+		put_error_msg("failed to set up link stream");
+		link_table_destroy(&links);
+		goto fail;
+	}
+
 	while (1)
 	{
 		buf_clear(&http_rbuf(http));
@@ -815,36 +1762,45 @@ Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_arc
 
 		do
 		{
-			Log("%d items in queue\n", URL_queue->nr_items);
-			item = QUEUE_dequeue(URL_queue);
-			Log("%d items in queue\n", URL_queue->nr_items);
-			if (NULL == item)
+			Log("%d items in queue\n", URLs_queued(URL_queue));
+			id = dequeue_URL_id(URL_queue);
+			Log("%d items in queue\n", URLs_queued(URL_queue));
+			if (URL_ID_NONE == id)
 				break;
 
-			Log("Dequeued item: %s\n", (char *)item->data);
+			Log("Dequeued item: %s\n", URL_ARENA_string(URL_arena, id));
 		}
-		while (NULL != (node = BTREE_search_data(tree_archived, item->data, strlen((char *)item->data))));
+		while (URL_SET_has(URLs_archived, id));
 
-		if (!item)
+		if (URL_ID_NONE == id)
 			break;
 
-		assert(item->data_len < HTTP_URL_MAX);
-		strcpy(http->URL, (char *)item->data);
-		http->URL_len = item->data_len;
-
-		if ((dead = search_dead_URL(Dead_URL_cache, http->URL)))
+		if ((dead = search_dead_URL(Dead_URL_cache, id)))
 		{
 			++dead->times_seen;
 			continue;
 		}
 
-		http->ops->URL_parse_host(http->URL, http->host);
-		http->ops->URL_parse_page(http->URL, http->page);
+		if (load_URL(http, id) < 0)
+			continue;
+
+	/*
+	 * The first time we get to a host, see what its
+	 * robots.txt says; URLs queued before then may
+	 * turn out to be off limits.
+	 */
+		if (robots_load(http) < 0)
+			put_error_msg("Failed to get robots.txt for %s", http->host);
+
+		if (!robots_allow(http_host_id(http), http->page, strlen(http->page)))
+			continue;
 
 		BLOCK_SIGNAL(SIGINT);
-		sleep(nwctx.config.crawl_delay);
+		robots_pace(http_host_id(http), nwctx.config.crawl_delay);
 		UNBLOCK_SIGNAL(SIGINT);
 
+		archive_prepare_resume(http);
+
 #ifdef DEBUG
 		fprintf(stderr, "Sending HTTP request for page\n");
 #endif
@@ -852,9 +1808,20 @@ Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_arc
 #ifdef DEBUG
 		fprintf(stderr, "Receiving HTTP response\n");
 #endif
-		http->ops->recv_response(http);
+		rv = http->ops->recv_response(http);
 
+		streamed = link_stream_finish(&stream);
 		code = http->code;
+
+	/*
+	 * The body was cut off, but we kept what
+	 * we got; try again later for the rest.
+	 */
+		if (rv < 0 && archive_retry_partial(http))
+		{
+			enqueue_URL_id(URL_queue, http_URL_id(http));
+			goto next;
+		}
 #ifdef DEBUG
 		fprintf(stderr, "Got response [%d]\n", code);
 #endif
@@ -862,12 +1829,13 @@ Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_arc
 		switch (code)
 		{
 			case HTTP_OK:
+			case HTTP_PARTIAL_CONTENT:
 
 				break;
 
 			case HTTP_NOT_FOUND:
 
-				cache_dead_URL(Dead_URL_cache, http->URL, code);
+				cache_dead_URL(Dead_URL_cache, http_URL_id(http), code);
 				Log("%d dead URLs cached\n", cache_nr_used(Dead_URL_cache));
 
 			default:
@@ -875,27 +1843,57 @@ Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_arc
 				goto next;
 		}
 
-		Log("Adding URL to archived documents tree\n");
-		BTREE_put_data(tree_archived, (void *)http->URL, http->URL_len);
-#ifdef DEBUG
-		btree_node_t *node = BTREE_search_data(tree_archived, (void *)http->URL, http->URL_len);
-		assert(node);
-#endif
-		Log("%d archived documents\n", tree_archived->nr_nodes);
+		Log("Adding URL to the archived set\n");
+		id = http_URL_id(http);
+		if (URL_SET_add(URLs_archived, id) < 0)
+		{
+			put_error_msg("Failed to record %s as archived", http->URL);
+			break;
+		}
+
+		Log("%d archived documents\n", URLs_archived->nr_ids);
 
-		if (URL_parseable(http->URL))
+	/*
+	 * Its links lead where the page it's much like
+	 * led us already.
+	 */
+		if (URL_parseable(http->URL) && page_is_near_duplicate(http))
 		{
-			parse_URLs(http, URL_queue, tree_archived);
-			transform_document_URLs(http);
+			link_stream_release(&stream, 0);
+			update_operation_status("Near duplicate of a page already crawled");
+
+			if (NEAR_DUPS_NOFOLLOW == nwctx.config.near_dups && archive_page(http) < 0)
+				Log("Failed to archive %s\n", http->URL);
+
+			goto next;
+		}
+
+		if (streamed)
+			link_stream_release(&stream, 1);
+
+	/*
+	 * If the page was scanned as it was received, its
+	 * links are already in the table and queued.
+	 */
+		if (URL_parseable(http->URL) && (streamed || link_table_build(&links, http) >= 0))
+		{
+			if (!streamed && parse_URLs(http, &links, URL_queue, URLs_archived) < 0)
+				put_error_msg("Failed to queue the links in %s", http->URL);
+
+			transform_document_URLs(http, &links);
 		}
 
-		archive_page(http);
+		if (archive_page(http) < 0)
+			Log("Failed to archive %s\n", http->URL);
 
 	next:
 
 		(void)code;
 	}
 
+	link_stream_destroy(&stream);
+	link_table_destroy(&links);
+
 fail:
 	return -1;
 }
@@ -0,0 +1,643 @@
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "buffer.h"
+#include "http.h"
+#include "netwasabi.h"
+#include "robots.h"
+
+#define ROBOTS_DEFAULT_NODES 64
+#define ROBOTS_MATCH_BUDGET 100000 /* steps a match with wildcards may take */
+#define ROBOTS_MAX_CRAWL_DELAY 60 /* seconds; more than this and we'd never finish */
+
+int
+robots_rules_init(robots_rules_t *rules)
+{
+	assert(rules);
+
+	rules->nodes = calloc(ROBOTS_DEFAULT_NODES, sizeof(struct robots_node));
+	if (!rules->nodes)
+		return -1;
+
+	rules->nr_nodes = 1;
+	rules->nr_allocated = ROBOTS_DEFAULT_NODES;
+	rules->crawl_delay = 0;
+	rules->sitemaps = NULL;
+	rules->nr_sitemaps = 0;
+
+	return 0;
+}
+
+void
+robots_rules_destroy(robots_rules_t *rules)
+{
+	assert(rules);
+
+	int i;
+
+	free(rules->nodes);
+	rules->nodes = NULL;
+	rules->nr_nodes = rules->nr_allocated = 0;
+
+	for (i = 0; i < rules->nr_sitemaps; ++i)
+		free(rules->sitemaps[i]);
+
+	free(rules->sitemaps);
+	rules->sitemaps = NULL;
+	rules->nr_sitemaps = 0;
+
+	return;
+}
+
+/*
+ * Get the child of node N for character C,
+ * adding it if need be. Returns 0 on failure.
+ */
+static uint32_t
+__child(robots_rules_t *rules, uint32_t n, unsigned char c)
+{
+	struct robots_node *nodes;
+	uint32_t child;
+
+	for (child = rules->nodes[n].child; child; child = rules->nodes[child].sibling)
+	{
+		if (rules->nodes[child].c == c)
+			return child;
+	}
+
+	if (rules->nr_nodes >= rules->nr_allocated)
+	{
+		nodes = realloc(rules->nodes, (rules->nr_allocated * 2 * sizeof(struct robots_node)));
+		if (!nodes)
+			return 0;
+
+		rules->nodes = nodes;
+		rules->nr_allocated *= 2;
+	}
+
+	child = rules->nr_nodes++;
+	memset(&rules->nodes[child], 0, sizeof(struct robots_node));
+
+	rules->nodes[child].c = c;
+	rules->nodes[child].sibling = rules->nodes[n].child;
+	rules->nodes[n].child = child;
+
+	return child;
+}
+
+static int
+__add_rule(robots_rules_t *rules, const char *pattern, size_t len, int rule)
+{
+	uint32_t n = 0;
+	int anchored = 0;
+	size_t i;
+
+	if (len && pattern[len - 1] == '$')
+	{
+		anchored = 1;
+		--len;
+	}
+
+	if (len > UINT16_MAX)
+		return 0;
+
+	for (i = 0; i < len; ++i)
+	{
+		if (!(n = __child(rules, n, (unsigned char)pattern[i])))
+			return -1;
+	}
+
+/*
+ * The same path can be both allowed and
+ * disallowed; Allow wins.
+ */
+	if (anchored)
+	{
+		if (rules->nodes[n].anchored_rule != ROBOTS_RULE_ALLOW)
+			rules->nodes[n].anchored_rule = rule;
+
+		rules->nodes[n].anchored_len = (uint16_t)len;
+	}
+	else
+	{
+		if (rules->nodes[n].rule != ROBOTS_RULE_ALLOW)
+			rules->nodes[n].rule = rule;
+
+		rules->nodes[n].len = (uint16_t)len;
+	}
+
+	return 0;
+}
+
+static int
+__add_sitemap(robots_rules_t *rules, const char *URL, size_t len)
+{
+	char **sitemaps;
+
+	if (rules->nr_sitemaps >= ROBOTS_MAX_SITEMAPS)
+		return 0;
+
+	sitemaps = realloc(rules->sitemaps, ((rules->nr_sitemaps + 1) * sizeof(char *)));
+	if (!sitemaps)
+		return -1;
+
+	rules->sitemaps = sitemaps;
+
+	if (!(rules->sitemaps[rules->nr_sitemaps] = strndup(URL, len)))
+		return -1;
+
+	++rules->nr_sitemaps;
+
+	return 0;
+}
+
+/*
+ * Does the User-agent value VALUE name us?
+ */
+static int
+__names_us(const char *value, size_t len, int want_star)
+{
+	if (want_star)
+		return (len == 1 && *value == '*');
+
+	return (len >= strlen(ROBOTS_AGENT) && !strncasecmp(value, ROBOTS_AGENT, strlen(ROBOTS_AGENT)));
+}
+
+/*
+ * Go through the file adding the rules of the groups
+ * that name us (or, if WANT_STAR, of the "*" groups).
+ * Returns the number of such groups.
+ */
+static int
+__parse_pass(robots_rules_t *rules, const char *txt, size_t len, int want_star)
+{
+	const char *p = txt;
+	const char *end = (txt + len);
+	const char *eol;
+	const char *colon;
+	const char *name_end;
+	const char *value;
+	const char *value_end;
+	int in_agents = 0; /* the line before was a User-agent line */
+	int applies = 0;
+	int nr_groups = 0;
+	double delay;
+
+	while (p < end)
+	{
+		eol = memchr(p, '\n', (end - p));
+		if (!eol)
+			eol = end;
+
+		value_end = memchr(p, '#', (eol - p));
+		if (!value_end)
+			value_end = eol;
+
+		colon = memchr(p, ':', (value_end - p));
+
+		if (!colon)
+			goto next;
+
+		while (p < colon && isspace((unsigned char)*p))
+			++p;
+
+		name_end = colon;
+		while (name_end > p && isspace((unsigned char)*(name_end - 1)))
+			--name_end;
+
+		value = (colon + 1);
+		while (value < value_end && isspace((unsigned char)*value))
+			++value;
+
+		while (value_end > value && isspace((unsigned char)*(value_end - 1)))
+			--value_end;
+
+		if ((name_end - p) == 10 && !strncasecmp(p, "user-agent", 10))
+		{
+			if (!in_agents)
+				applies = 0;
+
+			in_agents = 1;
+
+			if (__names_us(value, (value_end - value), want_star))
+			{
+				if (!applies)
+					++nr_groups;
+
+				applies = 1;
+			}
+
+			goto next;
+		}
+
+		in_agents = 0;
+
+	/*
+	 * Sitemap lines belong to no group; take
+	 * them on the first pass only.
+	 */
+		if ((name_end - p) == 7 && !strncasecmp(p, "sitemap", 7))
+		{
+			if (!want_star && value < value_end && __add_sitemap(rules, value, (value_end - value)) < 0)
+				return -1;
+
+			goto next;
+		}
+
+		if (!applies)
+			goto next;
+
+		if ((name_end - p) == 5 && !strncasecmp(p, "allow", 5))
+		{
+			if (value < value_end && __add_rule(rules, value, (value_end - value), ROBOTS_RULE_ALLOW) < 0)
+				return -1;
+		}
+		else
+		if ((name_end - p) == 8 && !strncasecmp(p, "disallow", 8))
+		{
+		/*
+		 * An empty Disallow disallows nothing.
+		 */
+			if (value < value_end && __add_rule(rules, value, (value_end - value), ROBOTS_RULE_DISALLOW) < 0)
+				return -1;
+		}
+		else
+		if ((name_end - p) == 11 && !strncasecmp(p, "crawl-delay", 11))
+		{
+			delay = strtod(value, NULL);
+
+			if (delay > ROBOTS_MAX_CRAWL_DELAY)
+				delay = ROBOTS_MAX_CRAWL_DELAY;
+
+			if (delay > 0)
+				rules->crawl_delay = (unsigned int)(delay + 0.999);
+		}
+
+	next:
+
+		p = (eol + 1);
+	}
+
+	return nr_groups;
+}
+
+/**
+ * Compile the rules in robots.txt file TXT that apply
+ * to us: those of the groups naming us if there are
+ * any, else those of the "*" groups.
+ *
+ * @rules Initialised rules, to add to
+ * @txt The robots.txt file
+ * @len Its length
+ */
+int
+robots_parse(robots_rules_t *rules, const char *txt, size_t len)
+{
+	assert(rules);
+	assert(txt);
+
+	int nr_groups;
+
+	if (len > ROBOTS_MAX_SIZE)
+		len = ROBOTS_MAX_SIZE;
+
+	nr_groups = __parse_pass(rules, txt, len, 0);
+
+	if (nr_groups < 0)
+		return -1;
+
+	if (nr_groups > 0)
+		return 0;
+
+	return (__parse_pass(rules, txt, len, 1) < 0 ? -1 : 0);
+}
+
+struct robots_match
+{
+	const char *path;
+	size_t len;
+	int rule;
+	size_t rule_len;
+	long budget;
+};
+
+static void
+__consider(struct robots_match *m, int rule, size_t len)
+{
+	if (len > m->rule_len || (len == m->rule_len && ROBOTS_RULE_ALLOW == rule))
+	{
+		m->rule = rule;
+		m->rule_len = len;
+	}
+
+	return;
+}
+
+static void
+__match(robots_rules_t *rules, uint32_t n, size_t pos, struct robots_match *m)
+{
+	struct robots_node *node = &rules->nodes[n];
+	uint32_t child;
+	size_t k;
+
+	if (--m->budget < 0)
+		return;
+
+	if (node->rule)
+		__consider(m, node->rule, node->len);
+
+	if (node->anchored_rule && pos == m->len)
+		__consider(m, node->anchored_rule, node->anchored_len);
+
+	for (child = node->child; child; child = rules->nodes[child].sibling)
+	{
+		if ('*' == rules->nodes[child].c)
+		{
+			for (k = pos; k <= m->len; ++k)
+				__match(rules, child, k, m);
+		}
+		else
+		if (pos < m->len && rules->nodes[child].c == (unsigned char)m->path[pos])
+		{
+			__match(rules, child, (pos + 1), m);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Check PATH (and query) against the rules.
+ * Returns 1 if we may fetch it.
+ */
+int
+robots_rules_allow(robots_rules_t *rules, const char *path, size_t len)
+{
+	assert(rules);
+	assert(path);
+
+	struct robots_match m;
+
+	if (!len)
+	{
+		path = "/";
+		len = 1;
+	}
+
+	m.path = path;
+	m.len = len;
+	m.rule = ROBOTS_RULE_NONE;
+	m.rule_len = 0;
+	m.budget = ROBOTS_MATCH_BUDGET;
+
+	__match(rules, 0, 0, &m);
+
+	return (ROBOTS_RULE_DISALLOW != m.rule);
+}
+
+#define ROBOTS_UNKNOWN 0
+#define ROBOTS_FETCHING 1
+#define ROBOTS_READY 2
+
+struct robots_host
+{
+	int state;
+	robots_rules_t rules;
+	struct timespec next_request; /* robots_pace() won't let us go before this */
+};
+
+static struct robots_host *Robots_hosts = NULL;
+static uint32_t Robots_nr_hosts = 0;
+static pthread_mutex_t Robots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Make sure there is an entry for HOST_ID
+ * (with Robots_lock held).
+ */
+static struct robots_host *
+__host(host_id_t host_id)
+{
+	struct robots_host *hosts;
+	uint32_t nr = (Robots_nr_hosts ? Robots_nr_hosts : 16);
+
+	if (host_id < Robots_nr_hosts)
+		return &Robots_hosts[host_id];
+
+	while (nr <= host_id)
+		nr *= 2;
+
+	hosts = realloc(Robots_hosts, (nr * sizeof(struct robots_host)));
+	if (!hosts)
+		return NULL;
+
+	memset(&hosts[Robots_nr_hosts], 0, ((nr - Robots_nr_hosts) * sizeof(struct robots_host)));
+
+	Robots_hosts = hosts;
+	Robots_nr_hosts = nr;
+
+	return &Robots_hosts[host_id];
+}
+
+static int
+__parse_body(struct http_t *http, const char *body, size_t len, void *arg)
+{
+	(void)http;
+
+	return robots_parse((robots_rules_t *)arg, body, len);
+}
+
+/**
+ * Fetch and compile the robots.txt of the host HTTP
+ * is about to make a request to, unless we already
+ * have. HTTP is left as it was.
+ *
+ * @http Our HTTP object, with its URL about to be fetched
+ */
+int
+robots_load(struct http_t *http)
+{
+	assert(http);
+
+	struct robots_host *host;
+	host_id_t host_id = http_host_id(http);
+	robots_rules_t rules;
+	int rv;
+
+	if (HOST_ID_NONE == host_id)
+		return -1;
+
+	pthread_mutex_lock(&Robots_lock);
+
+	host = __host(host_id);
+
+	if (!host || ROBOTS_UNKNOWN != host->state)
+	{
+		pthread_mutex_unlock(&Robots_lock);
+		return (host ? 0 : -1);
+	}
+
+	host->state = ROBOTS_FETCHING;
+
+	pthread_mutex_unlock(&Robots_lock);
+
+	if (robots_rules_init(&rules) < 0)
+		goto fail;
+
+/*
+ * No robots.txt (or one we can't get) means
+ * no rules.
+ */
+	rv = fetch_aside(http, "/robots.txt", __parse_body, (void *)&rules);
+
+	pthread_mutex_lock(&Robots_lock);
+
+	host = &Robots_hosts[host_id];
+	memcpy(&host->rules, &rules, sizeof(rules));
+	host->state = ROBOTS_READY;
+
+	pthread_mutex_unlock(&Robots_lock);
+
+	return (rv < 0 ? -1 : 0);
+
+fail:
+
+	pthread_mutex_lock(&Robots_lock);
+	Robots_hosts[host_id].state = ROBOTS_UNKNOWN;
+	pthread_mutex_unlock(&Robots_lock);
+
+	return -1;
+}
+
+/**
+ * Check whether the robots.txt of the host with
+ * HOST_ID lets us fetch PATH. Until we have it,
+ * everything is allowed.
+ */
+int
+robots_allow(host_id_t host_id, const char *path, size_t len)
+{
+	assert(path);
+
+	int allow = 1;
+
+	pthread_mutex_lock(&Robots_lock);
+
+	if (host_id < Robots_nr_hosts && ROBOTS_READY == Robots_hosts[host_id].state)
+		allow = robots_rules_allow(&Robots_hosts[host_id].rules, path, len);
+
+	pthread_mutex_unlock(&Robots_lock);
+
+	return allow;
+}
+
+/**
+ * Call CB with each sitemap URL given in the
+ * robots.txt of the host with HOST_ID.
+ * Returns how many there were.
+ */
+int
+robots_for_each_sitemap(host_id_t host_id, void (*cb)(const char *, void *), void *arg)
+{
+	assert(cb);
+
+	robots_rules_t *rules;
+	int nr = 0;
+	int i;
+
+	pthread_mutex_lock(&Robots_lock);
+
+	if (host_id < Robots_nr_hosts && ROBOTS_READY == Robots_hosts[host_id].state)
+	{
+		rules = &Robots_hosts[host_id].rules;
+
+		for (i = 0; i < rules->nr_sitemaps; ++i)
+			cb(rules->sitemaps[i], arg);
+
+		nr = rules->nr_sitemaps;
+	}
+
+	pthread_mutex_unlock(&Robots_lock);
+
+	return nr;
+}
+
+/**
+ * Wait until we may send the next request to the
+ * host with HOST_ID: at least DELAY seconds, or its
+ * Crawl-delay if longer, after the last one.
+ */
+void
+robots_pace(host_id_t host_id, unsigned int delay)
+{
+	struct robots_host *host;
+	struct timespec now;
+	struct timespec wait = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&Robots_lock);
+
+	host = __host(host_id);
+
+	if (!host)
+	{
+		pthread_mutex_unlock(&Robots_lock);
+		return;
+	}
+
+	if (ROBOTS_READY == host->state && host->rules.crawl_delay > delay)
+		delay = host->rules.crawl_delay;
+
+	if (host->next_request.tv_sec > now.tv_sec
+	|| (host->next_request.tv_sec == now.tv_sec && host->next_request.tv_nsec > now.tv_nsec))
+	{
+		wait.tv_sec = (host->next_request.tv_sec - now.tv_sec);
+		wait.tv_nsec = (host->next_request.tv_nsec - now.tv_nsec);
+
+		if (wait.tv_nsec < 0)
+		{
+			--wait.tv_sec;
+			wait.tv_nsec += 1000000000L;
+		}
+
+		now = host->next_request;
+	}
+
+	host->next_request.tv_sec = (now.tv_sec + delay);
+	host->next_request.tv_nsec = now.tv_nsec;
+
+	pthread_mutex_unlock(&Robots_lock);
+
+	while (nanosleep(&wait, &wait) < 0 && EINTR == errno)
+		;
+
+	return;
+}
+
+void
+robots_free_hosts(void)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&Robots_lock);
+
+	for (i = 0; i < Robots_nr_hosts; ++i)
+	{
+		if (ROBOTS_READY == Robots_hosts[i].state)
+			robots_rules_destroy(&Robots_hosts[i].rules);
+	}
+
+	free(Robots_hosts);
+	Robots_hosts = NULL;
+	Robots_nr_hosts = 0;
+
+	pthread_mutex_unlock(&Robots_lock);
+
+	return;
+}
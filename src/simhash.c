@@ -0,0 +1,279 @@
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "simhash.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/*
+ * Spread the bits of X about so that every bit of
+ * a shingle hash is as likely to be set as not.
+ */
+static uint64_t
+__mix(uint64_t x)
+{
+	x ^= (x >> 30);
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= (x >> 27);
+	x *= 0x94d049bb133111ebULL;
+	x ^= (x >> 31);
+
+	return x;
+}
+
+void
+simhash_init(struct simhash *sh)
+{
+	assert(sh);
+
+	memset(sh, 0, sizeof(*sh));
+	sh->word = FNV_OFFSET;
+
+	return;
+}
+
+static void
+__end_word(struct simhash *sh)
+{
+	uint64_t h;
+	int i;
+	int bit;
+
+	if (!sh->word_len)
+		return;
+
+	memmove(sh->window, (sh->window + 1), ((SIMHASH_SHINGLE - 1) * sizeof(uint64_t)));
+	sh->window[SIMHASH_SHINGLE - 1] = sh->word;
+
+	sh->word = FNV_OFFSET;
+	sh->word_len = 0;
+
+	if (++sh->nr_words < SIMHASH_SHINGLE)
+		return;
+
+	for (h = 0, i = 0; i < SIMHASH_SHINGLE; ++i)
+		h = __mix(h ^ sh->window[i]);
+
+	for (bit = 0; bit < 64; ++bit)
+		sh->votes[bit] += ((h >> bit) & 1) ? 1 : -1;
+
+	++sh->nr_shingles;
+
+	return;
+}
+
+/*
+ * We've just read the name of the tag we're in.
+ */
+static void
+__end_tag_name(struct simhash *sh)
+{
+	if (sh->tag_len < 0)
+		return;
+
+	sh->tag[sh->tag_len] = 0;
+
+	if (!strcasecmp("script", sh->tag) || !strcasecmp("style", sh->tag))
+		sh->in_raw = !sh->closing;
+
+	sh->tag_len = -1;
+
+	return;
+}
+
+/**
+ * Add the next LEN bytes of the page to the hash.
+ */
+void
+simhash_feed(struct simhash *sh, const char *data, size_t len)
+{
+	assert(sh);
+	assert(data);
+
+	const unsigned char *p = (const unsigned char *)data;
+	const unsigned char *e = (p + len);
+	unsigned char c;
+
+	for (; p < e; ++p)
+	{
+		c = *p;
+
+		if (sh->in_tag)
+		{
+			if ('>' == c)
+			{
+				__end_tag_name(sh);
+				sh->in_tag = 0;
+			}
+			else
+			if (sh->tag_len >= 0)
+			{
+				if ('/' == c && !sh->tag_len)
+					sh->closing = 1;
+				else
+				if (isalnum(c) && sh->tag_len < (SIMHASH_TAG_MAX - 1))
+					sh->tag[sh->tag_len++] = c;
+				else
+					__end_tag_name(sh);
+			}
+
+			continue;
+		}
+
+		if ('<' == c)
+		{
+			__end_word(sh);
+
+			sh->in_tag = 1;
+			sh->closing = 0;
+			sh->tag_len = 0;
+
+			continue;
+		}
+
+		if (sh->in_raw)
+			continue;
+
+		if (isalnum(c) || c >= 0x80)
+		{
+			sh->word = ((sh->word ^ tolower(c)) * FNV_PRIME);
+			++sh->word_len;
+		}
+		else
+		{
+			__end_word(sh);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Put the fingerprint of the page in *FP. Returns -1
+ * if there was too little text to go on.
+ */
+int
+simhash_final(struct simhash *sh, uint64_t *fp)
+{
+	assert(sh);
+	assert(fp);
+
+	int bit;
+
+	__end_word(sh);
+
+	if (sh->nr_shingles < SIMHASH_MIN_SHINGLES)
+		return -1;
+
+	for (*fp = 0, bit = 0; bit < 64; ++bit)
+	{
+		if (sh->votes[bit] > 0)
+			*fp |= (1ULL << bit);
+	}
+
+	return 0;
+}
+
+/*
+ * Each fingerprint is on one chain per band, that of
+ * the value of its bits in the band. Entries are
+ * numbered from 1; 0 ends a chain.
+ */
+struct simhash_entry
+{
+	uint64_t fp;
+	uint32_t next[SIMHASH_BANDS];
+};
+
+#define SIMHASH_BAND_BITS (64 / SIMHASH_BANDS)
+#define SIMHASH_BAND(fp, b) (((fp) >> ((b) * SIMHASH_BAND_BITS)) & ((1U << SIMHASH_BAND_BITS) - 1))
+
+static uint32_t Simhash_chains[SIMHASH_BANDS][1 << SIMHASH_BAND_BITS];
+static struct simhash_entry *Simhash_entries = NULL;
+static uint32_t Simhash_nr_entries = 0;
+static uint32_t Simhash_nr_allocated = 0;
+static pthread_mutex_t Simhash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+__near(uint64_t a, uint64_t b)
+{
+	return (__builtin_popcountll(a ^ b) <= SIMHASH_MAX_DISTANCE);
+}
+
+/**
+ * Check whether we've seen a page within SIMHASH_MAX_DISTANCE
+ * bits of FP; if not, remember this one. Returns 1 if we have.
+ */
+int
+simhash_seen(uint64_t fp)
+{
+	struct simhash_entry *entries;
+	uint32_t i;
+	uint32_t nr;
+	int b;
+	int seen = 0;
+
+	pthread_mutex_lock(&Simhash_lock);
+
+	for (b = 0; b < SIMHASH_BANDS && !seen; ++b)
+	{
+		for (i = Simhash_chains[b][SIMHASH_BAND(fp, b)]; i; i = Simhash_entries[i].next[b])
+		{
+			if (__near(fp, Simhash_entries[i].fp))
+			{
+				seen = 1;
+				break;
+			}
+		}
+	}
+
+	if (seen)
+		goto out;
+
+	if ((Simhash_nr_entries + 1) >= Simhash_nr_allocated)
+	{
+		nr = (Simhash_nr_allocated ? Simhash_nr_allocated * 2 : 1024);
+
+		entries = realloc(Simhash_entries, (nr * sizeof(struct simhash_entry)));
+		if (!entries)
+			goto out;
+
+		Simhash_entries = entries;
+		Simhash_nr_allocated = nr;
+	}
+
+	i = ++Simhash_nr_entries;
+	Simhash_entries[i].fp = fp;
+
+	for (b = 0; b < SIMHASH_BANDS; ++b)
+	{
+		Simhash_entries[i].next[b] = Simhash_chains[b][SIMHASH_BAND(fp, b)];
+		Simhash_chains[b][SIMHASH_BAND(fp, b)] = i;
+	}
+
+out:
+
+	pthread_mutex_unlock(&Simhash_lock);
+
+	return seen;
+}
+
+void
+simhash_index_destroy(void)
+{
+	pthread_mutex_lock(&Simhash_lock);
+
+	free(Simhash_entries);
+	Simhash_entries = NULL;
+	Simhash_nr_entries = Simhash_nr_allocated = 0;
+
+	memset(Simhash_chains, 0, sizeof(Simhash_chains));
+
+	pthread_mutex_unlock(&Simhash_lock);
+
+	return;
+}
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <zlib.h>
+#include "buffer.h"
+#include "netwasabi.h"
+#include "robots.h"
+#include "sitemap.h"
+#include "url_arena.h"
+#include "utils_url.h"
+#include "xml.h"
+
+struct sitemap_entry
+{
+	char *URL;
+	time_t lastmod; /* 0 if not given */
+	int order; /* where we found it, to keep ties in that order */
+};
+
+struct sitemap_ctx
+{
+	struct http_t *http;
+
+/*
+ * Pages on our host of the sitemaps still to fetch,
+ * and how many we've taken on in all.
+ */
+	char *pages[SITEMAP_MAX_FILES];
+	int nr_pages;
+	int nr_taken;
+
+	struct sitemap_entry *entries;
+	int nr_entries;
+	int nr_allocated;
+	int nr_in_file;
+
+/*
+ * The <loc> and <lastmod> of the <url>
+ * or <sitemap> we're in.
+ */
+	char *loc;
+	char *lastmod;
+};
+
+/*
+ * Take on the sitemap at URL, if it is on our host.
+ */
+static void
+__add_sitemap(const char *URL, void *arg)
+{
+	struct sitemap_ctx *ctx = (struct sitemap_ctx *)arg;
+	struct http_t *http = ctx->http;
+	url_parts_t parts;
+	size_t len = strlen(URL);
+	size_t host_len;
+
+	if (ctx->nr_taken >= SITEMAP_MAX_FILES)
+		return;
+
+	if (URL_parts_parse(URL, len, &parts) < 0 || !parts.scheme_len)
+		return;
+
+	host_len = (parts.path_off - parts.host_off);
+
+	if (host_len != strlen(http->host) || strncasecmp(URL + parts.host_off, http->host, host_len))
+		return;
+
+	if (!(ctx->pages[ctx->nr_pages] = strdup(parts.path_off < len ? (URL + parts.path_off) : "/")))
+		return;
+
+	++ctx->nr_pages;
+	++ctx->nr_taken;
+
+	return;
+}
+
+/*
+ * W3C datetime, as used by <lastmod>: YYYY-MM-DD,
+ * optionally followed by Thh:mm[:ss[.s]] and a
+ * timezone of Z or +hh:mm / -hh:mm.
+ */
+static time_t
+__parse_lastmod(const char *s)
+{
+	struct tm tm;
+	char *p;
+	int off_h = 0;
+	int off_m = 0;
+	time_t t;
+
+	memset(&tm, 0, sizeof(tm));
+
+	p = strptime(s, "%Y-%m-%d", &tm);
+	if (!p)
+		return 0;
+
+	if (*p == 'T')
+	{
+		if (!(p = strptime(p + 1, "%H:%M", &tm)))
+			return 0;
+
+		if (*p == ':')
+		{
+			tm.tm_sec = (int)strtol(p + 1, &p, 10);
+
+			if (*p == '.')
+				strtol(p + 1, &p, 10);
+		}
+
+		if (*p == '+' || *p == '-')
+		{
+			sscanf(p + 1, "%2d:%2d", &off_h, &off_m);
+
+			if (*p == '-')
+			{
+				off_h = -off_h;
+				off_m = -off_m;
+			}
+		}
+	}
+
+	t = timegm(&tm);
+
+	return (t - (off_h * 3600) - (off_m * 60));
+}
+
+static int
+__add_entry(struct sitemap_ctx *ctx)
+{
+	struct sitemap_entry *entries;
+	struct sitemap_entry *e;
+
+	if (ctx->nr_entries >= ctx->nr_allocated)
+	{
+		entries = realloc(ctx->entries, ((ctx->nr_allocated ? ctx->nr_allocated * 2 : 1024) * sizeof(struct sitemap_entry)));
+		if (!entries)
+			return -1;
+
+		ctx->entries = entries;
+		ctx->nr_allocated = (ctx->nr_allocated ? ctx->nr_allocated * 2 : 1024);
+	}
+
+	e = &ctx->entries[ctx->nr_entries];
+
+	e->URL = ctx->loc;
+	e->lastmod = (ctx->lastmod ? __parse_lastmod(ctx->lastmod) : 0);
+	e->order = ctx->nr_entries++;
+
+	ctx->loc = NULL;
+
+	return 0;
+}
+
+/*
+ * Called as each element of a <urlset> or <sitemapindex>
+ * ends. <loc> and <lastmod> are at depth 3, inside the
+ * <url> or <sitemap> at depth 2.
+ */
+static int
+__sitemap_element(const char *name, const char *value, int depth, void *arg)
+{
+	struct sitemap_ctx *ctx = (struct sitemap_ctx *)arg;
+	char **which = NULL;
+
+	if (3 == depth)
+	{
+		if (!strcmp("loc", name))
+			which = &ctx->loc;
+		else
+		if (!strcmp("lastmod", name))
+			which = &ctx->lastmod;
+
+		if (which && value)
+		{
+			free(*which);
+			*which = strdup(value);
+		}
+
+		return 0;
+	}
+
+	if (2 != depth)
+		return 0;
+
+	if (!strcmp("url", name) && ctx->loc)
+	{
+		if (ctx->nr_in_file < SITEMAP_MAX_URLS)
+		{
+			if (__add_entry(ctx) < 0)
+				return -1;
+
+			++ctx->nr_in_file;
+		}
+	}
+	else
+	if (!strcmp("sitemap", name) && ctx->loc)
+	{
+		__add_sitemap(ctx->loc, ctx);
+	}
+
+	free(ctx->loc);
+	free(ctx->lastmod);
+	ctx->loc = ctx->lastmod = NULL;
+
+	return 0;
+}
+
+/*
+ * Inflate the gzip'd LEN bytes at DATA into
+ * *OUT, up to SITEMAP_MAX_SIZE of it.
+ */
+static ssize_t
+__gunzip(const char *data, size_t len, char **out)
+{
+	z_stream z;
+	char *buf = NULL;
+	char *b;
+	size_t size = (len * 4 < SITEMAP_MAX_SIZE ? len * 4 + 1024 : SITEMAP_MAX_SIZE);
+	int rv;
+
+	memset(&z, 0, sizeof(z));
+
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+		return -1;
+
+	z.next_in = (Bytef *)data;
+	z.avail_in = len;
+
+	while (1)
+	{
+		if (!(b = realloc(buf, size)))
+			goto fail;
+
+		buf = b;
+		z.next_out = (Bytef *)(buf + z.total_out);
+		z.avail_out = (size - z.total_out);
+
+		rv = inflate(&z, Z_NO_FLUSH);
+
+		if (Z_STREAM_END == rv)
+			break;
+
+		if (Z_OK != rv && Z_BUF_ERROR != rv)
+			goto fail;
+
+	/*
+	 * Out of input but not at the end?
+	 * Then it was cut short.
+	 */
+		if (!z.avail_in && z.avail_out)
+			goto fail;
+
+		if (size >= SITEMAP_MAX_SIZE)
+			break;
+
+		size = (size * 2 < SITEMAP_MAX_SIZE ? size * 2 : SITEMAP_MAX_SIZE);
+	}
+
+	*out = buf;
+	len = z.total_out;
+
+	inflateEnd(&z);
+
+	return (ssize_t)len;
+
+fail:
+
+	free(buf);
+	inflateEnd(&z);
+
+	return -1;
+}
+
+static int
+__sitemap_body(struct http_t *http, const char *body, size_t len, void *arg)
+{
+	struct sitemap_ctx *ctx = (struct sitemap_ctx *)arg;
+	char *inflated = NULL;
+	ssize_t inflated_len;
+	int rv;
+
+	(void)http;
+
+	if (len >= 2 && (unsigned char)body[0] == 0x1f && (unsigned char)body[1] == 0x8b)
+	{
+		if ((inflated_len = __gunzip(body, len, &inflated)) < 0)
+			return -1;
+
+		body = inflated;
+		len = (size_t)inflated_len;
+	}
+	else
+	if (len > SITEMAP_MAX_SIZE)
+	{
+		len = SITEMAP_MAX_SIZE;
+	}
+
+	ctx->nr_in_file = 0;
+
+	rv = XML_parse_stream(body, len, __sitemap_element, ctx);
+
+	free(ctx->loc);
+	free(ctx->lastmod);
+	ctx->loc = ctx->lastmod = NULL;
+
+	free(inflated);
+
+	return rv;
+}
+
+/*
+ * Most recently modified first, then in
+ * the order we found them.
+ */
+static int
+__compare_entries(const void *a, const void *b)
+{
+	const struct sitemap_entry *e1 = (const struct sitemap_entry *)a;
+	const struct sitemap_entry *e2 = (const struct sitemap_entry *)b;
+
+	if (e1->lastmod != e2->lastmod)
+		return (e1->lastmod > e2->lastmod ? -1 : 1);
+
+	return (e1->order - e2->order);
+}
+
+/**
+ * Seed URL_QUEUE with the URLs in the sitemaps of the
+ * host HTTP is connected to. Returns how many URLs
+ * were queued.
+ *
+ * @http our HTTP object, connected to the host
+ * @URL_queue the queue to seed
+ * @URLs_archived URLs we already have, which we skip
+ */
+int
+sitemap_seed(struct http_t *http, queue_obj_t *URL_queue, url_set_t *URLs_archived)
+{
+	assert(http);
+	assert(URL_queue);
+	assert(URLs_archived);
+
+	struct sitemap_ctx ctx;
+	buf_t URL;
+	char *page;
+	int nr_queued = 0;
+	int rv;
+	int i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.http = http;
+
+	update_operation_status("Looking for sitemaps");
+
+	if (robots_load(http) < 0)
+		put_error_msg("failed to get robots.txt for %s", http->host);
+
+	if (!robots_for_each_sitemap(http_host_id(http), __add_sitemap, &ctx) || !ctx.nr_pages)
+		ctx.pages[ctx.nr_pages++] = strdup("/sitemap.xml");
+
+	while (ctx.nr_pages)
+	{
+		page = ctx.pages[--ctx.nr_pages];
+
+		if (!page)
+			continue;
+
+		update_operation_status("Fetching sitemap %s", page);
+
+		rv = fetch_aside(http, page, __sitemap_body, &ctx);
+
+		if (rv < 0)
+			put_error_msg("failed to read sitemap %s", page);
+
+		free(page);
+	}
+
+	if (!ctx.nr_entries)
+		goto out;
+
+	qsort(ctx.entries, ctx.nr_entries, sizeof(struct sitemap_entry), __compare_entries);
+
+	URL.magic = 0;
+	if (buf_init(&URL, HTTP_URL_MAX) < 0)
+		goto out;
+
+	for (i = 0; i < ctx.nr_entries; ++i)
+	{
+		if (strlen(ctx.entries[i].URL) >= HTTP_URL_MAX)
+			continue;
+
+		buf_clear(&URL);
+		if (buf_append(&URL, ctx.entries[i].URL) < 0)
+			continue;
+
+	/*
+	 * Made the same as a link to the page would be,
+	 * so that it isn't queued a second time as one.
+	 */
+		if (normalize_full_url(&URL) < 0)
+			continue;
+
+		if (enqueue_full_URL(http, URL_queue, URLs_archived, &URL) > 0)
+			++nr_queued;
+	}
+
+	buf_destroy(&URL);
+
+	update_operation_status("Queued %d URLs from sitemaps", nr_queued);
+
+out:
+
+	for (i = 0; i < ctx.nr_entries; ++i)
+		free(ctx.entries[i].URL);
+
+	free(ctx.entries);
+
+	return nr_queued;
+}
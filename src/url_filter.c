@@ -0,0 +1,540 @@
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "url_filter.h"
+
+#define URL_FILTER_DEFAULT_RULES 16
+#define URL_FILTER_STACK_RULES 64 /* evaluate with state on the stack up to this many rules */
+
+#define PREFIX_RULE "prefix:"
+#define SUFFIX_RULE "suffix:"
+#define GLOB_RULE "glob:"
+
+url_filter_t *
+URL_FILTER_object_new(void)
+{
+	url_filter_t *filter = calloc(1, sizeof(url_filter_t));
+
+	if (!filter)
+		goto fail;
+
+	filter->patterns = calloc(URL_FILTER_DEFAULT_RULES, sizeof(char *));
+	if (!filter->patterns)
+		goto fail_free_filter;
+
+	filter->rules = calloc(URL_FILTER_DEFAULT_RULES, sizeof(struct url_filter_rule));
+	if (!filter->rules)
+		goto fail_free_patterns;
+
+	filter->nr_allocated = URL_FILTER_DEFAULT_RULES;
+
+	return filter;
+
+fail_free_patterns:
+
+	free(filter->patterns);
+
+fail_free_filter:
+
+	free(filter);
+
+fail:
+
+	return NULL;
+}
+
+static void
+__free_automaton(url_filter_t *filter)
+{
+	free(filter->delta);
+	free(filter->out_start);
+	free(filter->outputs);
+
+	filter->delta = NULL;
+	filter->out_start = NULL;
+	filter->outputs = NULL;
+	filter->nr_states = 0;
+	filter->compiled = 0;
+
+	return;
+}
+
+void
+URL_FILTER_object_destroy(url_filter_t *filter)
+{
+	assert(filter);
+
+	int i;
+
+	for (i = 0; i < filter->nr_rules; ++i)
+		free(filter->patterns[i]);
+
+	free(filter->patterns);
+	free(filter->rules);
+
+	__free_automaton(filter);
+	free(filter);
+
+	return;
+}
+
+/**
+ * Add a rule (see url_filter.h for the syntax).
+ * The filter must be compiled again before it
+ * takes effect.
+ *
+ * @filter The URL filter
+ * @rule The rule
+ * @action URL_FILTER_INCLUDE or URL_FILTER_EXCLUDE
+ */
+int
+URL_FILTER_add_rule(url_filter_t *filter, const char *rule, int action)
+{
+	assert(filter);
+	assert(rule);
+
+	struct url_filter_rule *rules;
+	char **patterns;
+
+	if (!*rule)
+		return -1;
+
+	if (filter->nr_rules >= filter->nr_allocated)
+	{
+		patterns = realloc(filter->patterns, (filter->nr_allocated * 2 * sizeof(char *)));
+		if (!patterns)
+			return -1;
+
+		filter->patterns = patterns;
+
+		rules = realloc(filter->rules, (filter->nr_allocated * 2 * sizeof(struct url_filter_rule)));
+		if (!rules)
+			return -1;
+
+		filter->rules = rules;
+		filter->nr_allocated *= 2;
+	}
+
+	if (!(filter->patterns[filter->nr_rules] = strdup(rule)))
+		return -1;
+
+	memset(&filter->rules[filter->nr_rules], 0, sizeof(struct url_filter_rule));
+	filter->rules[filter->nr_rules].action = action;
+
+	++filter->nr_rules;
+
+	if (URL_FILTER_INCLUDE == action)
+		++filter->nr_includes;
+
+	filter->compiled = 0;
+
+	return 0;
+}
+
+/**
+ * Add each of the whitespace-separated rules in RULES.
+ */
+int
+URL_FILTER_add_rules(url_filter_t *filter, const char *rules, int action)
+{
+	assert(filter);
+	assert(rules);
+
+	char rule[1024];
+	const char *p = rules;
+	const char *e;
+
+	while (*p)
+	{
+		while (*p && isspace((unsigned char)*p))
+			++p;
+
+		if (!*p)
+			break;
+
+		for (e = p; *e && !isspace((unsigned char)*e); ++e)
+			;
+
+		if ((size_t)(e - p) >= sizeof(rule))
+			return -1;
+
+		memcpy(rule, p, (e - p));
+		rule[e - p] = 0;
+
+		if (URL_FILTER_add_rule(filter, rule, action) < 0)
+			return -1;
+
+		p = e;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the next '*'-separated segment of PATTERN
+ * from *POS, skipping empty ones. Returns its
+ * length, or 0 if there are no more.
+ */
+static size_t
+__next_segment(const char *pattern, int glob, size_t *pos, const char **seg)
+{
+	const char *p = (pattern + *pos);
+	const char *e;
+
+	if (!glob)
+	{
+		*seg = p;
+		*pos += strlen(p);
+		return strlen(p);
+	}
+
+	while (*p == '*')
+		++p;
+
+	e = strchr(p, '*');
+	if (!e)
+		e = (p + strlen(p));
+
+	*seg = p;
+	*pos = (size_t)(e - pattern);
+
+	return (size_t)(e - p);
+}
+
+/*
+ * Work out RULE's anchors and return the pattern
+ * its segments are to be taken from.
+ */
+static const char *
+__parse_rule(const char *pattern, struct url_filter_rule *rule, int *glob)
+{
+	size_t len;
+
+	*glob = 0;
+
+	if (!strncmp(PREFIX_RULE, pattern, strlen(PREFIX_RULE)))
+	{
+		rule->anchor_start = 1;
+		return (pattern + strlen(PREFIX_RULE));
+	}
+
+	if (!strncmp(SUFFIX_RULE, pattern, strlen(SUFFIX_RULE)))
+	{
+		rule->anchor_end = 1;
+		return (pattern + strlen(SUFFIX_RULE));
+	}
+
+	if (!strncmp(GLOB_RULE, pattern, strlen(GLOB_RULE)))
+	{
+		pattern += strlen(GLOB_RULE);
+		len = strlen(pattern);
+
+		*glob = 1;
+		rule->anchor_start = (len && pattern[0] != '*');
+		rule->anchor_end = (len && pattern[len - 1] != '*');
+
+		return pattern;
+	}
+
+	return pattern;
+}
+
+/**
+ * Build the automaton from the rules added so far.
+ */
+int
+URL_FILTER_compile(url_filter_t *filter)
+{
+	assert(filter);
+
+	struct url_filter_rule *rule;
+	struct url_filter_output *own = NULL;
+	uint32_t *own_next = NULL;
+	uint32_t *own_head = NULL;
+	uint32_t *fail = NULL;
+	uint32_t *order = NULL;
+	uint32_t max_states = 1;
+	uint32_t max_own = 1;
+	uint32_t nr_own = 0;
+	uint32_t nr_outputs = 0;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t s;
+	uint32_t t;
+	uint32_t o;
+	uint32_t *delta;
+	const char *pattern;
+	const char *seg;
+	size_t seg_len;
+	size_t pos;
+	size_t j;
+	int glob;
+	int c;
+	int i;
+
+	__free_automaton(filter);
+	filter->exclude_all = 0;
+	filter->include_all = 0;
+
+/*
+ * Every byte of every segment could need a state of
+ * its own, and there are fewer segments than bytes.
+ */
+	for (i = 0; i < filter->nr_rules; ++i)
+		max_states += strlen(filter->patterns[i]);
+
+	max_own = max_states;
+
+	filter->delta = calloc((size_t)max_states * 256, sizeof(uint32_t));
+	filter->out_start = calloc(max_states + 1, sizeof(uint32_t));
+	own_head = calloc(max_states, sizeof(uint32_t));
+	fail = calloc(max_states, sizeof(uint32_t));
+	order = calloc(max_states, sizeof(uint32_t));
+	own = calloc(max_own, sizeof(struct url_filter_output));
+	own_next = calloc(max_own, sizeof(uint32_t));
+
+	if (!filter->delta || !filter->out_start || !own_head || !fail || !order || !own || !own_next)
+		goto fail;
+
+	delta = filter->delta;
+	filter->nr_states = 1;
+
+/*
+ * Put each segment of each rule in the trie, and note
+ * at the state where it ends that it ends there. (The
+ * lists start at index 1 so that 0 can end them.)
+ */
+	for (i = 0; i < filter->nr_rules; ++i)
+	{
+		rule = &filter->rules[i];
+		rule->anchor_start = rule->anchor_end = 0;
+		rule->nr_segments = 0;
+
+		pattern = __parse_rule(filter->patterns[i], rule, &glob);
+		pos = 0;
+
+		while ((seg_len = __next_segment(pattern, glob, &pos, &seg)) > 0)
+		{
+			s = 0;
+
+			for (j = 0; j < seg_len; ++j)
+			{
+				c = (unsigned char)seg[j];
+
+				if (!delta[s * 256 + c])
+					delta[s * 256 + c] = filter->nr_states++;
+
+				s = delta[s * 256 + c];
+			}
+
+			++nr_own;
+			own[nr_own].rule = (uint16_t)i;
+			own[nr_own].segment = rule->nr_segments++;
+			own[nr_own].len = (uint16_t)seg_len;
+			own_next[nr_own] = own_head[s];
+			own_head[s] = nr_own;
+		}
+
+		if (!rule->nr_segments)
+		{
+			if (URL_FILTER_EXCLUDE == rule->action)
+				filter->exclude_all = 1;
+			else
+				filter->include_all = 1;
+		}
+	}
+
+/*
+ * Breadth first, so that a state's failure state is
+ * done before it: fill in the missing transitions
+ * and count the outputs of each state (its own and
+ * those of its failure state).
+ */
+	head = tail = 0;
+	order[tail++] = 0;
+
+	while (head < tail)
+	{
+		s = order[head++];
+
+		for (o = own_head[s]; o; o = own_next[o])
+			++filter->out_start[s + 1];
+
+		if (s)
+			filter->out_start[s + 1] += (filter->out_start[fail[s] + 1]);
+
+		for (c = 0; c < 256; ++c)
+		{
+			t = delta[s * 256 + c];
+
+			if (t && s != t)
+			{
+				fail[t] = (s ? delta[fail[s] * 256 + c] : 0);
+				order[tail++] = t;
+			}
+			else
+			{
+				delta[s * 256 + c] = (s ? delta[fail[s] * 256 + c] : 0);
+			}
+		}
+	}
+
+/*
+ * OUT_START[S + 1] holds the count for S;
+ * make them offsets.
+ */
+	for (s = 0; s < filter->nr_states; ++s)
+		filter->out_start[s + 1] += filter->out_start[s];
+
+	nr_outputs = filter->out_start[filter->nr_states];
+
+	filter->outputs = calloc(nr_outputs + 1, sizeof(struct url_filter_output));
+	if (!filter->outputs)
+		goto fail;
+
+	for (i = 0; (uint32_t)i < filter->nr_states; ++i)
+	{
+		s = order[i];
+		j = filter->out_start[s];
+
+		for (o = own_head[s]; o; o = own_next[o])
+			filter->outputs[j++] = own[o];
+
+		if (s)
+		{
+			for (o = filter->out_start[fail[s]]; o < filter->out_start[fail[s] + 1]; ++o)
+				filter->outputs[j++] = filter->outputs[o];
+		}
+	}
+
+	free(own_head);
+	free(fail);
+	free(order);
+	free(own);
+	free(own_next);
+
+	filter->compiled = 1;
+
+	return 0;
+
+fail:
+
+	__free_automaton(filter);
+
+	free(own_head);
+	free(fail);
+	free(order);
+	free(own);
+	free(own_next);
+
+	return -1;
+}
+
+/**
+ * Check URL against the rules in one pass over it.
+ * Each rule's segments have to be found in order and
+ * without overlapping; taking the first occurrence of
+ * each in turn finds them if they are there at all.
+ *
+ * @filter The compiled URL filter
+ * @URL The URL
+ * @len Length of URL
+ */
+int
+URL_FILTER_allows(url_filter_t *filter, const char *URL, size_t len)
+{
+	assert(filter);
+	assert(URL);
+
+	uint16_t stack_next_segment[URL_FILTER_STACK_RULES];
+	size_t stack_min_start[URL_FILTER_STACK_RULES];
+	uint16_t *next_segment = stack_next_segment;
+	size_t *min_start = stack_min_start;
+	struct url_filter_output *out;
+	struct url_filter_output *end;
+	struct url_filter_rule *rule;
+	uint32_t s = 0;
+	size_t start;
+	size_t i;
+	int included;
+	int allowed = 1;
+
+	if (!filter->compiled || !filter->nr_rules)
+		return 1;
+
+	if (filter->exclude_all)
+		return 0;
+
+	included = (!filter->nr_includes || filter->include_all);
+
+	if (filter->nr_rules > URL_FILTER_STACK_RULES)
+	{
+		next_segment = calloc(filter->nr_rules, sizeof(uint16_t));
+		min_start = calloc(filter->nr_rules, sizeof(size_t));
+
+		if (!next_segment || !min_start)
+		{
+			allowed = -1;
+			goto out;
+		}
+	}
+	else
+	{
+		memset(next_segment, 0, (filter->nr_rules * sizeof(uint16_t)));
+		memset(min_start, 0, (filter->nr_rules * sizeof(size_t)));
+	}
+
+	for (i = 0; i < len; ++i)
+	{
+		s = filter->delta[s * 256 + (unsigned char)URL[i]];
+
+		end = (filter->outputs + filter->out_start[s + 1]);
+
+		for (out = (filter->outputs + filter->out_start[s]); out < end; ++out)
+		{
+			rule = &filter->rules[out->rule];
+
+			if (out->segment != next_segment[out->rule])
+				continue;
+
+			start = (i + 1 - out->len);
+
+			if (start < min_start[out->rule])
+				continue;
+
+			if (!out->segment && rule->anchor_start && start)
+				continue;
+
+			if ((out->segment + 1) == rule->nr_segments && rule->anchor_end && (i + 1) != len)
+				continue;
+
+			++next_segment[out->rule];
+			min_start[out->rule] = (i + 1);
+
+			if (next_segment[out->rule] < rule->nr_segments)
+				continue;
+
+			if (URL_FILTER_EXCLUDE == rule->action)
+			{
+				allowed = 0;
+				goto out;
+			}
+
+			included = 1;
+		}
+	}
+
+	allowed = included;
+
+out:
+
+	if (next_segment != stack_next_segment)
+	{
+		free(next_segment);
+		free(min_start);
+	}
+
+	return allowed;
+}
@@ -0,0 +1,718 @@
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "hash_bucket.h"
+#include "url_traps.h"
+
+#define URL_TRAP_MAX_SEGMENTS 64
+
+struct url_trap_pattern
+{
+	char *template;
+	int kind;
+	unsigned int nr_seen; /* URLs that fit it */
+	unsigned int nr_suppressed; /* of those, the ones past its budget */
+};
+
+static struct url_trap_pattern *Trap_patterns = NULL;
+static uint32_t Trap_nr_patterns = 0;
+static uint32_t Trap_nr_allocated = 0;
+static unsigned int Trap_nr_suppressed = 0;
+
+static bucket_obj_t *Trap_index = NULL; /* template => index into Trap_patterns */
+static bucket_obj_t *Trap_fanout = NULL; /* directory => URLs we've taken in it */
+
+/*
+ * A bit for each URL ID we've counted, so that a URL
+ * linked to from many pages uses up a budget once.
+ */
+static uint8_t *Trap_seen = NULL;
+static size_t Trap_seen_size = 0;
+
+static pthread_mutex_t Trap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const unsigned int Trap_budgets[URL_TRAP_KINDS] =
+{
+	0,
+	URL_TRAP_REPEAT_BUDGET,
+	URL_TRAP_NUMERIC_BUDGET,
+	URL_TRAP_CALENDAR_BUDGET,
+	URL_TRAP_DEEP_BUDGET
+};
+
+static const char *const Trap_names[URL_TRAP_KINDS] =
+{
+	"none",
+	"repeating segments",
+	"query paging",
+	"calendar",
+	"deep path"
+};
+
+struct segments
+{
+	const char *s[URL_TRAP_MAX_SEGMENTS];
+	uint16_t len[URL_TRAP_MAX_SEGMENTS];
+	int nr;
+};
+
+struct template
+{
+	char buf[URL_TRAP_TEMPLATE_MAX];
+	size_t len;
+};
+
+static void
+__put(struct template *t, const char *s, size_t len)
+{
+	if (len > (sizeof(t->buf) - 1 - t->len))
+		len = (sizeof(t->buf) - 1 - t->len);
+
+	memcpy(t->buf + t->len, s, len);
+	t->len += len;
+	t->buf[t->len] = 0;
+
+	return;
+}
+
+#define __put_str(t, s) __put((t), (s), strlen(s))
+
+/*
+ * Start a template with the host of URL.
+ */
+static void
+__start(struct template *t, const char *URL, const url_parts_t *parts)
+{
+	t->len = 0;
+	t->buf[0] = 0;
+
+	__put(t, (URL + parts->host_off), parts->host_len);
+
+	return;
+}
+
+/*
+ * The non-empty segments of the LEN bytes of PATH.
+ */
+static void
+__split(const char *path, size_t len, struct segments *segs)
+{
+	const char *e = (path + len);
+	const char *p = path;
+	const char *slash;
+
+	segs->nr = 0;
+
+	while (p < e && segs->nr < URL_TRAP_MAX_SEGMENTS)
+	{
+		slash = memchr(p, '/', (e - p));
+		if (!slash)
+			slash = e;
+
+		if (slash > p)
+		{
+			segs->s[segs->nr] = p;
+			segs->len[segs->nr] = (uint16_t)(slash - p);
+			++segs->nr;
+		}
+
+		p = (slash + 1);
+	}
+
+	return;
+}
+
+static int
+__same(const struct segments *segs, int i, int j)
+{
+	return (segs->len[i] == segs->len[j] && !memcmp(segs->s[i], segs->s[j], segs->len[i]));
+}
+
+/*
+ * Relative links resolved against the wrong base
+ * give paths like /a/b/a/b/a/b. Catch a segment that
+ * appears URL_TRAP_REPEAT_MAX times, or a run of two
+ * or three segments that comes again straight after.
+ */
+static int
+__repeats(const char *URL, const url_parts_t *parts, const struct segments *segs, struct template *t)
+{
+	int i;
+	int j;
+	int k;
+	int n;
+
+	for (i = 0; i < segs->nr; ++i)
+	{
+		for (n = 1, j = (i + 1); j < segs->nr; ++j)
+		{
+			if (__same(segs, i, j))
+				++n;
+		}
+
+		if (n >= URL_TRAP_REPEAT_MAX)
+			goto found;
+
+		for (k = 2; k <= 3 && (i + 2 * k) <= segs->nr; ++k)
+		{
+			for (j = 0; j < k && __same(segs, (i + j), (i + k + j)); ++j)
+				;
+
+			if (j == k)
+				goto found;
+		}
+	}
+
+	return URL_TRAP_NONE;
+
+found:
+
+	__start(t, URL, parts);
+	__put(t, (URL + parts->path_off), ((segs->s[i] + segs->len[i]) - (URL + parts->path_off)));
+	__put_str(t, "/{repeat}");
+
+	return URL_TRAP_REPEAT;
+}
+
+static int
+__number(const char *p, int len)
+{
+	int n = 0;
+
+	while (len--)
+		n = (n * 10) + (*p++ - '0');
+
+	return n;
+}
+
+static int
+__all_digits(const char *p, size_t len)
+{
+	while (len--)
+	{
+		if (!isdigit((unsigned char)*p++))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * If there is a date at P, return its length: YYYYMMDD,
+ * or YYYY-MM with an optional -DD (the separators can
+ * be any of "-/_."). 0 if there isn't one.
+ */
+static size_t
+__date_at(const char *p, const char *e)
+{
+	const char *s = p;
+	int year;
+	int month;
+	int n;
+
+	if ((e - p) < 6 || !__all_digits(p, 4))
+		return 0;
+
+	year = __number(p, 4);
+	if (year < 1900 || year > 2099)
+		return 0;
+
+	p += 4;
+
+	if ((e - p) >= 4 && __all_digits(p, 4) && (p + 4 == e || !isdigit((unsigned char)p[4])))
+	{
+		month = __number(p, 2);
+		n = __number(p + 2, 2);
+
+		return ((month >= 1 && month <= 12 && n >= 1 && n <= 31) ? 8 : 0);
+	}
+
+	if (!strchr("-/_.", *p))
+		return 0;
+
+	++p;
+
+	for (n = 0; (p + n) < e && n < 3 && isdigit((unsigned char)p[n]); ++n)
+		;
+
+	if (n < 1 || n > 2)
+		return 0;
+
+	month = __number(p, n);
+	if (month < 1 || month > 12)
+		return 0;
+
+	p += n;
+
+	if ((e - p) >= 2 && strchr("-/_.", *p) && isdigit((unsigned char)p[1]))
+	{
+		for (n = 0; (p + 1 + n) < e && n < 3 && isdigit((unsigned char)p[1 + n]); ++n)
+			;
+
+		if (n <= 2 && __number(p + 1, n) >= 1 && __number(p + 1, n) <= 31)
+			p += (1 + n);
+	}
+
+	if (p < e && isdigit((unsigned char)*p))
+		return 0;
+
+	return (size_t)(p - s);
+}
+
+/*
+ * Query parameters that hold part of a date.
+ */
+static int
+__date_name(const char *name, size_t len)
+{
+	static const char *const words[] = { "year", "month", "week", "day", "date", NULL };
+	size_t i;
+	int w;
+
+	for (i = 0; i < len; ++i)
+	{
+		for (w = 0; words[w]; ++w)
+		{
+			if ((len - i) >= strlen(words[w]) && !strncasecmp(name + i, words[w], strlen(words[w])))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Query parameters that page through a listing. Other
+ * numeric values are most often IDs (?t=1234, ?id=56),
+ * each naming a page of its own rather than the next
+ * step of a walk, so they are left alone.
+ */
+static int
+__paging_name(const char *name, size_t len)
+{
+	static const char *const words[] = { "pg", "offset", "start", "skip", NULL };
+	size_t i;
+	int w;
+
+	for (i = 0; (i + 4) <= len; ++i)
+	{
+		if (!strncasecmp(name + i, "page", 4))
+			return 1;
+	}
+
+	for (w = 0; words[w]; ++w)
+	{
+		if (len == strlen(words[w]) && !strncasecmp(name, words[w], len))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the dates out of the path and query, and the
+ * page numbers and offsets out of the query. A calendar
+ * is a URL with a date in it; otherwise one that pages
+ * through something may be counting up without end.
+ */
+static int
+__dates_and_numbers(const char *URL, const url_parts_t *parts, struct template *t)
+{
+	const char *p = (URL + parts->path_off);
+	const char *start = p;
+	const char *e = (p + parts->path_len);
+	const char *eq;
+	const char *amp;
+	size_t value_len;
+	size_t n;
+	int kind = URL_TRAP_NONE;
+
+	__start(t, URL, parts);
+
+	while (p < e)
+	{
+		if (isdigit((unsigned char)*p) && (p == start || !isdigit((unsigned char)p[-1])) && (n = __date_at(p, e)))
+		{
+			__put_str(t, "{date}");
+			kind = URL_TRAP_CALENDAR;
+			p += n;
+
+			continue;
+		}
+
+		__put(t, p, 1);
+		++p;
+	}
+
+	if (!parts->query_len)
+		return kind;
+
+	__put_str(t, "?");
+
+	p = (URL + parts->query_off);
+	e = (p + parts->query_len);
+
+	while (p < e)
+	{
+		amp = memchr(p, '&', (e - p));
+		if (!amp)
+			amp = e;
+
+		eq = memchr(p, '=', (amp - p));
+
+		if (!eq)
+		{
+			__put(t, p, (amp - p));
+		}
+		else
+		{
+			__put(t, p, (eq + 1 - p));
+
+			++eq;
+			value_len = (amp - eq);
+
+			if (value_len
+			&& (__date_at(eq, amp) == value_len || (__all_digits(eq, value_len) && __date_name(p, (eq - 1 - p)))))
+			{
+				__put_str(t, "{date}");
+				kind = URL_TRAP_CALENDAR;
+			}
+			else
+			if (value_len && __all_digits(eq, value_len) && __paging_name(p, (eq - 1 - p)))
+			{
+				__put_str(t, "{n}");
+
+				if (URL_TRAP_NONE == kind)
+					kind = URL_TRAP_NUMERIC;
+			}
+			else
+			{
+				__put(t, eq, value_len);
+			}
+		}
+
+		if (amp < e)
+			__put_str(t, "&");
+
+		p = (amp + 1);
+	}
+
+	return kind;
+}
+
+/*
+ * HOST + the first LEVEL segments of the path.
+ */
+static void
+__directory(const char *URL, const url_parts_t *parts, const struct segments *segs, int level, struct template *t)
+{
+	__start(t, URL, parts);
+
+	if (level > 0)
+		__put(t, (URL + parts->path_off), ((segs->s[level - 1] + segs->len[level - 1]) - (URL + parts->path_off)));
+
+	return;
+}
+
+static unsigned int
+__fanout(const char *URL, const url_parts_t *parts, const struct segments *segs, int level)
+{
+	struct template dir;
+	bucket_t *b;
+
+	__directory(URL, parts, segs, level, &dir);
+
+	b = Trap_fanout->get(Trap_fanout, dir.buf);
+
+	return (b ? *(unsigned int *)b->data : 0);
+}
+
+/*
+ * A path URL_TRAP_DEEP_SEGMENTS deep, where each of
+ * the URL_TRAP_DEEP_CHAIN levels above its directory
+ * has led us to only one or two URLs, is most likely
+ * a chain of generated directories, not a real tree.
+ */
+static int
+__deep(const char *URL, const url_parts_t *parts, const struct segments *segs, struct template *t)
+{
+	unsigned int fanout;
+	int level;
+
+	if (segs->nr < URL_TRAP_DEEP_SEGMENTS)
+		return URL_TRAP_NONE;
+
+	for (level = (segs->nr - 2); level >= (segs->nr - 1 - URL_TRAP_DEEP_CHAIN); --level)
+	{
+		fanout = __fanout(URL, parts, segs, level);
+
+		if (!fanout || fanout > URL_TRAP_TINY_FANOUT)
+			return URL_TRAP_NONE;
+	}
+
+	__directory(URL, parts, segs, (URL_TRAP_DEEP_SEGMENTS - 1 - URL_TRAP_DEEP_CHAIN), t);
+	__put_str(t, "/{deep}");
+
+	return URL_TRAP_DEEP;
+}
+
+/*
+ * Count the URL we've just taken in the directory it's in,
+ * if that is deep enough for __deep() to ask about it.
+ */
+static void
+__add_to_fanout(const char *URL, const url_parts_t *parts, const struct segments *segs)
+{
+	static unsigned int one = 1;
+	struct template dir;
+	bucket_t *b;
+
+	if ((segs->nr - 1) < (URL_TRAP_DEEP_SEGMENTS - 1 - URL_TRAP_DEEP_CHAIN))
+		return;
+
+	__directory(URL, parts, segs, (segs->nr - 1), &dir);
+
+	b = Trap_fanout->get(Trap_fanout, dir.buf);
+
+	if (b)
+		++*(unsigned int *)b->data;
+	else
+		Trap_fanout->put(Trap_fanout, dir.buf, (void *)&one, sizeof(one), 0);
+
+	return;
+}
+
+/*
+ * Returns 1 the first time we're asked about ID.
+ */
+static int
+__first_time(url_id_t id)
+{
+	size_t byte = (id >> 3);
+	size_t size;
+	uint8_t *seen;
+
+	if (byte >= Trap_seen_size)
+	{
+		size = (Trap_seen_size ? Trap_seen_size : 4096);
+
+		while (size <= byte)
+			size *= 2;
+
+		seen = realloc(Trap_seen, size);
+		if (!seen)
+			return 1;
+
+		memset(seen + Trap_seen_size, 0, (size - Trap_seen_size));
+
+		Trap_seen = seen;
+		Trap_seen_size = size;
+	}
+
+	if (Trap_seen[byte] & (1 << (id & 7)))
+		return 0;
+
+	Trap_seen[byte] |= (1 << (id & 7));
+
+	return 1;
+}
+
+static struct url_trap_pattern *
+__pattern(const char *template, int kind)
+{
+	struct url_trap_pattern *patterns;
+	bucket_t *b;
+	uint32_t i;
+	uint32_t nr;
+
+	b = Trap_index->get(Trap_index, (char *)template);
+	if (b)
+		return &Trap_patterns[*(uint32_t *)b->data];
+
+	if (Trap_nr_patterns >= Trap_nr_allocated)
+	{
+		nr = (Trap_nr_allocated ? Trap_nr_allocated * 2 : 64);
+
+		patterns = realloc(Trap_patterns, (nr * sizeof(struct url_trap_pattern)));
+		if (!patterns)
+			return NULL;
+
+		Trap_patterns = patterns;
+		Trap_nr_allocated = nr;
+	}
+
+	i = Trap_nr_patterns;
+
+	if (!(Trap_patterns[i].template = strdup(template)))
+		return NULL;
+
+	Trap_patterns[i].kind = kind;
+	Trap_patterns[i].nr_seen = 0;
+	Trap_patterns[i].nr_suppressed = 0;
+
+	if (Trap_index->put(Trap_index, (char *)template, (void *)&i, sizeof(i), 0) < 0)
+	{
+		free(Trap_patterns[i].template);
+		return NULL;
+	}
+
+	++Trap_nr_patterns;
+
+	return &Trap_patterns[i];
+}
+
+/**
+ * Decide whether URL, with ID, is in a crawler trap whose
+ * budget is used up. Returns 1 if we shouldn't follow it.
+ *
+ * @URL the full URL
+ * @parts where its parts are
+ * @id its ID in the URL arena
+ */
+int
+url_traps_check(const char *URL, const url_parts_t *parts, url_id_t id)
+{
+	assert(URL);
+	assert(parts);
+
+	struct url_trap_pattern *pattern;
+	struct segments segs;
+	struct template t;
+	int new_URL;
+	int kind;
+	int suppressed = 0;
+
+	__split((URL + parts->path_off), parts->path_len, &segs);
+
+	pthread_mutex_lock(&Trap_lock);
+
+	if (!Trap_index)
+	{
+		Trap_index = BUCKET_object_new();
+		Trap_fanout = BUCKET_object_new();
+
+		if (!Trap_index || !Trap_fanout)
+			goto out;
+	}
+
+	new_URL = __first_time(id);
+
+	kind = __repeats(URL, parts, &segs, &t);
+
+	if (URL_TRAP_NONE == kind)
+		kind = __dates_and_numbers(URL, parts, &t);
+
+	if (URL_TRAP_NONE == kind)
+		kind = __deep(URL, parts, &segs, &t);
+
+	if (URL_TRAP_NONE != kind && (pattern = __pattern(t.buf, kind)))
+	{
+		if (new_URL)
+			++pattern->nr_seen;
+
+		if (pattern->nr_seen > Trap_budgets[kind])
+		{
+			if (new_URL)
+			{
+				++pattern->nr_suppressed;
+				++Trap_nr_suppressed;
+			}
+
+			suppressed = 1;
+			goto out;
+		}
+	}
+
+	if (new_URL)
+		__add_to_fanout(URL, parts, &segs);
+
+out:
+
+	pthread_mutex_unlock(&Trap_lock);
+
+	return suppressed;
+}
+
+/**
+ * How many URLs we've not followed for being in a trap.
+ */
+unsigned int
+url_traps_nr_suppressed(void)
+{
+	unsigned int nr;
+
+	pthread_mutex_lock(&Trap_lock);
+	nr = Trap_nr_suppressed;
+	pthread_mutex_unlock(&Trap_lock);
+
+	return nr;
+}
+
+/**
+ * Call CB with the kind, template and number of URLs
+ * suppressed of each pattern that ran over its budget.
+ */
+void
+url_traps_for_each(url_trap_cb_t cb, void *arg)
+{
+	assert(cb);
+
+	uint32_t i;
+
+	pthread_mutex_lock(&Trap_lock);
+
+	for (i = 0; i < Trap_nr_patterns; ++i)
+	{
+		if (Trap_patterns[i].nr_suppressed)
+			cb(Trap_patterns[i].kind, Trap_patterns[i].template, Trap_patterns[i].nr_suppressed, arg);
+	}
+
+	pthread_mutex_unlock(&Trap_lock);
+
+	return;
+}
+
+const char *
+url_trap_kind_name(int kind)
+{
+	if (kind < 0 || kind >= URL_TRAP_KINDS)
+		return Trap_names[URL_TRAP_NONE];
+
+	return Trap_names[kind];
+}
+
+void
+url_traps_destroy(void)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&Trap_lock);
+
+	for (i = 0; i < Trap_nr_patterns; ++i)
+		free(Trap_patterns[i].template);
+
+	free(Trap_patterns);
+	Trap_patterns = NULL;
+	Trap_nr_patterns = Trap_nr_allocated = 0;
+	Trap_nr_suppressed = 0;
+
+	if (Trap_index)
+		Trap_index->destroy(Trap_index, 0);
+
+	if (Trap_fanout)
+		Trap_fanout->destroy(Trap_fanout, 0);
+
+	Trap_index = Trap_fanout = NULL;
+
+	free(Trap_seen);
+	Trap_seen = NULL;
+	Trap_seen_size = 0;
+
+	pthread_mutex_unlock(&Trap_lock);
+
+	return;
+}
@@ -1,27 +1,41 @@
+#define _GNU_SOURCE /* for strcasestr() */
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#include "archive_index.h"
 #include "http.h"
+#include "link_scan.h"
+#include "url_filter.h"
 #include "utils_url.h"
 #include "netwasabi.h"
 
-struct url_encodings
-{
-	char old;
-	char *new;
-};
+/*
+ * What encode_url() does with each byte: copy it, percent-
+ * encode it, or (for '&' and '\') see whether it starts
+ * "&amp;" or "\u0026", which become '&'.
+ */
+#define URL_BYTE_COPY 0
+#define URL_BYTE_ENCODE 1
+#define URL_BYTE_AMP 2
+#define URL_BYTE_BSLASH 3
 
-struct url_encodings url_encodings[] =
+static const unsigned char __url_byte_class[256] =
 {
-	{ ' ', "%20" },
-	{ '"', "%22" },
-	{ '\'', "%27" },
-	{ '*', "%2c" },
-	{ 0, "" }
+	[' '] = URL_BYTE_ENCODE,
+	['"'] = URL_BYTE_ENCODE,
+	['\''] = URL_BYTE_ENCODE,
+	['*'] = URL_BYTE_ENCODE,
+	['&'] = URL_BYTE_AMP,
+	['\\'] = URL_BYTE_BSLASH
 };
 
 char *no_url_files[] =
@@ -54,74 +68,576 @@ Log(char *fmt, ...)
 }
 #endif // 0
 
+/*
+ * Skip the bytes from P to E that encode_url() copies as
+ * they are, sixteen at a time where we can.
+ */
+static const char *
+__skip_plain_bytes(const char *p, const char *e)
+{
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i dquote = _mm_set1_epi8('"');
+	const __m128i squote = _mm_set1_epi8('\'');
+	const __m128i star = _mm_set1_epi8('*');
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	__m128i v;
+	__m128i hits;
+	int mask;
+
+	while ((e - p) >= 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)p);
+
+		hits = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, dquote)),
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, squote), _mm_cmpeq_epi8(v, star)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, bslash))));
+
+		mask = _mm_movemask_epi8(hits);
+
+		if (mask)
+			return (p + __builtin_ctz(mask));
+
+		p += 16;
+	}
+#endif
+
+	while (p < e && URL_BYTE_COPY == __url_byte_class[(unsigned char)*p])
+		++p;
+
+	return p;
+}
+
+/**
+ * Percent-encode the characters in URL that can't go
+ * in a request line as they are, and turn "&amp;" and
+ * "\u0026" (as found in HTML and JS) back into '&'.
+ * Done in one pass, and not at all if there's nothing
+ * to change, which is most of the time.
+ */
 void
 encode_url(buf_t *url)
 {
 	assert(url);
 
-	int url_eidx = 0;
+	static const char hex[] = "0123456789ABCDEF";
+	const char *p = url->buf_head;
+	const char *e = url->buf_tail;
+	const char *plain;
+	char *out;
+	char *o;
+	char stack_out[HTTP_URL_MAX * 3 + 1];
+	size_t len = (e - p);
+
+	plain = __skip_plain_bytes(p, e);
+
+	if (plain == e)
+		return;
+
+	if ((len * 3 + 1) <= sizeof(stack_out))
+		out = stack_out;
+	else
+	if (!(out = malloc(len * 3 + 1)))
+		return;
+
+	o = out;
+
+	while (p < e)
+	{
+		memcpy(o, p, (plain - p));
+		o += (plain - p);
+		p = plain;
+
+		if (p == e)
+			break;
+
+		switch(__url_byte_class[(unsigned char)*p])
+		{
+			case URL_BYTE_ENCODE:
+
+				*o++ = '%';
+				*o++ = hex[(unsigned char)*p >> 4];
+				*o++ = hex[(unsigned char)*p & 0xf];
+				++p;
+				break;
+
+			case URL_BYTE_AMP:
+
+				*o++ = '&';
+				p += ((e - p) >= 5 && !memcmp(p, "&amp;", 5) ? 5 : 1);
+				break;
+
+			case URL_BYTE_BSLASH:
+
+				if ((e - p) >= 6 && !memcmp(p, "\\u0026", 6))
+				{
+					*o++ = '&';
+					p += 6;
+				}
+				else
+				{
+					*o++ = *p++;
+				}
+
+				break;
+		}
+
+		plain = __skip_plain_bytes(p, e);
+	}
+
+	*o = 0;
+
+	buf_clear(url);
+	if (buf_append(url, out) < 0)
+		put_error_msg("encode_url: failed to write encoded URL");
+
+	if (out != stack_out)
+		free(out);
+
+	return;
+}
+
+static const char *const __tracking_params[] =
+{
+	"fbclid",
+	"gclid",
+	"dclid",
+	"msclkid",
+	"mc_cid",
+	"mc_eid",
+	"_ga",
+	(char *)NULL
+};
+
+static const char *const __session_params[] =
+{
+	"jsessionid",
+	"phpsessid",
+	"aspsessionid",
+	"sessionid",
+	"session_id",
+	"sid",
+	(char *)NULL
+};
+
+#define __is_unreserved(c) (isalnum((unsigned char)(c)) || (c) == '-' || (c) == '.' || (c) == '_' || (c) == '~')
+
+static int
+__hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+
+	c = tolower((unsigned char)c);
+
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+
+	return -1;
+}
+
+/*
+ * Copy LEN bytes of DATA into OUT, decoding %XX escapes
+ * of unreserved characters and upper-casing the hex
+ * digits of the rest (RFC 3986 6.2.2.1 and 6.2.2.2).
+ */
+static void
+__normalise_pct(char *out, const char *data, size_t len)
+{
+	const char *end = (data + len);
+	int hi;
+	int lo;
+	char c;
+
+	while (data < end)
+	{
+		if (*data == '%' && (end - data) >= 3
+		&& (hi = __hex_value(data[1])) >= 0 && (lo = __hex_value(data[2])) >= 0)
+		{
+			c = (char)((hi << 4) | lo);
+
+			if (__is_unreserved(c))
+			{
+				*out++ = c;
+			}
+			else
+			{
+				*out++ = '%';
+				*out++ = toupper((unsigned char)data[1]);
+				*out++ = toupper((unsigned char)data[2]);
+			}
+
+			data += 3;
+			continue;
+		}
+
+		*out++ = *data++;
+	}
+
+	*out = 0;
+	return;
+}
+
+/*
+ * Drop the last segment (and the '/' before it)
+ * from what remove_dot_segments() has output.
+ */
+#define __drop_last_segment(start, out)\
+do {\
+	while ((out) > (start) && *--(out) != '/')\
+		;\
+} while (0)
+
+/*
+ * RFC 3986 5.2.4. OUT must have room for
+ * as many bytes as there are in PATH.
+ */
+static void
+__remove_dot_segments(const char *path, char *out)
+{
+	const char *in = path;
+	const char *seg_end;
+	char *start = out;
+
+	while (*in)
+	{
+		if (!strncmp("../", in, 3))
+		{
+			in += 3;
+		}
+		else
+		if (!strncmp("./", in, 2) || !strncmp("/./", in, 3))
+		{
+			in += 2;
+		}
+		else
+		if (!strcmp("/.", in))
+		{
+			*out++ = '/';
+			break;
+		}
+		else
+		if (!strncmp("/../", in, 4))
+		{
+			in += 3;
+			__drop_last_segment(start, out);
+		}
+		else
+		if (!strcmp("/..", in))
+		{
+			__drop_last_segment(start, out);
+			*out++ = '/';
+			break;
+		}
+		else
+		if (!strcmp(".", in) || !strcmp("..", in))
+		{
+			break;
+		}
+		else
+		{
+			seg_end = strchr((in + 1), '/');
+			if (!seg_end)
+				seg_end = (in + strlen(in));
+
+			memcpy(out, in, (seg_end - in));
+			out += (seg_end - in);
+			in = seg_end;
+		}
+	}
+
+	*out = 0;
+	return;
+}
+
+static int
+__param_in_list(const char *param, size_t key_len, const char *const *list)
+{
+	int i;
+
+	for (i = 0; list[i] != NULL; ++i)
+	{
+		if (strlen(list[i]) == key_len && !strncasecmp(list[i], param, key_len))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+__compare_params(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Rebuild the query string QUERY (normalised, without the '?')
+ * into OUT, leaving out empty parameters and any that FLAGS
+ * say to drop. Returns the number of parameters kept.
+ */
+static int
+__canonical_query(char *query, unsigned int flags, buf_t *out)
+{
+	char **params;
 	char *p;
-	char *e;
-	char *tail = url->buf_tail;
+	char *save = NULL;
+	size_t key_len;
+	int nr_params = 0;
+	int nr_allocated = 16;
+	int i;
 
-	while (url_encodings[url_eidx].old != 0)
+	if (!(params = calloc(nr_allocated, sizeof(char *))))
+		return -1;
+
+	for (p = strtok_r(query, "&", &save); p; p = strtok_r(NULL, "&", &save))
 	{
-		e = url->buf_head;
+		key_len = strcspn(p, "=");
+
+		if (!key_len)
+			continue;
+
+		if ((flags & URL_CANON_DROP_TRACKING)
+		&& (!strncasecmp("utm_", p, 4) || __param_in_list(p, key_len, __tracking_params)))
+			continue;
 
-		while (1)
+		if ((flags & URL_CANON_STRIP_SESSION) && __param_in_list(p, key_len, __session_params))
+			continue;
+
+		if (nr_params >= nr_allocated)
 		{
-			p = memchr(e, url_encodings[url_eidx].old, (tail - e));
+			char **tmp = realloc(params, (nr_allocated * 2 * sizeof(char *)));
 
-			if (!p)
+			if (!tmp)
 			{
-				++url_eidx;
-				break;
+				free(params);
+				return -1;
 			}
 
-			buf_shift(url, (off_t)(p - url->buf_head), (size_t)2);
-			tail = url->buf_tail;
-			strncpy(p, url_encodings[url_eidx].new, (size_t)3);
-			e = (p += 3);
+			params = tmp;
+			nr_allocated *= 2;
 		}
+
+		params[nr_params++] = p;
 	}
 
-	/* Remove \"&amp;" */
+	if (flags & URL_CANON_SORT_QUERY)
+		qsort(params, nr_params, sizeof(char *), __compare_params);
+
+	for (i = 0; i < nr_params; ++i)
+	{
+		if (buf_append(out, (i ? "&" : "?")) < 0
+		|| buf_append(out, params[i]) < 0)
+		{
+			free(params);
+			return -1;
+		}
+	}
 
-	e = url->buf_head;
-	tail = url->buf_tail;
+	free(params);
+	return nr_params;
+}
 
-	while (1)
+/**
+ * Put a full URL into canonical form so that the different
+ * ways of writing the same URL compare equal (RFC 3986 6.2.2):
+ * the scheme and host are lower-cased, a port that is the
+ * default for the scheme is removed, percent-encodings are
+ * normalised, "." and ".." segments are resolved, the fragment
+ * and an empty query are dropped, and so are empty parameters.
+ * FLAGS selects the URL_CANON_* rules to apply as well.
+ *
+ * Anything that isn't a full URL is left as it is.
+ *
+ * @url The URL
+ * @flags URL_CANON_* flags
+ */
+int
+canonicalize_url(buf_t *url, unsigned int flags)
+{
+	assert(url);
+
+	char *copy;
+	char *scratch;
+	char *p;
+	char *scheme_end;
+	char *auth;
+	char *auth_end;
+	char *host;
+	char *host_end;
+	char *port;
+	char *path;
+	char *path_end;
+	char *query = NULL;
+	size_t len = url->data_len;
+	int https;
+
+	scheme_end = memchr(url->buf_head, ':', len);
+
+	if (!scheme_end || strncmp("://", scheme_end, 3))
+		return 0;
+
+	if (!(copy = malloc(len + 1)))
+		return -1;
+
+	if (!(scratch = malloc((len * 2) + 2)))
 	{
-		p = strstr(e, "&amp;");
+		free(copy);
+		return -1;
+	}
 
-		if (!p || p >= tail)
-			break;
+	memcpy(copy, url->buf_head, len);
+	copy[len] = 0;
 
-		++p;
-		e = (p + 4);
-		buf_collapse(url, (off_t)(p - url->buf_head), (e - p));
-		tail = url->buf_tail;
-		e = p;
+	scheme_end = (copy + (scheme_end - url->buf_head));
+
+	for (p = copy; p < scheme_end; ++p)
+		*p = tolower((unsigned char)*p);
+
+	https = ((scheme_end - copy) == 5 && !strncmp("https", copy, 5));
+
+	auth = (scheme_end + 3);
+	auth_end = (auth + strcspn(auth, "/?#"));
+
+/*
+ * Host is after any userinfo and before any port;
+ * IPv6 literals are in brackets.
+ */
+	host = memchr(auth, '@', (auth_end - auth));
+	host = (host ? host + 1 : auth);
+
+	if (*host == '[')
+	{
+		host_end = memchr(host, ']', (auth_end - host));
+		host_end = (host_end ? host_end + 1 : auth_end);
+	}
+	else
+	{
+		host_end = memchr(host, ':', (auth_end - host));
+		if (!host_end)
+			host_end = auth_end;
 	}
 
-	e = url->buf_head;
-	tail = url->buf_tail;
+	for (p = host; p < host_end; ++p)
+		*p = tolower((unsigned char)*p);
 
-	while (1)
+	port = NULL;
+
+	if (host_end < auth_end && *host_end == ':')
 	{
-		p = strstr(e, "\\u0026");
+		port = (host_end + 1);
 
-		if (!p || p >= tail)
-			break;
+		if (port == auth_end
+		|| (!https && (auth_end - port) == 2 && !strncmp("80", port, 2))
+		|| (https && (auth_end - port) == 3 && !strncmp("443", port, 3)))
+			port = NULL;
+	}
+
+	path = auth_end;
+	path_end = (path + strcspn(path, "?#"));
 
-		*p++ = '&';
-		e = (p + 5);
-		buf_collapse(url, (off_t)(p - url->buf_head), (e - p));
-		tail = url->buf_tail;
-		e = p;
+	if (*path_end == '?')
+	{
+		query = (path_end + 1);
+		*(query + strcspn(query, "#")) = 0;
 	}
 
-	return;
+	*path_end = 0;
+
+	buf_clear(url);
+
+	if (buf_append_ex(url, copy, (host_end - copy)) < 0)
+		goto fail;
+
+	if (port)
+	{
+		if (buf_append(url, ":") < 0
+		|| buf_append_ex(url, port, (auth_end - port)) < 0)
+			goto fail;
+	}
+
+/*
+ * SCRATCH holds the normalised path and then
+ * the path with the dot segments removed.
+ */
+	__normalise_pct(scratch, path, (path_end - path));
+
+	if (flags & URL_CANON_STRIP_SESSION)
+	{
+		p = strcasestr(scratch, ";jsessionid=");
+		if (p)
+		{
+			char *e = (p + strcspn(p, "/"));
+			memmove(p, e, (strlen(e) + 1));
+		}
+	}
+
+	__remove_dot_segments(scratch, (scratch + len + 1));
+
+	if (buf_append(url, (scratch + len + 1)) < 0)
+		goto fail;
+
+	if (query && *query)
+	{
+		size_t path_len = url->data_len;
+
+		__normalise_pct(scratch, query, strlen(query));
+
+	/*
+	 * Leave the query as it was rather than
+	 * half rebuilt if we couldn't rebuild it.
+	 */
+		if (__canonical_query(scratch, flags, url) < 0)
+		{
+			if (url->data_len > path_len)
+				buf_snip(url, (url->data_len - path_len));
+
+			if (buf_append(url, "?") < 0
+			|| buf_append(url, query) < 0)
+				goto fail;
+		}
+	}
+
+	BUF_NULL_TERMINATE(url);
+
+	free(copy);
+	free(scratch);
+
+	return 0;
+
+fail:
+
+	free(copy);
+	free(scratch);
+
+	return -1;
+}
+
+/**
+ * Put a URL that is already a full one into the form we
+ * queue and archive it under: encoded, canonicalised and
+ * without a trailing '/'. Links and URLs from sitemaps
+ * both come through here, so a page is one URL however
+ * we came across it.
+ *
+ * @url The full URL
+ */
+int
+normalize_full_url(buf_t *url)
+{
+	assert(url);
+
+	encode_url(url);
+
+	if (canonicalize_url(url, nwctx.config.canon_flags) < 0)
+		return -1;
+
+	if (url->data_len && *(url->buf_tail - 1) == '/')
+		buf_snip(url, (size_t)1);
+
+	return 0;
 }
 
 /**
@@ -169,27 +685,24 @@ make_full_url(struct http_t *http, buf_t *in, buf_t *out)
  */
 	if (!strncmp("http://", p, 7) || !strncmp("https://", p, 8))
 	{
-		buf_append(out, in->buf_head);
-
-		if (*(out->buf_tail - 1) == '/')
-			buf_snip(out, (size_t)1);
+		if (buf_append(out, in->buf_head) < 0)
+			return -1;
 
-		encode_url(out);
-		return 0;
+		return normalize_full_url(out);
 	}
 
 /*
  * Handle relative URLs.
  */
-	if (http->usingSecure)
-		buf_append(out, "https://");
-	else
-		buf_append(out, "http://");
+	if (buf_append(out, (http->usingSecure ? "https://" : "http://")) < 0)
+		return -1;
 
 	if (!strncmp("//", p, 2))
 	{
 		p += 2;
-		buf_append(out, p);
+
+		if (buf_append(out, p) < 0)
+			return -1;
 
 		http->ops->URL_parse_page(out->buf_head, tmp_page);
 
@@ -198,15 +711,17 @@ make_full_url(struct http_t *http, buf_t *in, buf_t *out)
 	}
 	else
 	{
-		buf_append(out, http->host);
+		if (buf_append(out, http->host) < 0)
+			return -1;
 
 		if (*p == '.' || *p != '/')
 		{
 		/*
 		 * Append the current page first.
 		 */
-			if (http->page[0] != '/' && *(out->buf_tail - 1) != '/')
-				buf_append(out, "/");
+			if (http->page[0] != '/' && *(out->buf_tail - 1) != '/'
+			&& buf_append(out, "/") < 0)
+				return -1;
 
 			if (has_extension(http->page))
 			{
@@ -219,43 +734,56 @@ make_full_url(struct http_t *http, buf_t *in, buf_t *out)
 				*__e = 0;
 			}
 
-			buf_append(out, http->page);
+			if (buf_append(out, http->page) < 0)
+				return -1;
 
-			if (*(out->buf_tail - 1) != '/')
-				buf_append(out, "/");
+			if (*(out->buf_tail - 1) != '/' && buf_append(out, "/") < 0)
+				return -1;
 
-			buf_append(out, p);
+			if (buf_append(out, p) < 0)
+				return -1;
 		}
 		else
 		{
-			if (*(out->buf_tail - 1) != '/' && *p != '/')
-				buf_append(out, "/");
+			if (*(out->buf_tail - 1) != '/' && *p != '/'
+			&& buf_append(out, "/") < 0)
+				return -1;
 
-			buf_append(out, p);
+			if (buf_append(out, p) < 0)
+				return -1;
 		}
 	}
 
+	encode_url(out);
+
+	if (canonicalize_url(out, nwctx.config.canon_flags) < 0)
+		return -1;
+
 	if (!keep_tslash(&nwctx))
 	{
 		if (*(out->buf_tail - 1) == '/')
 			buf_snip(out, (size_t)1);
 	}
 
-	encode_url(out);
 	return 0;
 }
 
+/**
+ * Get the name under which URL is archived, relative
+ * to the archive directory: <host>/<path>, with pages
+ * given a .html extension.
+ *
+ * @url The full URL
+ * @name Buffer to hold the name
+ */
 int
-make_local_url(struct http_t *http, buf_t *url, buf_t *path)
+local_archive_name(buf_t *url, buf_t *name)
 {
-	assert(http);
 	assert(url);
-	assert(path);
+	assert(name);
 
-	char *home = getenv("HOME");
 	char *p;
-	char tmp_page[2048];
-	buf_t tmp_full;
+	url_parts_t parts;
 
 	if (!strncmp(url->buf_head, "file://", 7))
 	{
@@ -263,43 +791,92 @@ make_local_url(struct http_t *http, buf_t *url, buf_t *path)
 		assert(0);
 	}
 
-	buf_init(&tmp_full, HTTP_URL_MAX);
-	http->ops->URL_parse_page(url->buf_head, tmp_page);
-
 	if (strncmp("http:", url->buf_head, 5) && strncmp("https:", url->buf_head, 6))
 	{
-		fprintf(stderr, "make_local_url: not full url (%s)\n", url->buf_head);
+		fprintf(stderr, "local_archive_name: not full url (%s)\n", url->buf_head);
 		errno = EPROTO;
 		return -1;
 	}
 
-	buf_clear(path);
-	buf_append(path, "file://");
-	buf_append(path, home);
-	buf_append(path, "/" NETWASABI_DIR "/");
+	URL_parts_parse(url->buf_head, url->data_len, &parts);
+
+	buf_clear(name);
 
 	p = url->buf_head + strlen("http://");
 	if (*p == '/')
 		++p;
 
-	buf_append(path, p);
+	if (buf_append(name, p) < 0)
+		return -1;
 
-	if (*(path->buf_tail - 1) == '/')
-		buf_snip(path, (size_t)1);
+	if (*(name->buf_tail - 1) == '/')
+		buf_snip(name, (size_t)1);
 
-	if (!has_extension(tmp_page))
+	if (!has_extension(url->buf_head + parts.path_off))
 	{
-		buf_append(path, ".html");
+		if (buf_append(name, ".html") < 0)
+			return -1;
 	}
 	else
 	{
-		buf_replace(path, ".php", ".html");
-		buf_replace(path, ".asp", ".html");
-		buf_replace(path, ".aspx", ".html");
-		buf_replace(path, ".git", ".html");
+		buf_replace(name, ".php", ".html");
+		buf_replace(name, ".asp", ".html");
+		buf_replace(name, ".aspx", ".html");
+		buf_replace(name, ".git", ".html");
+	}
+
+	return 0;
+}
+
+/**
+ * Get the path of the archived page TO relative to the
+ * directory of the archived page FROM, both of them
+ * names from local_archive_name(). Only the part after
+ * the directories they have in common is kept, with a
+ * "../" for each of FROM's directories past those.
+ *
+ * @from Name of the page the link is in
+ * @to Name of the page the link is to
+ * @rel Buffer to hold the relative path
+ */
+int
+make_relative_url(const char *from, const char *to, buf_t *rel)
+{
+	assert(from);
+	assert(to);
+	assert(rel);
+
+	size_t common = 0;
+	size_t i;
+	const char *p;
+	const char *q;
+
+	for (i = 0; from[i] && from[i] == to[i]; ++i)
+	{
+		if ('/' == from[i])
+			common = (i + 1);
+	}
+
+	buf_clear(rel);
+
+	for (i = common; from[i]; ++i)
+	{
+		if ('/' == from[i] && buf_append(rel, "../") < 0)
+			return -1;
+	}
+
+/*
+ * The query is part of the file's name, but in
+ * a relative URL it would be taken as a query.
+ */
+	for (p = (to + common); (q = strchr(p, '?')); p = (q + 1))
+	{
+		if ((q > p && buf_append_ex(rel, (char *)p, (q - p)) < 0) || buf_append(rel, "%3F") < 0)
+			return -1;
 	}
 
-	buf_destroy(&tmp_full);
+	if (buf_append(rel, (char *)p) < 0)
+		return -1;
 
 	return 0;
 }
@@ -310,57 +887,60 @@ is_xdomain(struct http_t *http, buf_t *url)
 	assert(http);
 	assert(url);
 
-	char tmp_host[1024];
+	url_parts_t parts;
+	size_t host_len;
+
+	if (URL_parts_parse(url->buf_head, url->data_len, &parts) < 0)
+		return 1;
+
+	host_len = (parts.path_off - parts.host_off);
 
-	http->ops->URL_parse_host(url->buf_head, tmp_host);
+	if (host_len != strlen(http->primary_host))
+		return 1;
 
-	return strcmp(tmp_host, http->primary_host);
+	return memcmp((url->buf_head + parts.host_off), http->primary_host, host_len);
 }
 
+/**
+ * Check whether we already have an archived copy of LINK.
+ * This is asked of every link we find, so it looks in the
+ * archive index rather than at the filesystem.
+ *
+ * @link The URL, a full one
+ */
 int
-local_archive_exists(struct http_t *http, char *link)
+local_archive_exists(const char *link)
 {
-	assert(http);
 	assert(link);
 
-	buf_t tmp;
+	buf_t url;
+	buf_t name;
 	int exists = 0;
-	char *home;
-	char tmp_page[1024];
-	char tmp_host[1024];
 
-	buf_init(&tmp, path_max);
+	url.magic = name.magic = 0;
 
-	http->ops->URL_parse_host(link, tmp_host);
-	http->ops->URL_parse_page(link, tmp_page);
+	if (buf_init(&url, HTTP_URL_MAX) < 0)
+		goto out;
 
-	home = getenv("HOME");
-	buf_append(&tmp, home);
-	buf_append(&tmp, "/" NETWASABI_DIR "/");
-	buf_append(&tmp, tmp_host);
-	buf_append(&tmp, tmp_page);
+	if (buf_init(&name, HTTP_URL_MAX) < 0)
+		goto out_destroy_url;
 
-	if (*(tmp.buf_tail - 1) == '/')
-		buf_snip(&tmp, (size_t)1);
+	if (buf_append(&url, (char *)link) < 0 || local_archive_name(&url, &name) < 0)
+		goto out_destroy_name;
 
-	if (!has_extension(tmp_page))
-	{
-		buf_append(&tmp, ".html");
-	}
-	else
-	{
-		buf_replace(&tmp, ".php", ".html");
-		buf_replace(&tmp, ".asp", ".html");
-		buf_replace(&tmp, ".aspx", ".html");
-	}
+	exists = archive_index_has(name.buf_head);
 
-	exists = access(tmp.buf_head, F_OK);
-	buf_destroy(&tmp);
+out_destroy_name:
 
-	if (exists == 0)
-		return 1;
-	else
-		return 0;
+	buf_destroy(&name);
+
+out_destroy_url:
+
+	buf_destroy(&url);
+
+out:
+
+	return exists;
 }
 
 static
@@ -419,166 +999,135 @@ has_extension(char *page)
 		return 1;
 }
 
-/**
- * Transform embedded URLs in HTML into local
- * URLs (i.e., file:///path_to_archived_html_document)
+/*
+ * Copy LEN bytes onto the end of OUT, doubling its
+ * size when it runs short. Unlike buf_append_ex(),
+ * this doesn't strlen() the source, which here is
+ * the rest of the whole document.
  */
-void
-transform_document_URLs(struct http_t *http)
+static int
+__append_span(buf_t *out, char *data, size_t len)
 {
-	assert(http);
-
-	buf_t *buf = &http->conn.read_buf;
-	char *tail = buf->buf_tail;
-	char *p;
-	char *savep;
-	char *url_start;
-	char *url_end;
-	off_t url_start_off;
-	off_t url_end_off;
-	off_t savep_off;
-	off_t poff;
-	size_t range;
-	buf_t url;
-	buf_t path;
-	buf_t full;
-	int url_type_idx;
-
-	buf_init(&url, HTTP_URL_MAX);
-	buf_init(&path, HTTP_URL_MAX);
-	buf_init(&full, HTTP_URL_MAX);
+	size_t slack = buf_slack(out);
+	size_t by;
 
-#define save_pointers()\
-do {\
-	savep_off = (savep - buf->buf_head);\
-	poff = (savep - buf->buf_head);\
-	url_start_off = (url_start - buf->buf_head);\
-	url_end_off = (url_end - buf->buf_head);\
-} while (0)
+	if (len >= slack)
+	{
+		by = (out->buf_size > (len - slack) ? out->buf_size : ((len - slack) * 2));
 
-#define restore_pointers()\
-do {\
-	savep = (buf->buf_head + savep_off);\
-	p = (buf->buf_head + poff);\
-	url_start = (buf->buf_head + url_start_off);\
-	url_end = (buf->buf_head + url_end_off);\
-} while (0)
+		if (buf_extend(out, by) < 0)
+			return -1;
+	}
 
-	savep = buf->buf_head;
-	url_type_idx = 0;
+	memcpy(out->buf_tail, data, len);
+	buf_pull_tail(out, len);
 
-	while (1)
-	{
-		buf_clear(&url);
+	return 0;
+}
 
-		assert(buf->buf_tail <= buf->buf_end);
-		assert(buf->buf_head >= buf->data);
+/**
+ * Transform embedded URLs in HTML into paths to
+ * the archived documents, relative to this one
+ * (i.e., ../other_dir/document.html)
+ *
+ * The document is rebuilt into a new buffer in one
+ * pass: the text between links is copied over as it
+ * is and each link we have a local path for is copied
+ * as that path instead. The new buffer then replaces
+ * the read buffer.
+ *
+ * @http The HTTP object holding the document
+ * @links The document's links, from link_table_build()
+ */
+void
+transform_document_URLs(struct http_t *http, struct link_table *links)
+{
+	assert(http);
+	assert(links);
 
-		p = strstr(savep, url_types[url_type_idx].string);
+	buf_t *buf = &http->conn.read_buf;
+	size_t copied = 0; /* offset in BUF up to which we've copied into OUT */
+	size_t doc_len = (buf->buf_tail - buf->buf_head);
+	struct link *link;
+	buf_t out;
+	int i;
 
-		if (!p || p >= tail)
-		{
-			++url_type_idx;
+	out.magic = 0;
 
-			if (url_types[url_type_idx].delim == 0)
-				break;
+	for (i = 0; i < links->nr_links; ++i)
+	{
+		link = &links->links[i];
 
-			savep = buf->buf_head;
+		if (!link->local_len)
 			continue;
-		}
 
-		url_start = (p += url_types[url_type_idx].len);
-		url_end = memchr(url_start, url_types[url_type_idx].delim, (tail - url_start));
+		assert(link->local_len < (size_t)path_max);
+		assert((link->off + link->len) <= doc_len);
 
-		if (!url_end)
+		if (!buf_integrity(&out))
 		{
-			++url_type_idx;
-
-			if (url_types[url_type_idx].delim == 0)
-				break;
-
-			savep = buf->buf_head;
-			continue;
+			if (buf_init(&out, (doc_len + (doc_len >> 2) + HTTP_URL_MAX)) < 0)
+				return;
 		}
 
-		assert(buf->buf_tail <= buf->buf_end);
-		assert(url_start < buf->buf_tail);
-		assert(url_end < buf->buf_tail);
-		assert(p < buf->buf_tail);
-		assert(savep < buf->buf_tail);
-		assert((tail - buf->buf_head) == (buf->buf_tail - buf->buf_head));
-
-		range = (url_end - url_start);
+		if (__append_span(&out, (buf->buf_head + copied), (link->off - copied)) < 0
+		|| __append_span(&out, link_local_path(links, link), link->local_len) < 0)
+			goto fail_destroy_out;
 
-		if (!range)
-		{
-			++savep;
-			continue;
-		}
+		copied = (link->off + link->len);
+	}
 
-		if (!strncmp("http://", url_start, range) || !strncmp("https://", url_start, range))
-		{
-			savep = ++url_end;
-			continue;
-		}
+	if (!buf_integrity(&out))
+		return;
 
-		if (range >= HTTP_URL_MAX)
-		{
-			savep = ++url_end;
-			continue;
-		}
+	if (__append_span(&out, (buf->buf_head + copied), (doc_len - copied)) < 0)
+		goto fail_destroy_out;
 
-		assert(range < HTTP_URL_MAX);
+	BUF_NULL_TERMINATE(&out); /* __append_span() always leaves slack */
 
-		buf_append_ex(&url, url_start, range);
-		BUF_NULL_TERMINATE(&url);
+	buf_destroy(buf);
+	memcpy(buf, &out, sizeof(out));
 
-		if (range)
-		{
-			//fprintf(stderr, "turning %s into full url\n", url.buf_head);
-			make_full_url(http, &url, &full);
-			//fprintf(stderr, "made %s\n", full.buf_head);
+	return;
 
-			if (make_local_url(http, &full, &path) == 0)
-			{
-				//fprintf(stderr, "made local url %s\n", path.buf_head);
-				buf_collapse(buf, (off_t)(url_start - buf->buf_head), range);
-				tail = buf->buf_tail;
+fail_destroy_out:
 
-				save_pointers();
+	buf_destroy(&out);
+	return;
+}
 
-				assert(path.data_len < path_max);
+/*
+ * The no_url_files rules, compiled once by
+ * whichever thread first asks.
+ */
+static url_filter_t *Unparseable_filter = NULL;
+static pthread_once_t Unparseable_filter_once = PTHREAD_ONCE_INIT;
 
-				if (path.data_len >= buf->buf_size)
-				{
-					savep = ++url_end;
-					continue;
-				}
+static void
+__compile_unparseable_filter(void)
+{
+	int i;
 
-				buf_shift(buf, (off_t)(url_start - buf->buf_head), path.data_len);
-				tail = buf->buf_tail;
+	if (!(Unparseable_filter = URL_FILTER_object_new()))
+		return;
 
-				restore_pointers();
+	for (i = 0; no_url_files[i] != NULL; ++i)
+	{
+		if (URL_FILTER_add_rule(Unparseable_filter, no_url_files[i], URL_FILTER_EXCLUDE) < 0)
+			goto fail;
+	}
 
-				assert((url_start - buf->buf_head) == url_start_off);
-				assert((url_end - buf->buf_head) == url_end_off);
-				assert((p - buf->buf_head) == poff);
-				assert((savep - buf->buf_head) == savep_off);
+	if (URL_FILTER_compile(Unparseable_filter) < 0)
+		goto fail;
 
-				strncpy(url_start, path.buf_head, path.data_len);
-			}
-		}
+	return;
 
-		assert(buf_integrity(&url));
-		assert(buf_integrity(&full));
-		assert(buf_integrity(&path));
+fail:
 
-		//++savep;
-		savep = ++url_end;
+	URL_FILTER_object_destroy(Unparseable_filter);
+	Unparseable_filter = NULL;
 
-		if (savep >= tail)
-			break;
-	}
+	return;
 }
 
 int
@@ -586,6 +1135,11 @@ URL_parseable(char *url)
 {
 	int i;
 
+	pthread_once(&Unparseable_filter_once, __compile_unparseable_filter);
+
+	if (Unparseable_filter)
+		return (URL_FILTER_allows(Unparseable_filter, url, strlen(url)) == 1);
+
 	for (i = 0; no_url_files[i] != NULL; ++i)
 	{
 		if (strstr(url, no_url_files[i]))
@@ -9,384 +9,424 @@
 #include <unistd.h>
 #include "xml.h"
 
-#define __ctor __attribute__((constructor))
-#define __dtor __attribute__((destructor))
 #define ALIGN16(s) (((s) + 0xf) & ~(0xf))
 #define clear_struct(s) memset(s, 0, sizeof(*s))
 
-#ifndef max
-# define max(a,b) (a) > (b) ? (a) : (b)
-#endif
-
 #define error(m) fprintf(stderr, "%s\n", (m))
 
 // single chars
 #define OTAG		'<'
 #define ETAG		'>'
 #define DQUOTE		'\"'
+#define SQUOTE		'\''
 #define META		'?'
 #define ASSIGN		'='
-#define BSLASH		'\\'
 #define SLASH		'/'
-#define SPACE		' '
-#define DASH		'-'
-#define UNDER		'_'
-#define COLON		':'
 #define EXCL		'!'
-#define PERIOD		'.'
-
-#define iscntrlspace(p) ((p) == '\t' || (p) == '\r' || (p) == '\n')
+#define AMP		'&'
 
 #define istagnamechar(c) \
-	isalnum((c)) || \
-	(c) == PERIOD || \
-	(c) == DASH || \
-	(c) == UNDER
-
-#define istokenchar(c) \
-	isascii((c)) && \
-	(c) != OTAG && \
-	(c) != ETAG && \
-	(c) != DQUOTE
-
-#define isattribnamechar(c) \
-	isalpha((c)) || \
-	(c) == COLON
-
-#define isattribvaluechar(c) \
-	isalnum((c)) || \
-	(c) == SPACE || \
-	(c) == SLASH || \
-	(c) == PERIOD || \
-	(c) == DASH || \
-	(c) == UNDER || \
-	(c) == COLON
-
-static int lex(void);
-static int matches(int);
-static void advance(void);
-static void parse_token(void);
-static void parse_tagname(void);
+	(isalnum((c)) || \
+	(c) == '.' || \
+	(c) == '-' || \
+	(c) == '_' || \
+	(c) == ':' || \
+	((unsigned char)(c) & 0x80))
 
 static void Debug(char *, ...);
 
-enum
+#define STACK_MAX_DEPTH 256
+
+/*
+ * An element we're inside of: its name, the text
+ * we've seen in it so far and (when building a
+ * tree) its node.
+ */
+struct xml_frame
 {
-	TOK_OPEN = 1,
-	TOK_CLOSE,
-	TOK_META,
-	TOK_ASSIGN,
-	TOK_DQUOTE,
-	TOK_SPACE,
-	TOK_SLASH,
-	TOK_DASH,
-	TOK_EXCL,
-	TOK_CHARSEQ
+	char *name;
+	char *value;
+	size_t value_len;
+	size_t value_size;
+	xml_node_t *node;
 };
 
-static int current;
-static int lookahead = -1;
-static char *ptr = NULL;
-static char *buffer = NULL;
-static char *end = NULL;
-
-#define TOK_MAX 1024
-static char terminal[TOK_MAX];
-static char token[TOK_MAX];
-
-#define TOK_LEN_OK(l) ((l) < TOK_MAX)
-
-static void
-parse_token(void)
+/*
+ * All the state of one parse, so that any number
+ * of documents can be parsed at the same time.
+ */
+struct xml_parser
 {
-	char *s = ptr;
+	const char *ptr;
+	const char *end;
 
-repeat:
-	while (istokenchar(*ptr))
-		++ptr;
+	struct xml_frame frames[STACK_MAX_DEPTH];
+	int depth;
 
-	if (*ptr == DQUOTE && *(ptr - 1) == BSLASH)
-	{
-		++ptr;
-		goto repeat;
-	}
+	struct XML *xml; /* tree we're building, or... */
+	XML_element_cb_t element_cb; /* ...who we tell about each element */
+	void *arg;
+};
+
+#define AT(p) ((p)->ptr < (p)->end ? *(p)->ptr : 0)
+#define LEFT(p) ((size_t)((p)->end - (p)->ptr))
+#define LOOKING_AT(p, s) (LEFT(p) >= (sizeof(s) - 1) && !memcmp((p)->ptr, (s), (sizeof(s) - 1)))
 
-	assert(TOK_LEN_OK(ptr - s));
-	strncpy(token, s, ptr - s);
-	token[ptr - s] = 0;
+void
+Debug(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
 
-	Debug("parse_token -> %s\n", token);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
 
 	return;
 }
 
-#if 0
-static void
-parse_tagname(void)
+/*
+ * Find S (of length LEN) between P->PTR and P->END.
+ */
+static const char *
+find(struct xml_parser *p, const char *s, size_t len)
 {
-	char *s = ptr;
+	const char *q = p->ptr;
 
-	while (istagnamechar(*ptr))
-		++ptr;
+	while ((size_t)(p->end - q) >= len)
+	{
+		q = memchr(q, *s, (p->end - q) - len + 1);
+		if (!q)
+			return NULL;
 
-	assert(TOK_LEN_OK(ptr - s));
-	strncpy(token, s, ptr - s);
-	token[ptr - s] = 0;
+		if (!memcmp(q, s, len))
+			return q;
 
-	Debug("parse_tagname -> %s\n", token);
+		++q;
+	}
 
-	return;
+	return NULL;
 }
-#endif
 
 static void
-parse_tagname(void)
+put_utf8(char *out, size_t *n, unsigned long cp)
 {
-	char *s = ptr;
-
-	while (istagnamechar(*ptr))
-		++ptr;
-
-	assert(TOK_LEN_OK(ptr - s));
-	strncpy(terminal, s, ptr - s);
-	terminal[ptr - s] = 0;
-
-	Debug("parse_tagname -> %s\n", terminal);
+	if (cp < 0x80)
+	{
+		out[(*n)++] = (char)cp;
+	}
+	else
+	if (cp < 0x800)
+	{
+		out[(*n)++] = (char)(0xc0 | (cp >> 6));
+		out[(*n)++] = (char)(0x80 | (cp & 0x3f));
+	}
+	else
+	if (cp < 0x10000)
+	{
+		out[(*n)++] = (char)(0xe0 | (cp >> 12));
+		out[(*n)++] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		out[(*n)++] = (char)(0x80 | (cp & 0x3f));
+	}
+	else
+	{
+		out[(*n)++] = (char)(0xf0 | ((cp >> 18) & 0x7));
+		out[(*n)++] = (char)(0x80 | ((cp >> 12) & 0x3f));
+		out[(*n)++] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		out[(*n)++] = (char)(0x80 | (cp & 0x3f));
+	}
 
 	return;
 }
 
-#define ATTRIBUTE_NAME_MAX 256
-#define ATTRIBUTE_VALUE_MAX 1024
-static char attribute_name[ATTRIBUTE_NAME_MAX];
-static char attribute_value[ATTRIBUTE_VALUE_MAX];
-
-static void
-parse_attribute_name(void)
+/*
+ * Copy LEN bytes of text from S to OUT, replacing
+ * entities such as &amp; and &#38; with what they
+ * stand for. OUT needs LEN bytes at most, since
+ * no entity is shorter than what it becomes.
+ */
+static size_t
+decode_text(char *out, const char *s, size_t len)
 {
-	char *s = ptr;
+	const char *e = (s + len);
+	const char *semi;
+	unsigned long cp;
+	size_t n = 0;
 
-	/*
-	 * Might be at a space char, so skip it.
-	 * If not, we're at an alpha char, and
-	 * lex() will not advance PTR.
-	 */
-	advance();
-	while (isattribnamechar(*ptr))
-		++ptr;
+	while (s < e)
+	{
+		if (*s != AMP || !(semi = memchr(s, ';', (e - s))) || (semi - s) > 10)
+		{
+			out[n++] = *s++;
+			continue;
+		}
 
-	assert((ptr - s) < ATTRIBUTE_NAME_MAX);
-	strncpy(attribute_name, s, ptr - s);
-	attribute_name[ptr - s] = 0;
+		if (!strncmp(s, "&amp;", 5))
+			out[n++] = '&';
+		else
+		if (!strncmp(s, "&lt;", 4))
+			out[n++] = '<';
+		else
+		if (!strncmp(s, "&gt;", 4))
+			out[n++] = '>';
+		else
+		if (!strncmp(s, "&quot;", 6))
+			out[n++] = '"';
+		else
+		if (!strncmp(s, "&apos;", 6))
+			out[n++] = '\'';
+		else
+		if (s[1] == '#')
+		{
+			if (s[2] == 'x' || s[2] == 'X')
+				cp = strtoul(s + 3, NULL, 16);
+			else
+				cp = strtoul(s + 2, NULL, 10);
 
-	Debug("Attribute name -> %s\n", attribute_name);
+			if (!cp || cp > 0x10ffff)
+			{
+				out[n++] = *s++;
+				continue;
+			}
 
-	advance();
-	assert(matches(TOK_ASSIGN));
+			put_utf8(out, &n, cp);
+		}
+		else
+		{
+			out[n++] = *s++;
+			continue;
+		}
 
-	return;
+		s = (semi + 1);
+	}
+
+	return n;
 }
 
-static void
-parse_attribute_value(void)
+/*
+ * Add text (LEN bytes at S) to the value of the
+ * element we're in. Entities are decoded unless
+ * it's from a CDATA section.
+ */
+static int
+add_text(struct xml_parser *p, const char *s, size_t len, int raw)
 {
-	advance();
-	assert(matches(TOK_DQUOTE));
+	struct xml_frame *frame;
+	char *value;
+	size_t size;
 
-	char *s = ptr;
+	if (!p->depth || !len)
+		return 0;
 
-repeat:
-	while (isattribvaluechar(*ptr))
-		++ptr;
+	frame = &p->frames[p->depth - 1];
 
-	if (*ptr == DQUOTE && *(ptr-1) == BSLASH)
+	if ((frame->value_len + len + 1) > frame->value_size)
 	{
-		++ptr;
-		goto repeat;
-	}
+		size = ALIGN16(frame->value_len + len + 1);
+		value = realloc(frame->value, size);
+		if (!value)
+			return -1;
 
-	assert((ptr - s) < ATTRIBUTE_VALUE_MAX);
-	strncpy(attribute_value, s, ptr - s);
-	attribute_value[ptr - s] = 0;
+		frame->value = value;
+		frame->value_size = size;
+	}
 
-	advance();
-	assert(matches(TOK_DQUOTE));
+	if (raw)
+	{
+		memcpy(frame->value + frame->value_len, s, len);
+		frame->value_len += len;
+	}
+	else
+	{
+		frame->value_len += decode_text(frame->value + frame->value_len, s, len);
+	}
 
-	Debug("Attribute value -> %s\n", attribute_value);
+	frame->value[frame->value_len] = 0;
 
-	return;
+	return 0;
 }
 
-static attribute_t *
-parse_attributes(int *nr)
+/*
+ * The value of an element is its text with
+ * leading and trailing whitespace removed;
+ * NULL if that leaves nothing.
+ */
+static char *
+take_value(struct xml_frame *frame)
 {
-	assert(matches(TOK_SPACE));
-
-	attribute_t *attribs = NULL;
-	int i = 0;
-
-	for (attribs = calloc(1, sizeof(attribute_t));
-		;
-		attribs = realloc(attribs, ((i+1) * sizeof(attribute_t))))
-	{
-		assert(attribs);
+	char *value = frame->value;
+	char *s;
+	size_t len = frame->value_len;
 
-		parse_attribute_name();
-		attribs[i].name = strdup(attribute_name);
+	frame->value = NULL;
+	frame->value_len = frame->value_size = 0;
 
-		parse_attribute_value();
-		attribs[i].value = strdup(attribute_value);
+	if (!value)
+		return NULL;
 
-		++i;
+	s = value;
+	while (len && isspace((unsigned char)*s))
+	{
+		++s;
+		--len;
+	}
 
-		advance();
+	while (len && isspace((unsigned char)s[len - 1]))
+		--len;
 
-		if (matches(TOK_CLOSE))
-			break;
+	if (!len)
+	{
+		free(value);
+		return NULL;
 	}
 
-	*nr = i;
+	memmove(value, s, len);
+	value[len] = 0;
 
-	return attribs;
+	return value;
 }
 
-
-void
-Debug(char *fmt, ...)
+static char *
+parse_name(struct xml_parser *p)
 {
-#ifdef DEBUG
-	va_list args;
+	const char *s = p->ptr;
+	char *name;
 
-	va_start(args, fmt);
-	vfprintf(stderr, fmt, args);
-	va_end(args);
-#else
-	(void)fmt;
-#endif
+	while (p->ptr < p->end && istagnamechar(*p->ptr))
+		++p->ptr;
 
-	return;
+	if (p->ptr == s)
+		return NULL;
+
+	name = malloc((p->ptr - s) + 1);
+	if (!name)
+		return NULL;
+
+	memcpy(name, s, (p->ptr - s));
+	name[p->ptr - s] = 0;
+
+	return name;
 }
 
 static void
-__dtor xml_fini(void)
+skip_space(struct xml_parser *p)
 {
-	if (NULL != buffer)
-	{
-		free(buffer);
-		buffer = NULL;
-	}
+	while (p->ptr < p->end && isspace((unsigned char)*p->ptr))
+		++p->ptr;
 
 	return;
 }
 
-/**
- * Read the XML file into BUFFER
+/*
+ * <tagname attribute1="value1" attribute2='value2'>
+ *          ^
+ * Leaves P->PTR at the '>' or "/>".
  */
 static int
-setup(char *path)
+parse_attributes(struct xml_parser *p, xml_node_t *node)
 {
-	struct stat statb;
-	int fd = -1;
+	attribute_t *attribs;
+	char *name;
+	char *value;
+	const char *s;
+	const char *e;
+	char quote;
 
-	memset(&statb, 0, sizeof(statb));
-	if (lstat(path, &statb) < 0)
-		return -1;
+	while (1)
+	{
+		skip_space(p);
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		return -1;
+		if (!AT(p) || AT(p) == ETAG || AT(p) == SLASH)
+			return 0;
 
-	buffer = calloc(ALIGN16(statb.st_size+1), 1);
-	if (!buffer)
-		return -1;
+		if (!(name = parse_name(p)))
+			return -1;
 
-	size_t toread = statb.st_size;
-	ssize_t n;
-	char *p = buffer;
+		skip_space(p);
 
-	while (toread > 0 && (n = read(fd, p, toread)))
-	{
-		if (toread < 0)
-			goto fail;
+		if (AT(p) != ASSIGN)
+			goto fail_free_name;
 
-		p += n;
-		toread -= n;
-	}
+		++p->ptr;
+		skip_space(p);
 
-	*p = 0;
+		quote = AT(p);
+		if (quote != DQUOTE && quote != SQUOTE)
+			goto fail_free_name;
 
-	ptr = buffer;
-	end = buffer + statb.st_size;
+		s = ++p->ptr;
+		e = memchr(s, quote, LEFT(p));
+		if (!e)
+			goto fail_free_name;
 
-	return 0;
+		p->ptr = (e + 1);
 
-fail:
-	if (buffer)
-		free(buffer);
+	/*
+	 * When streaming, nobody sees attributes.
+	 */
+		if (!node)
+		{
+			free(name);
+			continue;
+		}
 
-	return -1;
-}
+		value = malloc((e - s) + 1);
+		if (!value)
+			goto fail_free_name;
 
-static void
-free_token_array(char **tokens)
-{
-	if (NULL == tokens)
-		return;
+		value[decode_text(value, s, (e - s))] = 0;
 
-	int i = 0;
-	while (NULL != tokens[i])
-	{
-		free(tokens[i++]);
+		attribs = realloc(node->attributes, ((node->nr_attributes + 1) * sizeof(attribute_t)));
+		if (!attribs)
+		{
+			free(value);
+			goto fail_free_name;
+		}
+
+		node->attributes = attribs;
+		node->attributes[node->nr_attributes].name = name;
+		node->attributes[node->nr_attributes].value = value;
+		++node->nr_attributes;
 	}
 
-	return;
+fail_free_name:
+
+	free(name);
+
+	return -1;
 }
 
 /**
  * Turn a query such as \"plants/rose/price\"
  * into { "plants", "rose", "price" }
  */
-char **
+static char **
 tokenize_query(char *query)
 {
 	char **tokens = NULL;
-	char *t = NULL;
+	char **t;
+	char *tok;
+	char *state = NULL;
 	int n = 0;
 
-	tokens = calloc(1, sizeof(char *));
-	if (!tokens)
-		goto fail;
-
-	t = strtok(query, "/");
-	if (!t)
-		goto fail;
-
-	tokens[n] = calloc(strlen(t), 1);
-	strcpy(tokens[n++], t);
-
-	while (1)
+	for (tok = strtok_r(query, "/", &state); tok; tok = strtok_r(NULL, "/", &state))
 	{
-		t = strtok(NULL, "/");
+		t = realloc(tokens, (sizeof(char *) * (n+2)));
 		if (!t)
-			break;
-
-		tokens = realloc(tokens, (sizeof(char *) * (n+1)));
-		if (!tokens)
 			goto fail;
 
-		tokens[n] = calloc(strlen(t), 1);
-		strcpy(tokens[n++], t);
+		tokens = t;
+		tokens[n++] = tok;
+		tokens[n] = NULL;
 	}
 
-	tokens = realloc(tokens, (sizeof(char *) * (n+1)));
-	if (!tokens)
-		goto fail;
-
-	tokens[n] = NULL;
-
 	return tokens;
 
 fail:
-	free_token_array(tokens);
+	free(tokens);
 
 	return NULL;
 }
@@ -398,65 +438,6 @@ fail:
 #define NVALUE(n) ((n)->value)
 #define NNAME(n) ((n)->name)
 
-#define NSET_VALUE(n,v) ((n)->value = strdup((v)))
-
-#define STACK_MAX_DEPTH 256
-static node_ptr node_stack[STACK_MAX_DEPTH];
-static char *stack[STACK_MAX_DEPTH];
-static int pnode_idx = 0;
-static int stack_idx = 0;
-
-#define CLEAR_STACK() memset(stack, 0, sizeof(char *) * STACK_MAX_DEPTH)
-
-/*
- * The following macros are only used in
- * do_parse(), so we can safely have the
- * return statement in here.
- */
-#define PUSH_TAG(t) \
-do { \
-	if (stack_idx >= STACK_MAX_DEPTH) \
-	{ \
-		error("tag stack overflow"); \
-		return -1; \
-	} \
-	stack[stack_idx++] = strdup((t)); \
-	Debug(":::Stack Depth::: => %d\n", stack_idx); \
-} while (0)
-
-#define POP_TAG() \
-({ \
-	if (!stack_idx) \
-	{ \
-		error("tag stack underflow"); \
-		return -1; \
-	} \
-	Debug(":::Stack Depth::: => %d\n", stack_idx-1); \
-	stack[--stack_idx]; \
-})
-
-#define PUSH_PARENT(p) \
-do { \
-	if (pnode_idx >= STACK_MAX_DEPTH) \
-	{ \
-		error("node stack overflow"); \
-		return -1; \
-	} \
-	node_stack[pnode_idx++] = (p); \
-} while (0)
-
-#define POP_PARENT() \
-({ \
-	if (!pnode_idx) \
-	{ \
-		error("node stack underflow"); \
-		return -1; \
-	} \
-	node_stack[--pnode_idx]; \
-})
-
-#define CLEAR_NODE_STACK() memset(node_stack, 0, sizeof(node_ptr) * STACK_MAX_DEPTH)
-
 static node_ptr
 new_node(void)
 {
@@ -473,19 +454,23 @@ new_node(void)
  * parent's array of xml_node_t
  * pointers.
  */
-static void
+static int
 add_child(node_ptr parent, node_ptr child)
 {
 	assert(parent);
 	assert(child);
 
-	parent->children = realloc(parent->children, sizeof(node_ptr) * (NCH(parent) + 1));
-	assert(parent->children);
+	node_ptr *children;
+
+	children = realloc(parent->children, sizeof(node_ptr) * (NCH(parent) + 1));
+	if (!children)
+		return -1;
 
+	parent->children = children;
 	CHILD(parent, NCH(parent)) = child;
 	++NCH(parent);
 
-	return;
+	return 0;
 }
 
 static int indent = 1;
@@ -545,63 +530,50 @@ XML_walk_tree(struct XML *xml)
 static void
 do_free_tree(node_ptr root)
 {
-	if (!NCH(root))
-	{
-		return;
-	}
-
 	node_ptr n;
 	int i;
+	int j;
 
 	for (i = 0; i < NCH(root); ++i)
 	{
 		n = CHILD(root, i);
 
-		if (NCH(n))
-			do_free_tree(n);
-
-		if (NULL != NNAME(n))
-		{
-			//Debug("Freeing node name %s\n", NNAME(n));
-			free(NNAME(n));
-		}
+		do_free_tree(n);
 
-		if (NULL != NVALUE(n))
-		{
-			//Debug("Freeing node value %s\n", NVALUE(n));
-			free(NVALUE(n));
-		}
+		free(NNAME(n));
+		free(NVALUE(n));
 
-		if (NULL != n->attributes)
+		for (j = 0; j < n->nr_attributes; ++j)
 		{
-			int j;
-
-			for (j = 0; j < n->nr_attributes; ++j)
-			{
-				free(n->attributes[j].name);
-				free(n->attributes[j].value);
-			}
+			free(n->attributes[j].name);
+			free(n->attributes[j].value);
 		}
 
-		//Debug("Freeing node\n");
+		free(n->attributes);
 		free(n);
 	}
 
+	free(root->children);
+
 	return;
 }
 
 void
 XML_free(struct XML *xml)
 {
-	if (NULL == xml || NULL == xml->root)
+	if (NULL == xml)
 		return;
 
-	do_free_tree(xml->root);
+	if (NULL != xml->root)
+	{
+		do_free_tree(xml->root);
 
-	Debug("Freeing tree root\n");
+		Debug("Freeing tree root\n");
 
-	free(NVALUE(xml->root)); // the strdup of "XML_ROOT_NODE"
-	free(xml->root);
+		free(NNAME(xml->root));
+		free(NVALUE(xml->root));
+		free(xml->root);
+	}
 
 	Debug("Freeing tree object\n");
 	free(xml);
@@ -630,7 +602,6 @@ XML_find_parent_node_for_value(xml_node_t *root, char *value)
 	int i;
 	node_ptr node = NULL;
 	node_ptr result = NULL;
-	size_t vlen = strlen(value);
 
 	for (i = 0; i < NCH(root); ++i)
 	{
@@ -639,7 +610,7 @@ XML_find_parent_node_for_value(xml_node_t *root, char *value)
 		if (NULL == node->value)
 			goto recur;
 
-		if (!memcmp((void *)value, (void *)node->value, vlen))
+		if (!strcmp(value, node->value))
 			return root;
 
 	recur:
@@ -665,78 +636,42 @@ XML_find_by_path(struct XML *xml, char *path)
 	assert(path);
 	assert(xml->root);
 
-	int inode;
-	int itok;
-	int nch;
 	node_ptr parent = xml->root;
-	node_ptr node;
-	char **tokens = tokenize_query(path);
-	char *tok;
-	size_t tlen;
-
-	assert(tokens);
-
-	nch = NCH(parent);
-	itok = 0;
-	inode = 0;
+	node_ptr node = NULL;
+	char *query = strdup(path);
+	char **tokens = NULL;
+	int itok;
+	int inode;
 
-	if (0 == nch)
+	if (!query || !(tokens = tokenize_query(query)))
 		goto not_found;
 
-	node = CHILD(parent, inode++);
-	tok = tokens[itok++];
-	assert(tok);
-	tlen = strlen(tok);
-
-	while (1)
+	for (itok = 0; tokens[itok]; ++itok)
 	{
-		Debug("Comparing %s with %s\n", tok, node->name);
-		int cmp = memcmp((void *)tok, (void *)node->name, tlen);
-
-		if (!cmp)
+		for (inode = 0; inode < NCH(parent); ++inode)
 		{
-			if (tokens[itok] == NULL) // we're done
-			{
-				goto found;
-			}
-			else
-			{
-				parent = node;
-				nch = NCH(parent);
-				inode = 0;
+			Debug("Comparing %s with %s\n", tokens[itok], NNAME(CHILD(parent, inode)));
 
-				if (0 == nch)
-					goto not_found;
+			if (!strcmp(tokens[itok], NNAME(CHILD(parent, inode))))
+				break;
+		}
 
-				node = FIRST_CHILD(parent);
-				assert(node);
+		if (inode == NCH(parent))
+			goto not_found;
 
-				tok = tokens[itok++];
-				assert(tok);
-				tlen = strlen(tok);
+		node = parent = CHILD(parent, inode);
+	}
 
-				continue;
-			}
-		}
-		else
-		{
-			if (inode == nch)
-				goto not_found;
+	free(tokens);
+	free(query);
 
-			node = CHILD(parent, inode++);
-			assert(node);
-		}
-	}
+	return node;
 
 not_found:
-	free_token_array(tokens);
-	return NULL;
-
-found:
-	free_token_array(tokens);
+	free(tokens);
+	free(query);
 
-	assert(NULL != node);
-	return node;
+	return NULL;
 }
 
 char *
@@ -745,25 +680,15 @@ XML_get_node_value(xml_node_t *root, char *name)
 	assert(root);
 	assert(name);
 
-	int nch = NCH(root);
-
-	if (0 == nch)
-		return NULL;
-
-	node_ptr parent = root;
 	node_ptr node = NULL;
-
-	size_t nlen = strlen(name);
-	int inode = 0;
+	int inode;
 	char *value = NULL;
 
-	while (inode < nch)
+	for (inode = 0; inode < NCH(root); ++inode)
 	{
-		node = CHILD(parent, inode++);
-
-		int cmp = memcmp((void *)name, (void *)node->name, nlen);
+		node = CHILD(root, inode);
 
-		if (!cmp)
+		if (!strcmp(name, node->name))
 			return node->value;
 
 		value = XML_get_node_value(node, name);
@@ -796,400 +721,381 @@ XML_for_each_child(xml_node_t *root, XML_cb_t func)
 	return;
 }
 
-static int
-matches(int tok)
-{
-	return (lookahead == tok);
-}
-
-static void
-advance(void)
-{
-	current = lookahead;
-	lookahead = lex();
-}
-
 /*
- * meta-expr -> '<' '?' target 1(SP attribute '=' DQUOTE value DQUOTE) '?' '>'
- *
- * TODO
- *
- * Correctly extract the information from this.
+ * We're at <tagname...
+ *           ^
+ * Push a new frame for it (and, when building
+ * a tree, add its node to its parent's).
  */
-static void
-meta_expr(void)
+static int
+open_element(struct xml_parser *p)
 {
-	parse_tagname();
-	++ptr; // skip SP
-
-get_expr:
-	parse_tagname(); // parse attribute
-	advance(); // set lookahead to next char (should be '=')
+	struct xml_frame *frame;
+	xml_node_t *parent;
+	xml_node_t *node = NULL;
+	char *name;
 
-	if (!matches(TOK_ASSIGN))
+	if (p->depth >= STACK_MAX_DEPTH)
 	{
-		//fprintf(stderr, "%c <- %c -> %c\n", *(ptr-1), *ptr, *(ptr+1));
-		error("Missing '=' symbol");
-		abort();
+		error("tag stack overflow");
+		return -1;
 	}
 
-	advance();
+	if (!(name = parse_name(p)))
+		return -1;
 
-	if (!matches(TOK_DQUOTE))
+	if (p->xml)
 	{
-		error("Missing '\"' symbol");
-		abort();
-	}
+		parent = (p->depth ? p->frames[p->depth - 1].node : p->xml->root);
 
-	parse_token(); // parses until DQUOTE
-
-	advance();
+		if (!(node = new_node()) || add_child(parent, node) < 0)
+		{
+			free(node);
+			free(name);
+			return -1;
+		}
 
-	if (!matches(TOK_DQUOTE))
-	{
-		error("Missing '\"' symbol");
-		abort();
+		node->name = name;
+		++p->xml->nr_nodes;
 	}
 
-	advance();
-
-	/*
-	 * <?target attribute="value" attribute2="value2"?>
-	 */
-	if (matches(TOK_SPACE))
-		goto get_expr;
+	frame = &p->frames[p->depth++];
+	clear_struct(frame);
 
-	if (!matches(TOK_META))
-	{
-		error("Missing '?' symbol");
-		abort();
-	}
+	frame->name = name;
+	frame->node = node;
 
-	return;
+	return parse_attributes(p, node);
 }
 
-/**
- * Consume the next byte in the buffer
- * (skipping whitespace)
+/*
+ * Pop the frame of the element we're closing,
+ * giving its value to its node or to whoever
+ * we're parsing for.
  */
 static int
-lex(void)
+close_element(struct xml_parser *p)
 {
-	while (iscntrlspace(*ptr)) // skip CR NL TAB
-		++ptr;
+	struct xml_frame *frame = &p->frames[p->depth - 1];
+	char *value = take_value(frame);
+	int rv = 0;
 
-	switch(*ptr)
+	if (p->xml)
 	{
-		case OTAG:
-			++ptr;
-			return TOK_OPEN;
-		case ETAG:
-			++ptr;
-			return TOK_CLOSE;
-		case META:
-			++ptr;
-			return TOK_META;
-		case DQUOTE:
-			++ptr;
-			return TOK_DQUOTE;
-		case ASSIGN:
-			++ptr;
-			return TOK_ASSIGN;
-		case SPACE:
-			++ptr;
-			return TOK_SPACE;
-		case DASH:
-			++ptr;
-			return TOK_DASH;
-		case EXCL:
-			++ptr;
-			return TOK_EXCL;
-		case SLASH:
-			++ptr;
-			return TOK_SLASH;
-		default: // do not consume anything
-
-			return TOK_CHARSEQ;
+		frame->node->value = value;
 	}
+	else
+	{
+		rv = p->element_cb(frame->name, value, p->depth, p->arg);
+		free(frame->name);
+		free(value);
+	}
+
+	--p->depth;
+
+	return rv;
 }
 
 /**
- * Create a tree of nodes representing the
- * structure of the XML file. Each node
- * in the tree represents a <tag>. Tags
- * which have values, such as
- * <tag>tag information</tag> will have
- * this stored in NODE->VALUE, otherwise
- * NODE->VALUE will be %NULL.
- *
- * When we encounter a new opening tag,
- * we push the pointer to the current
- * parent node onto the stack, and the
- * new node representing the new tag
- * becomes the new parent node.
+ * Go through the document between P->PTR and P->END,
+ * building a tree of nodes representing its structure
+ * or, when streaming, calling P->ELEMENT_CB as each
+ * element ends. Each node in the tree represents a
+ * <tag>. Tags which have values, such as
+ * <tag>tag information</tag> will have this stored
+ * in NODE->VALUE, otherwise NODE->VALUE will be %NULL.
  *
- * On encountering a corresponding closing
- * tag, the previous parent is popped
- * off the stack, becoming again the current
- * parent node of newly created nodes.
+ * The elements we're inside of are kept on a stack
+ * of frames; on an opening tag, a frame is pushed
+ * and on its closing tag, popped.
  */
-int
-do_parse(struct XML *xml)
+static int
+do_parse(struct xml_parser *p)
 {
-	assert(xml);
+	const char *s;
+	const char *e;
+	char *closing;
+	int rv = 0;
 
-	node_ptr parent = NULL;
-	node_ptr node = NULL;
+	while (p->ptr < p->end)
+	{
+		if (AT(p) != OTAG)
+		{
+			s = p->ptr;
+			e = memchr(s, OTAG, LEFT(p));
+			p->ptr = (e ? e : p->end);
 
-	xml->root = new_node();
-	node_ptr r = xml->root;
+			if (add_text(p, s, (p->ptr - s), 0) < 0)
+				goto fail;
 
-	r->name = strdup("root");
-	r->value = NULL;
+			continue;
+		}
 
-	parent = r;
+		if (LOOKING_AT(p, "<!--"))
+		{
+			p->ptr += 4;
+			e = find(p, "-->", 3);
+			if (!e)
+				goto fail;
 
-	CLEAR_STACK();
-	CLEAR_NODE_STACK();
+			p->ptr = (e + 3);
+		}
+		else
+		if (LOOKING_AT(p, "<![CDATA["))
+		{
+			p->ptr += 9;
+			e = find(p, "]]>", 3);
+			if (!e)
+				goto fail;
 
-	advance();
+			if (add_text(p, p->ptr, (e - p->ptr), 1) < 0)
+				goto fail;
 
-	while (ptr < end)
-	{
-		switch(lookahead)
+			p->ptr = (e + 3);
+		}
+		else
+		if (LOOKING_AT(p, "<!") || LOOKING_AT(p, "<?"))
+		{
+		/*
+		 * <?xml version="1.0" ?> and <!DOCTYPE ...>
+		 * tell us nothing we need.
+		 */
+			e = memchr(p->ptr, ETAG, LEFT(p));
+			if (!e)
+				goto fail;
+
+			p->ptr = (e + 1);
+		}
+		else
+		if (LOOKING_AT(p, "</"))
 		{
-			case TOK_OPEN:
-
-				/*
-				 * If we are at <tag...
-				 *               ^
-				 * lex() will not advance the pointer
-				 * since we're at an alnum char.
-				 */
-				advance();
-
-				if (matches(TOK_EXCL)) // comment - <!-- ... -->
-				{
-					advance();
-					assert(matches(TOK_DASH));
-
-					advance();
-					assert(matches(TOK_DASH));
-
-					ptr = memchr(ptr, '>', end - ptr);
-					assert(ptr);
-
-					advance();
-					assert(matches(TOK_CLOSE));
-
-					advance();
-
-					continue;
-				}
-				else
-				if (matches(TOK_META))
-				{
-					//pr("opening meta tag");
-					meta_expr();
-					break;
-				}
-				else
-				if (matches(TOK_SLASH))
-				{
-					parse_tagname();
-					char *last_opened = POP_TAG();
-
-					if (!last_opened)
-					{
-						error("Unexpected closing tag");
-						return -1;
-					}
-
-					if (memcmp(last_opened, terminal, strlen(terminal)))
-					{
-						fprintf(stderr, "Open/close tag mismatch (<%s> & </%s>)\n",
-							last_opened, terminal);
-						return -1;
-					}
-
-					free(last_opened);
-
-					parent = POP_PARENT();
-					//Debug("Popped parent - at %p\n", parent);
-
-					break;
-				}
-
-				parse_tagname();
-
-				node = new_node();
-				node->name = strdup(terminal);
-				node->value = NULL;
-
-				add_child(parent, node);
-
-				advance();
-
-				if (matches(TOK_SPACE)) // <tagname( attrib="value")+>
-				{
-					node->attributes = parse_attributes(&node->nr_attributes);
-					//assert(matches(TOK_CLOSE));
-				}
-
-				if (matches(TOK_SLASH))
-				{
-					advance();
-					assert(matches(TOK_CLOSE));
-				}
-				else
-				{
-					PUSH_TAG(terminal);
-					PUSH_PARENT(parent);
-
-					parent = LAST_CHILD(parent);
-				}
-
-				Debug("Adding child node to node @ %p\n", parent);
-
-				advance();
-
-				if (matches(TOK_CHARSEQ))
-				{
-					parse_token();
-					node->value = strdup(token);
-				}
-				else
-					continue;
+			p->ptr += 2;
 
-				break;
+			if (!(closing = parse_name(p)))
+				goto fail;
 
-			case TOK_META:
+			if (!p->depth || strcmp(closing, p->frames[p->depth - 1].name))
+			{
+				fprintf(stderr, "Open/close tag mismatch (<%s> & </%s>)\n",
+					p->depth ? p->frames[p->depth - 1].name : "", closing);
+				free(closing);
+				goto fail;
+			}
 
-				//pr("meta symbol");
-				break;
+			free(closing);
 
-/*
-			case TOK_CHARSEQ:
+			skip_space(p);
+			if (AT(p) != ETAG)
+				goto fail;
 
-				parse_token();
+			++p->ptr;
 
-				node = new_node();
+			if ((rv = close_element(p)) != 0)
+				goto out;
+		}
+		else
+		{
+			++p->ptr;
 
-				NSET_VALUE(node, token);
-				NSET_TYPE(node, XML_TYPE_VALUE);
+			if (open_element(p) < 0)
+				goto fail;
 
-				Debug("Adding value node to parent @ %p\n", parent);
-				add_child(parent, node);
-				//pr("character sequence");
+			if (AT(p) == SLASH)
+			{
+				++p->ptr;
+				if (AT(p) != ETAG)
+					goto fail;
 
-				break;
-*/
+				++p->ptr;
 
-			default:
-					;
-				//pr("unknown...");
+				if ((rv = close_element(p)) != 0)
+					goto out;
+			}
+			else
+			if (AT(p) == ETAG)
+			{
+				++p->ptr;
+			}
+			else
+			{
+				goto fail;
+			}
 		}
+	}
 
-		advance();
+	if (p->depth)
+	{
+		error("unexpected end of document");
+		goto fail;
 	}
 
 	return 0;
+
+fail:
+
+	rv = -1;
+
+out:
+
+/*
+ * When building a tree, the nodes of unclosed
+ * elements are in the tree and freed with it.
+ */
+	while (p->depth)
+	{
+		--p->depth;
+
+		free(p->frames[p->depth].value);
+
+		if (!p->xml)
+			free(p->frames[p->depth].name);
+	}
+
+	return (rv < 0 ? -1 : rv);
 }
 
-//#define XML_VERSION_PATTERN "<?xml version=\"[^\"]*\"\\( [a-zA-Z]*=\"[^\"]*\"\\)*?>"
+/**
+ * Parse the LEN bytes of XML at BUFFER into a tree.
+ */
 int
-XML_parse_file(struct XML *xml, char *path)
+XML_parse_buffer(struct XML *xml, const char *buffer, size_t len)
 {
 	assert(xml);
-	assert(path);
+	assert(buffer);
+
+	struct xml_parser *p;
+	int rv;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -1;
 
-	if (access(path, F_OK) != 0)
+	if (!xml->root)
 	{
-		perror("access");
-		goto fail;
+		xml->root = new_node();
+		if (!xml->root)
+			goto fail;
+
+		xml->root->name = strdup("root");
 	}
 
-	if (setup(path) < 0)
-		goto fail;
+	p->ptr = buffer;
+	p->end = (buffer + len);
+	p->xml = xml;
 
-	//if (!str_find(buffer, XML_VERSION_PATTERN))
-	//{
-	//	fprintf(stderr, "Not an XML file\n");
-	//	goto fail;
-	//}
+	rv = do_parse(p);
 
-	if (do_parse(xml) != 0)
-		goto fail;
+	free(p);
 
-	return 0;
+	return rv;
 
 fail:
+	free(p);
+
 	return -1;
 }
 
-struct XML *
-XML_new(void)
+/**
+ * Parse the LEN bytes of XML at BUFFER without building
+ * a tree, calling CB with the name and value of each
+ * element (and how deep it is, the outermost being at
+ * depth 1) as it ends. Values are freed once CB returns.
+ * If CB returns non-zero, we stop and return that.
+ */
+int
+XML_parse_stream(const char *buffer, size_t len, XML_element_cb_t cb, void *arg)
 {
-	struct XML *xml = malloc(sizeof(struct XML));
+	assert(buffer);
+	assert(cb);
 
-	if (NULL == xml)
-		return NULL;
+	struct xml_parser *p;
+	int rv;
 
-	memset(xml, 0, sizeof(*xml));
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -1;
 
-	return xml;
+	p->ptr = buffer;
+	p->end = (buffer + len);
+	p->element_cb = cb;
+	p->arg = arg;
+
+	rv = do_parse(p);
+
+	free(p);
+
+	return rv;
 }
 
-/*
 int
-main(int argc, char *argv[])
+XML_parse_file(struct XML *xml, char *path)
 {
-	if (setup(argv[1]) < 0) // argv[1] has xml filename
+	assert(xml);
+	assert(path);
+
+	struct stat statb;
+	char *buffer = NULL;
+	char *b;
+	size_t toread;
+	ssize_t n;
+	int fd = -1;
+	int rv;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+	{
+		perror("open");
 		goto fail;
+	}
 
-	struct XML *xml = XML_new();
+	if (fstat(fd, &statb) < 0)
+		goto fail;
 
-	if (0 != xml->parse(xml, argv[1]))
+	buffer = malloc(statb.st_size + 1);
+	if (!buffer)
 		goto fail;
 
-	char *query = strdup("project/dependencies");
-	node_ptr p = xml->find(xml, query);
+	toread = statb.st_size;
+	b = buffer;
 
-	if (p)
+	while (toread > 0)
 	{
-		int j;
-		node_ptr n;
+		n = read(fd, b, toread);
+		if (n <= 0)
+			goto fail;
 
-		for (j = 0; j < NCH(p); ++j)
-		{
-			n = CHILD(p, j);
-			char *group = XML_get_node_value(n, "groupId");
-			char *artifact = XML_get_node_value(n, "artifactId");
-			char *version = XML_get_node_value(n, "version");
-			char *scope = XML_get_node_value(n, "scope");
-
-			fprintf(stderr,
-				"Dependency #%d:\n\n"
-				"Group ID: %s\n"
-				"Artifact ID: %s\n"
-				"Version: %s\n"
-				"Scope: %s\n\n\n",
-				j + 1,
-				group ? group : "N/A",
-				artifact ? artifact : "N/A",
-				version ? version : "N/A",
-				scope ? scope : "N/A"
-			);
-		}
+		b += n;
+		toread -= n;
 	}
 
-	free(query);
+	*b = 0;
 
-	xml->walk_tree(xml);
-	xml->free_tree(xml);
+	close(fd);
+	fd = -1;
+
+	rv = XML_parse_buffer(xml, buffer, (b - buffer));
+
+	free(buffer);
+
+	return rv;
 
-	return 0;
 fail:
+	if (fd != -1)
+		close(fd);
+
+	free(buffer);
+
 	return -1;
 }
-*/
+
+struct XML *
+XML_new(void)
+{
+	struct XML *xml = malloc(sizeof(struct XML));
+
+	if (NULL == xml)
+		return NULL;
+
+	memset(xml, 0, sizeof(*xml));
+
+	return xml;
+}